@@ -0,0 +1,130 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <chrono>
+#include <string>
+#include <fstream>
+
+#include <libQuestMR/QuestVideoMngr.h>
+#include <libQuestMR/QuestStreamSimulator.h>
+
+using namespace libQuestMR;
+
+const char *profileNames[] = {"default", "low_latency", "throughput"};
+
+void printLatency(const char *name, const QuestLatencyStats& latencyStats)
+{
+    printf("    %s : p50 %.2lf ms, p95 %.2lf ms, p99 %.2lf ms, max %.2lf ms\n", name, latencyStats.p50Ms, latencyStats.p95Ms, latencyStats.p99Ms, latencyStats.maxMs);
+}
+
+//decode the whole recording as fast as possible
+void runOffline(const std::string& videoFilename, int profile, int nbThreads)
+{
+    std::shared_ptr<QuestVideoMngr> mngr = createQuestVideoMngr();
+    std::shared_ptr<QuestVideoSourceFile> videoSrc = createQuestVideoSourceFile();
+    videoSrc->open(videoFilename.c_str());
+    mngr->setDecoderProfile(profile, nbThreads);
+    mngr->attachSource(videoSrc);
+
+    auto start = std::chrono::steady_clock::now();
+    while(videoSrc->isValid())
+        mngr->VideoTickImpl();
+    double duration = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+    QuestVideoMngrStats stats;
+    mngr->getStats(&stats);
+    QuestLatencyStats latencyStats;
+    mngr->getStageLatencyStats(QUEST_FRAME_STAGE_RECEIVE_FRAME, &latencyStats);
+    printf("%s, offline : %.1lf fps\n", profileNames[profile], stats.nbDecodedVideoFrames / duration);
+    printLatency("send_packet -> receive_frame", latencyStats);
+}
+
+//same with the parse/decode/convert pipeline, no frame dropped
+void runOfflinePipeline(const std::string& videoFilename, int profile, int nbThreads)
+{
+    std::shared_ptr<QuestVideoMngr> mngr = createQuestVideoMngr();
+    std::shared_ptr<QuestVideoSourceFile> videoSrc = createQuestVideoSourceFile();
+    videoSrc->open(videoFilename.c_str());
+    mngr->setDecoderProfile(profile, nbThreads);
+    mngr->attachSource(videoSrc);
+
+    auto start = std::chrono::steady_clock::now();
+    mngr->startPipeline(QUEST_PIPELINE_BLOCK);
+    while(mngr->waitForNewImg(1000))
+        ;
+    double duration = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    mngr->detachSource();
+
+    QuestVideoMngrStats stats;
+    mngr->getStats(&stats);
+    printf("%s, offline pipeline : %.1lf fps\n", profileNames[profile], stats.nbDecodedVideoFrames / duration);
+}
+
+//live stream replayed by the simulator at the recorded speed
+void runLive(uint32_t port, int profile, int nbThreads, int maxDurationSec)
+{
+    std::shared_ptr<QuestVideoSourceBufferedSocket> videoSrc = createQuestVideoSourceBufferedSocket();
+    if(!videoSrc->Connect("127.0.0.1", port)) {
+        printf("can not connect to the simulator\n");
+        return;
+    }
+    std::shared_ptr<QuestVideoMngr> mngr = createQuestVideoMngr();
+    mngr->setDecoderProfile(profile, nbThreads);
+    mngr->attachSource(videoSrc);
+
+    auto start = std::chrono::steady_clock::now();
+    while(videoSrc->isValid() && std::chrono::steady_clock::now() - start < std::chrono::seconds(maxDurationSec))
+    {
+        if(mngr->waitForNewImg(100))
+        {
+            int frameId;
+            mngr->getMostRecentImg(NULL, &frameId);
+            mngr->notifyFrameConsumed(frameId);
+        }
+    }
+    double duration = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    mngr->detachSource();
+
+    QuestVideoMngrStats stats;
+    mngr->getStats(&stats);
+    QuestLatencyStats latencyStats;
+    printf("%s, live : %.1lf fps\n", profileNames[profile], stats.nbDecodedVideoFrames / duration);
+    mngr->getStageLatencyStats(QUEST_FRAME_STAGE_RECEIVE_FRAME, &latencyStats);
+    printLatency("send_packet -> receive_frame", latencyStats);
+    mngr->getTotalLatencyStats(&latencyStats);
+    printLatency("total", latencyStats);
+}
+
+int main(int argc, char** argv)
+{
+    if(argc < 2) {
+		printf("usage: demo-benchmarkDecoder recording_without_ext (nbThreads) (liveDurationSec) (port)\n");
+		printf("compares the decoder profiles, offline (as fast as possible, with and without the pipeline) and live (replayed with QuestStreamSimulator)\n");
+		return 0;
+	}
+    std::string videoFilename = std::string(argv[1]) + ".questMRVideo";
+    std::string timestampFilename = std::string(argv[1]) + "_questTimestamp.txt";
+    int nbThreads = argc > 2 ? atoi(argv[2]) : 0;
+    int liveDurationSec = argc > 3 ? atoi(argv[3]) : 20;
+    uint32_t port = argc > 4 ? atoi(argv[4]) : 29000;
+
+    for(int profile = QUEST_DECODER_PROFILE_DEFAULT; profile <= QUEST_DECODER_PROFILE_THROUGHPUT; profile++)
+    {
+        runOffline(videoFilename, profile, nbThreads);
+        runOfflinePipeline(videoFilename, profile, nbThreads);
+    }
+
+    std::shared_ptr<QuestStreamSimulator> simulator = createQuestStreamSimulator();
+    bool hasTimestamps = std::ifstream(timestampFilename).good();
+    if(!hasTimestamps) {
+        printf("no timestamp file, skipping the live benchmark\n");
+        return 0;
+    }
+    if(!simulator->load(videoFilename.c_str(), timestampFilename.c_str()) || !simulator->start(port)) {
+        printf("can not start the simulator\n");
+        return 0;
+    }
+    for(int profile = QUEST_DECODER_PROFILE_DEFAULT; profile <= QUEST_DECODER_PROFILE_THROUGHPUT; profile++)
+        runLive(port, profile, nbThreads, liveDurationSec);
+    simulator->stop();
+    return 0;
+}
@@ -0,0 +1,344 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <thread>
+#include <chrono>
+#include <vector>
+#include <string>
+#include <fstream>
+#include <mutex>
+
+#ifndef _WIN32
+#include <unistd.h>
+#include <sys/wait.h>
+#endif
+
+#include <libQuestMR/QuestStreamHub.h>
+#include <libQuestMR/QuestStreamSimulator.h>
+
+using namespace libQuestMR;
+
+//current resident memory of the process in MB, 0 if unknown
+double getResidentMemoryMB()
+{
+#ifdef __linux__
+    long nbPages = 0, nbResidentPages = 0;
+    FILE *file = fopen("/proc/self/statm", "r");
+    if(file == NULL)
+        return 0;
+    int nbRead = fscanf(file, "%ld %ld", &nbPages, &nbResidentPages);
+    fclose(file);
+    if(nbRead != 2)
+        return 0;
+    return nbResidentPages * (double)sysconf(_SC_PAGESIZE) / (1024.0*1024.0);
+#else
+    return 0;
+#endif
+}
+
+//peak of the resident memory during one run, above the memory at its start :
+//the peak of the process (getrusage) only grows from one run to the next
+class MemoryPeak
+{
+public:
+    MemoryPeak()
+    {
+        baselineMB = getResidentMemoryMB();
+        peakMB = baselineMB;
+    }
+
+    void sample()
+    {
+        peakMB = std::max(peakMB, getResidentMemoryMB());
+    }
+
+    double getPeakAboveBaselineMB() const
+    {
+        return peakMB - baselineMB;
+    }
+
+private:
+    double baselineMB;
+    double peakMB;
+};
+
+//delay between the reception of each video frame and its output, measured by a subscriber
+class FrameLatency
+{
+public:
+    FrameLatency()
+        :nbFrames(0), sumLatencyMs(0)
+    {
+    }
+
+    void add(const QuestStreamEvent& event)
+    {
+        if(event.type != QUEST_STREAM_EVENT_VIDEO)
+            return;
+        uint64_t now = getTimestampMs();
+        uint64_t timestamp = event.videoFrame->getTimestamp();
+        std::lock_guard<std::mutex> lock(mutex);
+        nbFrames++;
+        sumLatencyMs += now > timestamp ? (double)(now - timestamp) : 0.0;
+    }
+
+    double getAvgLatencyMs()
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        return nbFrames > 0 ? sumLatencyMs / nbFrames : 0;
+    }
+
+private:
+    std::mutex mutex;
+    int nbFrames;
+    double sumLatencyMs;
+};
+
+void printStageLatency(std::shared_ptr<QuestVideoMngr> mngr)
+{
+    const char *stageNames[] = {"recv", "parsed", "send_packet", "receive_frame", "converted", "consumer"};
+    for(int stage = QUEST_FRAME_STAGE_PARSED; stage < QUEST_FRAME_STAGE_COUNT; stage++)
+    {
+        QuestLatencyStats latencyStats;
+        mngr->getStageLatencyStats(stage, &latencyStats);
+        printf("    %s -> %s : p50 %.2lf ms, p95 %.2lf ms, p99 %.2lf ms\n", stageNames[stage-1], stageNames[stage], latencyStats.p50Ms, latencyStats.p95Ms, latencyStats.p99Ms);
+    }
+    QuestLatencyStats latencyStats;
+    mngr->getTotalLatencyStats(&latencyStats);
+    printf("    total : p50 %.2lf ms, p95 %.2lf ms, p99 %.2lf ms\n", latencyStats.p50Ms, latencyStats.p95Ms, latencyStats.p99Ms);
+}
+
+//all the streams in a QuestStreamHub
+void runBenchmarkHub(int nbStreams, int nbWorkers, uint32_t port)
+{
+    std::shared_ptr<QuestStreamHub> hub = createQuestStreamHub();
+    std::vector<int> listStreamId;
+    for(int i = 0; i < nbStreams; i++)
+    {
+        int streamId = hub->addStream("127.0.0.1", port);
+        if(streamId >= 0)
+            listStreamId.push_back(streamId);
+    }
+
+    MemoryPeak memoryPeak;
+    auto start = std::chrono::steady_clock::now();
+    hub->start(nbWorkers);
+    for(size_t i = 0; i < listStreamId.size(); i++)
+    {
+        QuestStreamStats stats;
+        while(hub->getStreamStats(listStreamId[i], &stats) && stats.connected)
+        {
+            if(hub->waitForNewImg(listStreamId[i], 100))
+                hub->getMostRecentImg(listStreamId[i]);
+            memoryPeak.sample();
+        }
+    }
+    double duration = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    hub->stop();
+
+    uint64_t totalBytes = 0;
+    int totalFrames = 0;
+    double sumAvgLatencyMs = 0;
+    for(size_t i = 0; i < listStreamId.size(); i++)
+    {
+        QuestStreamStats stats;
+        hub->getStreamStats(listStreamId[i], &stats);
+        totalBytes += stats.bytesReceived;
+        totalFrames += stats.nbDecodedFrames;
+        sumAvgLatencyMs += stats.avgLatencyMs;
+    }
+    printf("hub, %d streams : %.1lf MB/s, %.1lf fps total (%.1lf fps per stream), avg latency %.1lf ms, peak memory +%.0lf MB over the run start\n",
+           (int)listStreamId.size(), totalBytes / duration / (1024*1024), totalFrames / duration,
+           listStreamId.empty() ? 0.0 : totalFrames / duration / listStreamId.size(),
+           listStreamId.empty() ? 0.0 : sumAvgLatencyMs / listStreamId.size(), memoryPeak.getPeakAboveBaselineMB());
+    if(!listStreamId.empty())
+        printStageLatency(hub->getVideoMngr(listStreamId[0]));
+}
+
+//one QuestVideoSourceBufferedSocket + QuestVideoMngr + decoding thread per stream
+void runBenchmarkSocket(int nbStreams, uint32_t port)
+{
+    std::vector<std::shared_ptr<QuestVideoSourceBufferedSocket> > listSource;
+    std::vector<std::shared_ptr<QuestVideoMngr> > listMngr;
+    std::vector<std::shared_ptr<QuestVideoMngrThreadData> > listThreadData;
+    std::vector<std::thread*> listThread;
+    std::vector<FrameLatency> listLatency(nbStreams);
+    for(int i = 0; i < nbStreams; i++)
+    {
+        std::shared_ptr<QuestVideoSourceBufferedSocket> source = createQuestVideoSourceBufferedSocket();
+        source->setUseThread(true, 64*1024*1024);
+        if(!source->Connect("127.0.0.1", port))
+            continue;
+        std::shared_ptr<QuestVideoMngr> mngr = createQuestVideoMngr();
+        mngr->attachSource(source);
+        std::shared_ptr<QuestVideoMngrThreadData> threadData = createQuestVideoMngrThreadData(mngr);
+        FrameLatency *latency = &listLatency[listSource.size()];
+        mngr->subscribe([latency](const QuestStreamEvent& event) { latency->add(event); });
+        listSource.push_back(source);
+        listMngr.push_back(mngr);
+        listThreadData.push_back(threadData);
+    }
+
+    MemoryPeak memoryPeak;
+    auto start = std::chrono::steady_clock::now();
+    for(size_t i = 0; i < listThreadData.size(); i++)
+        listThread.push_back(new std::thread(QuestVideoMngrThreadFunc, listThreadData[i].get()));
+    int totalFrames = 0;
+    double sumAvgLatencyMs = 0;
+    uint64_t totalImgAllocations = 0;
+    for(size_t i = 0; i < listThreadData.size(); i++)
+    {
+        while(listSource[i]->isValid())
+        {
+            if(listThreadData[i]->waitForNewImg(100))
+            {
+                uint64_t timestamp;
+                listThreadData[i]->getMostRecentImg(&timestamp);
+            }
+            memoryPeak.sample();
+        }
+    }
+    double duration = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    for(size_t i = 0; i < listThread.size(); i++)
+    {
+        listThreadData[i]->setFinishedVal(true);
+        listThread[i]->join();
+        delete listThread[i];
+        QuestVideoMngrStats stats;
+        listMngr[i]->getStats(&stats);
+        totalFrames += static_cast<int>(stats.nbDecodedVideoFrames);
+        totalImgAllocations += stats.nbOutputImgAllocations;
+        sumAvgLatencyMs += listLatency[i].getAvgLatencyMs();
+    }
+    printf("socket, %d streams : %.1lf fps total (%.1lf fps per stream), avg latency %.1lf ms, peak memory +%.0lf MB over the run start, %llu output images allocated\n",
+           (int)listSource.size(), totalFrames / duration,
+           listSource.empty() ? 0.0 : totalFrames / duration / listSource.size(),
+           listSource.empty() ? 0.0 : sumAvgLatencyMs / listSource.size(), memoryPeak.getPeakAboveBaselineMB(),
+           static_cast<unsigned long long>(totalImgAllocations));
+    if(!listMngr.empty())
+        printStageLatency(listMngr[0]);
+}
+
+//The simulator runs in a child process where possible, so that its copy of the recording
+//and its sessions are not counted in the memory of the benchmark
+class SimulatorProcess
+{
+public:
+    SimulatorProcess()
+#ifndef _WIN32
+        :pid(-1), controlFd(-1)
+#endif
+    {
+    }
+
+    bool start(const std::string& videoFilename, const std::string& timestampFilename, double speed, uint32_t port)
+    {
+#ifndef _WIN32
+        int readyPipe[2], controlPipe[2];
+        if(pipe(readyPipe) != 0)
+            return false;
+        if(pipe(controlPipe) != 0) {
+            close(readyPipe[0]);
+            close(readyPipe[1]);
+            return false;
+        }
+        fflush(stdout);
+        pid = fork();
+        if(pid == 0)
+        {
+            close(readyPipe[0]);
+            close(controlPipe[1]);
+            char ready = startInProcess(videoFilename, timestampFilename, speed, port) ? 1 : 0;
+            if(write(readyPipe[1], &ready, 1) != 1)
+                ready = 0;
+            //serve until the benchmark closes the pipe (or exits)
+            char dummy;
+            while(ready && read(controlPipe[0], &dummy, 1) > 0)
+                ;
+            if(simulator != NULL)
+                simulator->stop();
+            _exit(0);
+        }
+        close(readyPipe[1]);
+        close(controlPipe[0]);
+        controlFd = controlPipe[1];
+        char ready = 0;
+        bool started = pid > 0 && read(readyPipe[0], &ready, 1) == 1 && ready == 1;
+        close(readyPipe[0]);
+        if(!started)
+            stop();
+        return started;
+#else
+        return startInProcess(videoFilename, timestampFilename, speed, port);
+#endif
+    }
+
+    void stop()
+    {
+#ifndef _WIN32
+        if(controlFd >= 0) {
+            close(controlFd);
+            controlFd = -1;
+        }
+        if(pid > 0) {
+            waitpid(pid, NULL, 0);
+            pid = -1;
+        }
+#else
+        if(simulator != NULL)
+            simulator->stop();
+#endif
+    }
+
+private:
+    bool startInProcess(const std::string& videoFilename, const std::string& timestampFilename, double speed, uint32_t port)
+    {
+        simulator = createQuestStreamSimulator();
+        bool hasTimestamps = std::ifstream(timestampFilename).good();
+        if(!simulator->load(videoFilename.c_str(), hasTimestamps ? timestampFilename.c_str() : NULL)) {
+            printf("can not load %s\n", videoFilename.c_str());
+            return false;
+        }
+        simulator->setSpeed(speed);
+        if(!simulator->start(port)) {
+            printf("can not listen on port %u\n", port);
+            return false;
+        }
+        return true;
+    }
+
+    std::shared_ptr<QuestStreamSimulator> simulator;
+#ifndef _WIN32
+    pid_t pid;
+    int controlFd;//closed to stop the child
+#endif
+};
+
+int main(int argc, char** argv)
+{
+    if(argc < 2) {
+		printf("usage: demo-benchmarkStreamHub recording_without_ext (hub|socket) (speed) (nbWorkers) (port)\n");
+		printf("replays the recording with QuestStreamSimulator to 1, 2, 4 and 8 streams, speed <= 0 : as fast as possible\n");
+		return 0;
+	}
+    std::string videoFilename = std::string(argv[1]) + ".questMRVideo";
+    std::string timestampFilename = std::string(argv[1]) + "_questTimestamp.txt";
+    bool useHub = argc <= 2 || strcmp(argv[2], "socket") != 0;
+    double speed = argc > 3 ? atof(argv[3]) : 0;
+    int nbWorkers = argc > 4 ? atoi(argv[4]) : 0;
+    uint32_t port = argc > 5 ? atoi(argv[5]) : 29000;
+
+    SimulatorProcess simulator;
+    if(!simulator.start(videoFilename, timestampFilename, speed, port))
+        return 0;
+
+    const int listNbStreams[] = {1, 2, 4, 8};
+    for(int i = 0; i < 4; i++)
+    {
+        if(useHub)
+            runBenchmarkHub(listNbStreams[i], nbWorkers, port);
+        else runBenchmarkSocket(listNbStreams[i], port);
+    }
+    simulator.stop();
+    return 0;
+}
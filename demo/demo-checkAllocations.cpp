@@ -0,0 +1,204 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <dlfcn.h>
+#include <execinfo.h>
+#include <atomic>
+#include <string>
+
+#include <libQuestMR/QuestVideoMngr.h>
+
+using namespace libQuestMR;
+
+//The allocation functions are replaced to count the heap allocations made while decoding a recording in steady state.
+//The allocations made by libQuestMR (or by the loop below) must be 0, the ones made inside the FFmpeg decoding calls
+//(decoder references, decoder threads) are only reported.
+
+extern "C" {
+void *__libc_malloc(size_t size);
+void *__libc_calloc(size_t nmemb, size_t size);
+void *__libc_realloc(void *ptr, size_t size);
+void *__libc_memalign(size_t alignment, size_t size);
+}
+
+static std::atomic<bool> counting(false);
+static std::atomic<uint64_t> nbAllocations(0);
+static std::atomic<uint64_t> nbDecoderAllocations(0);
+static thread_local bool inAllocationHook = false;
+
+//stacks of the first allocations of libQuestMR, printed at the end
+const int maxReportedStacks = 4;
+const int maxStackDepth = 32;
+static void *reportedStacks[maxReportedStacks][maxStackDepth];
+static int reportedStackDepth[maxReportedStacks];
+
+static void *questMRBase = NULL;
+static void *executableBase = NULL;
+
+//functions called by libQuestMR whose internal allocations belong to FFmpeg
+static const char *decoderFunctions[] = {"avcodec_send_packet", "avcodec_receive_frame", "avcodec_flush_buffers", "sws_scale", NULL};
+
+static bool isFFmpegLibrary(const char *filename)
+{
+    return filename != NULL && (strstr(filename, "libav") != NULL || strstr(filename, "libsw") != NULL);
+}
+
+static bool isDecoderFunction(const char *name)
+{
+    for(int i = 0; name != NULL && decoderFunctions[i] != NULL; i++) {
+        if(strcmp(name, decoderFunctions[i]) == 0)
+            return true;
+    }
+    return false;
+}
+
+//the innermost frame of libQuestMR (or of this demo) is the one responsible for the allocation,
+//unless it is inside one of the decoderFunctions it called
+static void __attribute__((noinline)) countAllocation()
+{
+    if(!counting || inAllocationHook)
+        return;
+    inAllocationHook = true;
+    void *stack[maxStackDepth];
+    int depth = backtrace(stack, maxStackDepth);
+    //0 : countAllocation, 1 : malloc
+    const int firstCaller = 2;
+    bool fromQuestMR = false;
+    bool inDecoder = false;
+    Dl_info callee;
+    bool hasCallee = false;
+    for(int i = firstCaller; i < depth; i++)
+    {
+        Dl_info info;
+        if(dladdr(stack[i], &info) == 0)
+            continue;
+        if(info.dli_fbase == questMRBase || info.dli_fbase == executableBase) {
+            fromQuestMR = true;
+            inDecoder = hasCallee && isFFmpegLibrary(callee.dli_fname) && isDecoderFunction(callee.dli_sname);
+            break;
+        }
+        callee = info;
+        hasCallee = true;
+    }
+    if(fromQuestMR && !inDecoder) {
+        uint64_t id = nbAllocations++;
+        if(id < maxReportedStacks) {
+            memcpy(reportedStacks[id], stack, depth * sizeof(void*));
+            reportedStackDepth[id] = depth;
+        }
+    } else {
+        //also the decoder threads, without frame of libQuestMR
+        nbDecoderAllocations++;
+    }
+    inAllocationHook = false;
+}
+
+extern "C" {
+void *malloc(size_t size) noexcept
+{
+    countAllocation();
+    return __libc_malloc(size);
+}
+
+void *calloc(size_t nmemb, size_t size) noexcept
+{
+    countAllocation();
+    return __libc_calloc(nmemb, size);
+}
+
+void *realloc(void *ptr, size_t size) noexcept
+{
+    countAllocation();
+    return __libc_realloc(ptr, size);
+}
+
+void *memalign(size_t alignment, size_t size) noexcept
+{
+    countAllocation();
+    return __libc_memalign(alignment, size);
+}
+
+void *aligned_alloc(size_t alignment, size_t size) noexcept
+{
+    countAllocation();
+    return __libc_memalign(alignment, size);
+}
+
+int posix_memalign(void **memptr, size_t alignment, size_t size) noexcept
+{
+    if(alignment % sizeof(void*) != 0 || (alignment & (alignment - 1)) != 0)
+        return EINVAL;
+    countAllocation();
+    void *ptr = __libc_memalign(alignment, size);
+    if(ptr == NULL)
+        return ENOMEM;
+    *memptr = ptr;
+    return 0;
+}
+}
+
+int main(int argc, char** argv)
+{
+    if(argc < 2) {
+		printf("usage: demo-checkAllocations recording_without_ext (nbWarmupFrames) (nbCheckedFrames)\n");
+		printf("decodes the recording and fails if libQuestMR allocates memory once the nbWarmupFrames first frames are decoded\n");
+		return 0;
+	}
+    std::string videoFilename = std::string(argv[1]) + ".questMRVideo";
+    uint64_t nbWarmupFrames = argc > 2 ? atoi(argv[2]) : 300;
+    uint64_t nbCheckedFrames = argc > 3 ? atoi(argv[3]) : 300;
+
+    Dl_info info;
+    if(dladdr(reinterpret_cast<void*>(&createQuestVideoMngrRawPtr), &info) != 0)
+        questMRBase = info.dli_fbase;
+    if(dladdr(reinterpret_cast<void*>(&countAllocation), &info) != 0)
+        executableBase = info.dli_fbase;
+    //the first call of backtrace loads the unwinder
+    void *stack[1];
+    backtrace(stack, 1);
+
+    std::shared_ptr<QuestVideoMngr> mngr = createQuestVideoMngr();
+    std::shared_ptr<QuestVideoSourceFile> videoSrc = createQuestVideoSourceFile();
+    videoSrc->open(videoFilename.c_str());
+    mngr->setAudioRingSize(48000);
+    mngr->attachSource(videoSrc);
+    //all the outputs : subscription, BGR image, YUV frame, audio list and audio ring
+    int subscriptionId = mngr->subscribe([](const QuestStreamEvent& event) {});
+    float audio[2 * 1024];
+
+    QuestVideoMngrStats stats;
+    uint64_t nbFrames = 0;
+    uint64_t firstCheckedFrame = nbWarmupFrames;
+    uint64_t lastCheckedFrame = nbWarmupFrames + nbCheckedFrames;
+    while(videoSrc->isValid() && nbFrames < lastCheckedFrame)
+    {
+        counting = nbFrames >= firstCheckedFrame;
+        mngr->VideoTickImpl();
+        int frameId;
+        mngr->getMostRecentImg(NULL, &frameId);
+        mngr->notifyFrameConsumed(frameId);
+        std::shared_ptr<QuestYUVFrame> frame = mngr->getMostRecentFrameYUV();
+        QuestAudioData **listAudioData;
+        mngr->getMostRecentAudio(&listAudioData);
+        while(mngr->readAudio(audio, 1024) > 0)
+            ;
+        mngr->getStats(&stats);
+        nbFrames = stats.nbDecodedVideoFrames;
+    }
+    counting = false;
+    mngr->unsubscribe(subscriptionId);
+
+    if(nbFrames < lastCheckedFrame) {
+        printf("the recording is too short : %llu frames, %llu needed\n", (unsigned long long)nbFrames, (unsigned long long)lastCheckedFrame);
+        return 1;
+    }
+    printf("%llu frames checked : %llu allocations by libQuestMR, %llu inside the decoder\n", (unsigned long long)nbCheckedFrames, (unsigned long long)nbAllocations.load(), (unsigned long long)nbDecoderAllocations.load());
+    for(int i = 0; i < maxReportedStacks && i < (int)nbAllocations; i++) {
+        printf("allocation %d :\n", i);
+        fflush(stdout);
+        backtrace_symbols_fd(reportedStacks[i], reportedStackDepth[i], STDOUT_FILENO);
+    }
+    return nbAllocations > 0 ? 1 : 0;
+}
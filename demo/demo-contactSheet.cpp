@@ -0,0 +1,67 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <chrono>
+#include <vector>
+
+#include <libQuestMR/QuestVideoMngr.h>
+
+using namespace libQuestMR;
+
+//add the image frameId to the thumbnails if it is new
+void addThumbnail(std::shared_ptr<QuestVideoMngr> mngr, int *lastFrameId, int thumbnailWidth, std::vector<cv::Mat>& thumbnails)
+{
+    int frameId;
+    cv::Mat img = mngr->getMostRecentImg(NULL, &frameId);
+    if(img.empty() || frameId == *lastFrameId)
+        return;
+    *lastFrameId = frameId;
+    cv::Mat thumbnail;
+    cv::resize(img, thumbnail, cv::Size(thumbnailWidth, img.rows * thumbnailWidth / img.cols), 0, 0, cv::INTER_AREA);
+    thumbnails.push_back(thumbnail);
+}
+
+int main(int argc, char** argv)
+{
+    if(argc < 3) {
+		printf("usage: demo-contactSheet recording.questMRVideo output.jpg (nbColumns) (thumbnailWidth)\n");
+		printf("decodes the keyframes only and writes them in a grid\n");
+		return 0;
+	}
+    int nbColumns = argc > 3 ? atoi(argv[3]) : 8;
+    int thumbnailWidth = argc > 4 ? atoi(argv[4]) : 240;
+
+    std::shared_ptr<QuestVideoMngr> mngr = createQuestVideoMngr();
+    std::shared_ptr<QuestVideoSourceFile> videoSrc = createQuestVideoSourceFile();
+    videoSrc->open(argv[1]);
+    mngr->setDecodeMode(QUEST_DECODE_MODE_KEYFRAMES);
+    mngr->attachSource(videoSrc);
+
+    auto start = std::chrono::steady_clock::now();
+    std::vector<cv::Mat> thumbnails;
+    int lastFrameId = 0;
+    while(videoSrc->isValid())
+    {
+        mngr->VideoTickImpl();
+        addThumbnail(mngr, &lastFrameId, thumbnailWidth, thumbnails);
+    }
+    //the last keyframe is output when the decoder is flushed at the end of the file
+    addThumbnail(mngr, &lastFrameId, thumbnailWidth, thumbnails);
+    double duration = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+    QuestVideoMngrStats stats;
+    mngr->getStats(&stats);
+    printf("%d keyframes, %llu frames skipped, %.2lf s\n", (int)thumbnails.size(), (unsigned long long)stats.nbSkippedVideoFrames, duration);
+    if(thumbnails.empty())
+        return 0;
+
+    int nbRows = ((int)thumbnails.size() + nbColumns - 1) / nbColumns;
+    cv::Mat sheet = cv::Mat::zeros(nbRows * thumbnails[0].rows, nbColumns * thumbnailWidth, CV_8UC3);
+    for(size_t i = 0; i < thumbnails.size(); i++)
+    {
+        cv::Rect rect((i % nbColumns) * thumbnailWidth, (i / nbColumns) * thumbnails[0].rows, thumbnails[i].cols, thumbnails[i].rows);
+        rect &= cv::Rect(0, 0, sheet.cols, sheet.rows);
+        thumbnails[i](cv::Rect(0, 0, rect.width, rect.height)).copyTo(sheet(rect));
+    }
+    cv::imwrite(argv[2], sheet);
+    return 0;
+}
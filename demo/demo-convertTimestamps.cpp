@@ -0,0 +1,36 @@
+#include <stdio.h>
+#include <string.h>
+#include <string>
+
+#include <libQuestMR/QuestTimestampIndex.h>
+
+using namespace libQuestMR;
+
+//Build the binary index (_questTimestamp.idx) of a recorded timestamp file,
+//so the recording opens without parsing and rectifying the timestamps
+int main(int argc, char **argv)
+{
+    if(argc < 2)
+    {
+        printf("usage : %s timestampFile [indexFile] [--no-rectify]\n", argv[0]);
+        return 0;
+    }
+    bool rectify = true;
+    std::string indexFilename;
+    for(int i = 2; i < argc; i++)
+    {
+        if(!strcmp(argv[i], "--no-rectify"))
+            rectify = false;
+        else indexFilename = argv[i];
+    }
+    if(indexFilename.empty())
+        indexFilename = getQuestTimestampIndexFilename(argv[1]);
+
+    if(!convertQuestTimestampFile(argv[1], indexFilename.c_str(), rectify))
+    {
+        printf("can not convert %s\n", argv[1]);
+        return -1;
+    }
+    printf("index saved to %s\n", indexFilename.c_str());
+    return 0;
+}
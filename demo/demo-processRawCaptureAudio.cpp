@@ -1,7 +1,9 @@
 #include <stdio.h>
 #include <thread>
+#include <atomic>
 
 #include <libQuestMR/QuestVideoMngr.h>
+#include <libQuestMR/QuestAudioConverter.h>
 #include <libQuestMR/QuestVideoTimestampRectifier.h>
 #include <libQuestMR/BackgroundSubtractor.h>
 #include <RPCameraInterface/ImageFormatConverter.h>
@@ -32,76 +34,95 @@ void processRawCaptureAudio(const char *recordName)
 
 	bool firstFrame = true;
 	uint64_t last_timestamp = 0;
-	int last_frameId = -1;
 
-	std::vector<float> remainingAudio;
-	double accAudioLength = 0;
+	//the encoder takes stereo float at 48 kHz, by blocks of 1024 frames
+	std::shared_ptr<QuestAudioConverter> audioConverter = createQuestAudioConverter();
+	if(!audioConverter->init(48000, 2, QUEST_AUDIO_SAMPLE_FORMAT_FLOAT, 1024)) {
+		printf("can not init the audio converter\n");
+		return ;
+	}
 
-	double firstTimestamp = -1;
+	//every frame and audio packet, in order
+	int subscriptionId = mngr->subscribeQueue(QUEST_SUBSCRIPTION_ALL, 256);
+	std::vector<std::shared_ptr<QuestAudioData> > audioBeforeFirstFrame;
+	bool stop = false;
 
-	while(videoSrc->isValid())
-	{
-		cv::Mat questImg;
-		uint64_t quest_timestamp;
-		int frameId = last_frameId;
-		while(frameId == last_frameId && videoSrc->isValid()) {
+	//decoded on another thread : it waits while the queue is full, until this thread reads it
+	std::atomic<bool> stopDecoding(false);
+	std::atomic<bool> decodingFinished(false);
+	std::thread decodingThread([&]() {
+		while(!stopDecoding && videoSrc->isValid())
 			mngr->VideoTickImpl();
-			questImg = mngr->getMostRecentImg(&quest_timestamp, &frameId);
-		}
-		if(!videoSrc->isValid())
-			break;
-		QuestAudioData **listAudioData;
-		int nbAudioFrames = mngr->getMostRecentAudio(&listAudioData);
-		if(questImg.empty())
-			continue;
+		decodingFinished = true;
+	});
 
-		if(!firstFrame && quest_timestamp <= last_timestamp) {
-			printf("skip frame, frame %d %d, timestamp %llu %llu\n", last_frameId, frameId, (unsigned long long)last_timestamp, (unsigned long long)quest_timestamp);
-			last_frameId = frameId;
-			continue;
+	while(!stop)
+	{
+		QuestStreamEvent event;
+		cv::Mat img;
+		bool hasEvent = false;
+		while(!hasEvent)
+		{
+			//read before waiting : everything published before the end is already in the queue
+			bool finished = decodingFinished;
+			hasEvent = mngr->waitEvent(subscriptionId, &event, 100);
+			if(finished)
+				break;
 		}
-
-		cv::Mat img = questImg(cv::Rect(0,0,questImg.cols/2,questImg.rows)).clone();
-
-		cv::imshow("img", img);
-
-		if(firstFrame)
-			videoEncoder->open("testResultWithAudio.mp4", img.rows, img.cols, 30, "", bitrate);
-		for(int i = 0; i < nbAudioFrames; i++) {
-			std::vector<float> audioData = remainingAudio;
-			remainingAudio.clear();
-			int size = listAudioData[i]->getDataLength() / sizeof(float);
-			const float *data = (const float*)listAudioData[i]->getData();
-			uint32_t sampleRate = listAudioData[i]->getSampleRate();
-			int nbChannels = listAudioData[i]->getNbChannels();
-			int nbSamples = (size*48000/sampleRate)/nbChannels;
-			if(nbChannels == 1) {
-				for(int j = 0; j < 2*nbSamples; j++)
-					audioData.push_back(data[(j/2)*sampleRate/48000]);
-			} else if(sampleRate != 48000) {
-				for(int j = 0; j < nbSamples; j++) {
-					audioData.push_back(data[(j*sampleRate/48000)*2]);
-					audioData.push_back(data[(j*sampleRate/48000)*2+1]);
-				}
-			} else {
-				for(int j = 0; j < size; j++)
-					audioData.push_back(data[j]);
+		if(!hasEvent)
+			break;//end of the recording
+		if(event.type == QUEST_STREAM_EVENT_AUDIO) {
+			if(firstFrame) {
+				audioBeforeFirstFrame.push_back(event.audioData);
+				continue;
+			}
+		} else {
+			uint64_t quest_timestamp = event.videoFrame->getTimestamp();
+			if(!firstFrame && quest_timestamp <= last_timestamp) {
+				printf("skip frame %d (event %llu), timestamp %llu %llu\n", event.videoFrame->getFrameId(), (unsigned long long)event.sequenceNumber, (unsigned long long)last_timestamp, (unsigned long long)quest_timestamp);
+				continue;
 			}
-			int nbAudioPacket = audioData.size() / 2048;
-			videoEncoder->write_audio(&audioData[0], nbAudioPacket * 2048, listAudioData[i]->getLocalTimestamp());
-			audioData.erase(audioData.begin(), audioData.begin() + nbAudioPacket * 2048);
-			accAudioLength += static_cast<double>(size)*1000/(2*48000);
-			remainingAudio = audioData;
+			//background layer only, converted directly from the decoded frame
+			mngr->convertLayers(*event.videoFrame, &img, NULL, NULL);
+			cv::imshow("img", img);
+
+			if(firstFrame)
+				videoEncoder->open("testResultWithAudio.mp4", img.rows, img.cols, 30, "", bitrate);
 		}
-		videoEncoder->write(createImageDataFromMat(img, quest_timestamp, false));
+
+		std::vector<std::shared_ptr<QuestAudioData> > listAudioData;
+		if(event.type == QUEST_STREAM_EVENT_AUDIO)
+			listAudioData.push_back(event.audioData);
+		else if(firstFrame)
+			listAudioData.swap(audioBeforeFirstFrame);
+		for(size_t i = 0; i < listAudioData.size(); i++)
+			audioConverter->addAudio(*listAudioData[i]);
+		const void *audioBlock;
+		uint64_t audioTimestamp;
+		while((audioBlock = audioConverter->getBlock(&audioTimestamp)) != NULL)
+			videoEncoder->write_audio((float*)audioBlock, 2 * audioConverter->getBlockSize(), audioTimestamp);
+		if(event.type != QUEST_STREAM_EVENT_VIDEO)
+			continue;
+		videoEncoder->write(createImageDataFromMat(img, event.videoFrame->getTimestamp(), false));
 
 		int key = cv::waitKey(10);
 		if(key > 0)
-			break;
+			stop = true;
 		firstFrame = false;
-		last_timestamp = quest_timestamp;
-		last_frameId = frameId;
+		last_timestamp = event.videoFrame->getTimestamp();
     }
+	//also wakes up the decoding thread if it waits for the queue
+	stopDecoding = true;
+	mngr->unsubscribe(subscriptionId);
+	decodingThread.join();
+	if(!firstFrame) {
+		//the end of the audio, completed with silence
+		audioConverter->flush();
+		const void *audioBlock;
+		uint64_t audioTimestamp;
+		while((audioBlock = audioConverter->getBlock(&audioTimestamp)) != NULL)
+			videoEncoder->write_audio((float*)audioBlock, 2 * audioConverter->getBlockSize(), audioTimestamp);
+	}
 	printf("release\n");
 	videoEncoder->release();
 }
@@ -0,0 +1,50 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <thread>
+#include <chrono>
+#include <string>
+#include <fstream>
+
+#include <libQuestMR/QuestStreamSimulator.h>
+
+using namespace libQuestMR;
+
+int main(int argc, char** argv)
+{
+    if(argc < 2) {
+		printf("usage: questmr-sim recording_without_ext (port) (speed) (loop) (maxSessions)\n");
+		printf("serves recording_without_ext.questMRVideo, paced with recording_without_ext_questTimestamp.txt if it exists\n");
+		printf("speed <= 0 : as fast as possible, loop : 0 or 1, maxSessions : 0 for no limit\n");
+		return 0;
+	}
+    std::string videoFilename = std::string(argv[1]) + ".questMRVideo";
+    std::string timestampFilename = std::string(argv[1]) + "_questTimestamp.txt";
+    uint32_t port = argc > 2 ? atoi(argv[2]) : OM_DEFAULT_PORT;
+    double speed = argc > 3 ? atof(argv[3]) : 1.0;
+    bool loop = argc > 4 ? atoi(argv[4]) != 0 : false;
+    int maxSessions = argc > 5 ? atoi(argv[5]) : 0;
+
+    std::shared_ptr<QuestStreamSimulator> simulator = createQuestStreamSimulator();
+    bool hasTimestamps = std::ifstream(timestampFilename).good();
+    if(!simulator->load(videoFilename.c_str(), hasTimestamps ? timestampFilename.c_str() : NULL)) {
+        printf("can not load %s\n", videoFilename.c_str());
+        return 0;
+    }
+    simulator->setSpeed(speed);
+    simulator->setLoop(loop);
+    if(!simulator->start(port, true, maxSessions)) {
+        printf("can not listen on port %u\n", port);
+        return 0;
+    }
+    printf("serving %d frames on port %u%s\n", simulator->getNbFrames(), port, hasTimestamps ? "" : " (no timestamp file, not paced)");
+
+    uint64_t lastBytesSent = 0;
+    while(true)
+    {
+        std::this_thread::sleep_for(std::chrono::seconds(1));
+        uint64_t bytesSent = simulator->getBytesSent();
+        printf("%d sessions, %.1lf MB/s\n", simulator->getNbActiveSessions(), (bytesSent - lastBytesSent) / (1024.0*1024.0));
+        lastBytesSent = bytesSent;
+    }
+    return 0;
+}
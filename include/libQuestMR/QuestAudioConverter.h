@@ -0,0 +1,56 @@
+#pragma once
+
+#include <libQuestMR/config.h>
+#include <libQuestMR/QuestVideoMngr.h>
+
+namespace libQuestMR
+{
+
+enum QuestAudioSampleFormat
+{
+	QUEST_AUDIO_SAMPLE_FORMAT_FLOAT = 0,//interleaved float
+	QUEST_AUDIO_SAMPLE_FORMAT_S16,//interleaved signed 16 bits
+};
+
+//Streaming conversion of the Quest audio (float, mono or stereo, at the AUDIO_SAMPLERATE rate) to a fixed format,
+//output in blocks of a fixed number of frames (for audio encoders). Uses swresample, the resampler keeps its state
+//between the packets and the buffers are reused. Not thread-safe.
+class LQMR_EXPORTS QuestAudioConverter
+{
+public:
+	virtual ~QuestAudioConverter();
+
+	//output format : sample rate, number of channels (1 or 2), QuestAudioSampleFormat, number of frames per block.
+	//Returns false if the format is not supported (or without ffmpeg)
+	virtual bool init(uint32_t sampleRate, int nbChannels, int sampleFormat, int blockSize) = 0;
+
+	//Convert a packet. The input format is read from the packet, the resampler is reinitialized if it changes.
+	//timestampMs is the time of the first frame of the packet. The block timestamps are interpolated from the first packet,
+	//and re-anchored on a packet whose timestamp is more than one block away from the interpolated one
+	virtual bool addAudio(const QuestAudioData& audioData) = 0;//getLocalTimestamp() is used as timestamp
+	virtual bool addAudio(const float *data, int nbFrames, int nbChannels, uint32_t sampleRate, uint64_t timestampMs) = 0;
+	//Output the frames still in the resampler, padded with silence to a complete block. Call it at the end of the stream
+	virtual void flush() = 0;
+
+	virtual int getNbBlocks() = 0;//number of complete blocks available
+	//Next complete block (blockSize interleaved frames), NULL if there is none.
+	//Valid until the next call to addAudio() or flush(). timestampMs (can be NULL) gets the time of its first frame
+	virtual const void *getBlock(uint64_t *timestampMs = NULL) = 0;
+	virtual int getBlockSize() = 0;//in frames
+	virtual int getBlockSizeInBytes() = 0;
+
+	virtual void reset() = 0;//discard the buffered audio and the resampler state
+};
+
+extern "C"
+{
+	LQMR_EXPORTS QuestAudioConverter *createQuestAudioConverterRawPtr();
+	LQMR_EXPORTS void deleteQuestAudioConverterRawPtr(QuestAudioConverter *converter);
+}
+
+inline std::shared_ptr<QuestAudioConverter> createQuestAudioConverter()
+{
+	return std::shared_ptr<QuestAudioConverter>(createQuestAudioConverterRawPtr(), deleteQuestAudioConverterRawPtr);
+}
+
+}
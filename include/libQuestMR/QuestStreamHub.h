@@ -0,0 +1,64 @@
+#pragma once
+
+#include <libQuestMR/config.h>
+#include <libQuestMR/QuestVideoMngr.h>
+
+namespace libQuestMR
+{
+
+class LQMR_EXPORTS QuestStreamStats
+{
+public:
+    uint64_t bytesReceived;//total bytes read from the socket
+    int nbDecodedFrames;//number of video frames decoded (QuestVideoMngrStats::nbDecodedVideoFrames)
+    double avgLatencyMs;//average delay between the reception of a video frame and the publication of its image, over all the output frames
+    double maxLatencyMs;
+    bool connected;//false once the connection is closed and the remaining data is processed
+};
+
+//Receives several MRC streams (one per headset) with a single I/O thread,
+//and decodes them with a shared pool of worker threads.
+class LQMR_EXPORTS QuestStreamHub
+{
+public:
+    virtual ~QuestStreamHub();
+
+    //connect to the MRC app of a headset, returns the stream id or -1 if the connection failed
+    //can be called before or after start()
+    virtual int addStream(const char *ipaddr, uint32_t port = OM_DEFAULT_PORT) = 0;
+    virtual void removeStream(int streamId) = 0;
+    virtual int getNbStreams() = 0;
+
+    //start the I/O thread and nbWorkers decoding threads (0 : number of cores)
+    virtual bool start(int nbWorkers = 0) = 0;
+    virtual void stop() = 0;
+
+    //video manager of the stream, driven by the worker threads.
+    //Only use it for configuration (setRecording, setVideoDecoding, setLatencyBudget, setDecoderProfile,...) right after addStream(), before the hub is started,
+    //and for getStats().
+    virtual std::shared_ptr<QuestVideoMngr> getVideoMngr(int streamId) = 0;
+
+#ifdef LIBQUESTMR_USE_OPENCV
+    //Thread-safe function to get the last decoded image of the stream
+    virtual cv::Mat getMostRecentImg(int streamId, uint64_t *timestamp = NULL, int *frameId = NULL) = 0;
+#endif
+
+    //Thread-safe function to wait for an image more recent than lastFrameId (-1 : more recent than the current one)
+    //Returns false on timeout (timeoutMs < 0 : no timeout) or if the stream is disconnected
+    virtual bool waitForNewImg(int streamId, int timeoutMs, int lastFrameId = -1) = 0;
+
+    virtual bool getStreamStats(int streamId, QuestStreamStats *stats) = 0;
+};
+
+extern "C"
+{
+    LQMR_EXPORTS QuestStreamHub *createQuestStreamHubRawPtr();
+    LQMR_EXPORTS void deleteQuestStreamHubRawPtr(QuestStreamHub *hub);
+}
+
+inline std::shared_ptr<QuestStreamHub> createQuestStreamHub()
+{
+    return std::shared_ptr<QuestStreamHub>(createQuestStreamHubRawPtr(), deleteQuestStreamHubRawPtr);
+}
+
+}
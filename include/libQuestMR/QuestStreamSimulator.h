@@ -0,0 +1,44 @@
+#pragma once
+
+#include <libQuestMR/config.h>
+#include <libQuestMR/QuestVideoMngr.h>
+
+namespace libQuestMR
+{
+
+//Serves a recorded .questMRVideo over TCP like the MRC app of a headset, to test the live path without a headset.
+//Each client connection gets its own session replaying the recording from the start.
+class LQMR_EXPORTS QuestStreamSimulator
+{
+public:
+    virtual ~QuestStreamSimulator();
+
+    //memory-map the recording (not while running), the frames are paced with the timestamp file if any (NULL : as fast as possible)
+    virtual bool load(const char *videoFilename, const char *timestampFilename = NULL, bool use_rectifyTimestamps = true) = 0;
+    virtual int getNbFrames() = 0;
+
+    //playback speed multiplier (2 : twice faster than recorded), <= 0 to send as fast as possible. Call it before start()
+    virtual void setSpeed(double speed) = 0;
+    //restart from the beginning at the end of the recording instead of closing the connection. Call it before start()
+    virtual void setLoop(bool loop) = 0;
+
+    //listen on the port and start a session for each client (maxSessions simultaneous clients, 0 : no limit)
+    virtual bool start(uint32_t port = OM_DEFAULT_PORT, bool localhostOnly = true, int maxSessions = 0) = 0;
+    virtual void stop() = 0;
+
+    virtual int getNbActiveSessions() = 0;
+    virtual uint64_t getBytesSent() = 0;//total over all the sessions
+};
+
+extern "C"
+{
+    LQMR_EXPORTS QuestStreamSimulator *createQuestStreamSimulatorRawPtr();
+    LQMR_EXPORTS void deleteQuestStreamSimulatorRawPtr(QuestStreamSimulator *simulator);
+}
+
+inline std::shared_ptr<QuestStreamSimulator> createQuestStreamSimulator()
+{
+    return std::shared_ptr<QuestStreamSimulator>(createQuestStreamSimulatorRawPtr(), deleteQuestStreamSimulatorRawPtr);
+}
+
+}
@@ -0,0 +1,89 @@
+#pragma once
+
+#include <libQuestMR/config.h>
+#include <stdint.h>
+#include <memory>
+#include <string>
+#include <vector>
+
+namespace libQuestMR
+{
+
+//Binary index of the frames of a recording, the compact equivalent of the _questTimestamp.txt file (_questTimestamp.idx).
+//Header followed by one fixed-size record per frame, in native byte order (little-endian on all the supported platforms).
+//The rectified timestamps are computed when the index is built, so opening a recording does not run rectifyTimestamps().
+#define QUEST_TIMESTAMP_INDEX_VERSION 2
+
+enum QuestTimestampIndexFlags
+{
+	QUEST_TIMESTAMP_INDEX_RECTIFIED = 1,//the records have a rectified timestamp
+};
+
+enum QuestTimestampRecordFlags
+{
+	QUEST_TIMESTAMP_RECORD_HAS_EXTRA_DATA = 1,//the extra data (audioTimestamp, param0, param1) was recorded
+};
+
+struct QuestTimestampIndexHeader
+{
+	char magic[8];//"QMRTSIDX"
+	uint32_t version;//QUEST_TIMESTAMP_INDEX_VERSION
+	uint32_t recordSize;//sizeof(QuestTimestampRecord)
+	uint64_t nbRecords;
+	uint64_t sourceSize;//size of the timestamp file the index was built from, to detect an outdated index
+	uint32_t flags;//QuestTimestampIndexFlags
+	uint32_t reserved;
+	int64_t sourceMtime;//modification time of the timestamp file the index was built from (s), to detect a rewritten file
+};
+
+struct QuestTimestampRecord
+{
+	uint64_t timestamp;//local timestamp of the frame (ms), as recorded
+	uint64_t rectifiedTimestamp;//if QUEST_TIMESTAMP_INDEX_RECTIFIED
+	uint64_t audioTimestamp;//AUDIO_DATA : timestamp recorded on the device
+	uint32_t type;//payload type (10 : video dimension, 11 : video data, 12 : audio sample rate, 13 : audio data)
+	uint32_t size;//payload size
+	int32_t param0;//AUDIO_DATA : number of channels, AUDIO_SAMPLERATE : sample rate, VIDEO_DIMENSION : width
+	int32_t param1;//AUDIO_DATA : length of the audio data, VIDEO_DIMENSION : height
+	uint32_t flags;//QuestTimestampRecordFlags
+	uint32_t reserved;
+};
+
+//Memory-mapped binary index, the records are not copied
+class LQMR_EXPORTS QuestTimestampIndex
+{
+public:
+	virtual ~QuestTimestampIndex();
+	virtual bool open(const char *filename) = 0;//returns false if the file is missing or not a valid index
+	virtual void close() = 0;
+	virtual int getNbRecords() = 0;
+	virtual const QuestTimestampRecord *getRecords() = 0;//valid until close()
+	virtual bool hasRectifiedTimestamps() = 0;
+	virtual uint64_t getSourceSize() = 0;
+	virtual int64_t getSourceMtime() = 0;
+};
+
+//_questTimestamp.txt -> _questTimestamp.idx (the extension is replaced, or appended if it is not .txt)
+LQMR_EXPORTS std::string getQuestTimestampIndexFilename(const char *timestampFilename);
+
+//Timestamps of all the frames of a recording. filename can be a binary index or a timestamp file :
+//the index next to the timestamp file is used if it is up to date, otherwise it is rebuilt and saved for the next time
+LQMR_EXPORTS bool loadQuestTimestamps(const char *filename, std::vector<uint64_t> *listTimestamp, bool rectified = true);
+
+extern "C"
+{
+	LQMR_EXPORTS QuestTimestampIndex *createQuestTimestampIndexRawPtr();
+	LQMR_EXPORTS void deleteQuestTimestampIndexRawPtr(QuestTimestampIndex *index);
+
+	//Parse a timestamp file into records (without rectified timestamps). Returns false if the file can not be opened
+	LQMR_EXPORTS bool loadQuestTimestampRecords(const char *timestampFilename, std::vector<QuestTimestampRecord> *records);
+	//Build the binary index of a timestamp file, with the rectified timestamps if rectify is true
+	LQMR_EXPORTS bool convertQuestTimestampFile(const char *timestampFilename, const char *indexFilename, bool rectify = true);
+}
+
+inline std::shared_ptr<QuestTimestampIndex> createQuestTimestampIndex()
+{
+	return std::shared_ptr<QuestTimestampIndex>(createQuestTimestampIndexRawPtr(), deleteQuestTimestampIndexRawPtr);
+}
+
+}
@@ -12,6 +12,8 @@ extern "C" {
 #endif
 
 #include <BufferedSocket/BufferedSocket.h>
+#include <functional>
+#include <memory>
 
 #ifdef LIBQUESTMR_USE_OPENCV
 #include <opencv2/opencv.hpp>
@@ -28,12 +30,103 @@ namespace libQuestMR
 
 LQMR_EXPORTS uint64_t getTimestampMs();
 
+//Stages of the video pipeline stamped on each frame (steady clock, in microseconds) for latency tracing
+enum QuestFrameStage
+{
+	QUEST_FRAME_STAGE_RECV = 0,//data read from the socket
+	QUEST_FRAME_STAGE_PARSED,//frame complete in the FrameCollection
+	QUEST_FRAME_STAGE_SEND_PACKET,//sent to the decoder (avcodec_send_packet)
+	QUEST_FRAME_STAGE_RECEIVE_FRAME,//decoded (avcodec_receive_frame)
+	QUEST_FRAME_STAGE_CONVERTED,//output (converted to BGR with the pipeline, otherwise on demand by getMostRecentImg)
+	QUEST_FRAME_STAGE_CONSUMER,//handed to the consumer (notifyFrameConsumed)
+	QUEST_FRAME_STAGE_COUNT
+};
+
+//decoder configuration, see QuestVideoMngr::setDecoderProfile()
+enum QuestDecoderProfile
+{
+	QUEST_DECODER_PROFILE_DEFAULT = 0,//single thread
+	QUEST_DECODER_PROFILE_LOW_LATENCY,//slice threads and low delay, each picture is output as soon as decoded (live)
+	QUEST_DECODER_PROFILE_THROUGHPUT,//frame threads, higher fps but nbThreads-1 frames of delay (offline processing)
+};
+
+//see QuestVideoMngr::setDecodeMode()
+enum QuestDecodeMode
+{
+	QUEST_DECODE_MODE_ALL = 0,//decode all the video frames
+	QUEST_DECODE_MODE_KEYFRAMES,//only decode the keyframes (IDR), much faster than realtime : thumbnails, scrub previews
+};
+
+//what a pipeline stage does when the queue to the next stage is full, see QuestVideoMngr::startPipeline()
+enum QuestPipelinePolicy
+{
+	QUEST_PIPELINE_BLOCK = 0,//wait for the next stage (no frame lost, the source is read more slowly)
+	QUEST_PIPELINE_DROP,//drop the video up to the next keyframe, and only convert the most recent decoded picture (live)
+};
+
+class LQMR_EXPORTS QuestLatencyStats
+{
+public:
+    int nbSamples;//number of frames in the rolling window
+    double p50Ms;
+    double p95Ms;
+    double p99Ms;
+    double maxMs;
+};
+
+//Position and content of a frame in a recording (see QuestVideoSource::getFrameIndex)
+class LQMR_EXPORTS QuestFrameIndexEntry
+{
+public:
+    uint64_t offset;//position of the frame header in the file
+    uint32_t payloadType;//10 : video dimension, 11 : video data, 12 : audio sample rate, 13 : audio data
+    uint32_t payloadLength;
+    bool keyFrame;//video data starting with an IDR picture, the decoding can start from it
+    uint32_t width;//video dimension frames only
+    uint32_t height;//video dimension frames only
+    uint32_t sampleRate;//audio sample rate frames only
+};
+
+//segment of a recording, from the manifest
+class LQMR_EXPORTS QuestRecordingSegment
+{
+public:
+    std::string videoFilename;//with the folder of the manifest
+    std::string timestampFilename;
+    uint64_t firstTimestamp;
+    uint64_t lastTimestamp;
+    int nbFrames;
+    uint64_t size;//bytes
+    bool complete;//false if the recording was interrupted in this segment, the other fields are not known
+};
+
 class LQMR_EXPORTS QuestVideoSource
 {
 public:
 	virtual ~QuestVideoSource();
 	virtual bool isValid() = 0;
 	virtual int recv(char *buf, size_t bufferSize, uint64_t *timestamp) = 0;
+
+	//Zero-copy alternative to recv() for sources that buffer the data internally (see hasRecvSpan()).
+	//Points *data to at most maxSize received bytes, valid until releaseRecvSpan() is called.
+	//recvTimeUs (can be NULL) gets the steady clock time of the reception, in microseconds.
+	//Returns the number of bytes available, 0 if the source is closed, <0 on error.
+	virtual bool hasRecvSpan();
+	virtual int recvSpan(const char **data, size_t maxSize, uint64_t *timestamp, uint64_t *recvTimeUs);
+	virtual void releaseRecvSpan(size_t size);//release the first size bytes obtained by recvSpan()
+	//If not NULL, the spans returned by recvSpan() stay valid as long as this object is alive (memory-mapped file),
+	//so the frames can reference them instead of copying
+	virtual std::shared_ptr<const void> getRecvSpanOwner();
+
+	//Block until recv() can return without waiting, or until timeoutMs elapsed (timeoutMs < 0 : no timeout).
+	//Returns false on timeout or if the source is closed.
+	virtual bool waitForData(int timeoutMs);
+
+	//Random access, only supported by file sources.
+	//Index of all the frames of the stream (built at the first call), NULL if not supported
+	virtual const QuestFrameIndexEntry *getFrameIndex(int *nbFrames);
+	//the next recv() returns the data from the start of frame frameId, returns false if not supported
+	virtual bool seekToFrame(int frameId);
 };
 
 class LQMR_EXPORTS QuestVideoSourceBufferedSocket : public QuestVideoSource
@@ -42,6 +135,7 @@ public:
 	virtual ~QuestVideoSourceBufferedSocket();
 	virtual bool isValid() = 0;
 	virtual int recv(char *buf, size_t bufferSize, uint64_t *timestamp) = 0;
+	//if useThread is true, a receiver thread reads the socket into a ring buffer of maxBufferSize bytes allocated on Connect()
 	virtual void setUseThread(bool useThread, int maxBufferSize) = 0;
 	virtual int getBufferedDataLength() = 0;
 
@@ -56,8 +150,12 @@ public:
 	virtual bool isValid() = 0;
 	virtual int recv(char *buf, size_t bufferSize, uint64_t *timestamp) = 0;
 
-    virtual void open(const char *filename) = 0;
+    //the file is memory-mapped if possible (useMemoryMapping), otherwise read with fread
+    virtual void open(const char *filename, bool useMemoryMapping = true) = 0;
     virtual void close() = 0;
+
+    virtual uint64_t getReadPosition() = 0;//position in the file of the next byte returned by recv()
+    virtual uint64_t getFileSize() = 0;
 };
 
 class LQMR_EXPORTS QuestAudioData
@@ -72,6 +170,79 @@ public:
 	virtual int getDataLength() const = 0;//length (in bytes) of the audio data
 };
 
+//format and timestamps of the audio returned by QuestVideoMngr::readAudio() and peekAudio()
+class LQMR_EXPORTS QuestAudioReadInfo
+{
+public:
+	int nbChannels;
+	uint32_t sampleRate;
+	//timestamps of the audio packet containing the first frame returned, packetFrameOffset frames before it
+	uint64_t localTimestamp;
+	uint64_t deviceTimestamp;
+	int packetFrameOffset;
+};
+
+//Decoded picture in the pixel format of the decoder (planar YUV, usually AV_PIX_FMT_YUV420P).
+//The planes are a reference to the decoder buffers (no copy), valid while the QuestYUVFrame is held. Do not modify them.
+class LQMR_EXPORTS QuestYUVFrame
+{
+public:
+	virtual ~QuestYUVFrame();
+	virtual int getWidth() const = 0;
+	virtual int getHeight() const = 0;
+	virtual int getPixelFormat() const = 0;//AVPixelFormat
+	virtual int getNbPlanes() const = 0;
+	virtual const uint8_t *getPlane(int plane) const = 0;
+	virtual int getStride(int plane) const = 0;//bytes between two rows of the plane
+	//true if the picture is upside down compared to getMostRecentImg(),
+	//start from the last row of each plane with a negative stride to get the same orientation
+	virtual bool isFlipped() const = 0;
+	virtual uint64_t getTimestamp() const = 0;//same as getMostRecentImg()
+	virtual int getFrameId() const = 0;//same as getMostRecentImg()
+};
+
+enum QuestStreamEventType
+{
+	QUEST_STREAM_EVENT_VIDEO = 0,//decoded video frame (videoFrame)
+	QUEST_STREAM_EVENT_AUDIO,//audio packet (audioData)
+};
+
+//policy of a subscription queue, see QuestVideoMngr::subscribeQueue()
+enum QuestSubscriptionPolicy
+{
+	QUEST_SUBSCRIPTION_ALL = 0,//every event, the decoding waits while the queue is full (recording, offline processing), read it from another thread
+	QUEST_SUBSCRIPTION_LATEST,//only the most recent video frame is kept, the oldest audio is dropped when the queue is full (preview)
+};
+
+class LQMR_EXPORTS QuestStreamEvent
+{
+public:
+	int type;//QuestStreamEventType
+	uint64_t sequenceNumber;//+1 for each event published by the mngr (video and audio) : a gap means that events were dropped
+	std::shared_ptr<QuestYUVFrame> videoFrame;
+	std::shared_ptr<QuestAudioData> audioData;
+};
+
+class LQMR_EXPORTS QuestVideoMngrStats
+{
+public:
+    uint64_t nbDecodedVideoFrames;//number of video frames sent to the decoder
+    uint64_t nbDroppedVideoFrames;//number of video frames dropped while waiting for a keyframe (latency budget or resync)
+    uint64_t nbCatchUps;//number of times the latency budget was exceeded
+    uint64_t nbResyncs;//number of times corrupted data was skipped to find the next frame header
+    uint64_t nbResyncSkippedBytes;//total number of bytes skipped by the resyncs
+    uint64_t nbPacketCopies;//number of video payloads copied to be decoded (the others are decoded in place)
+    uint64_t nbOutputImgAllocations;//number of output images allocated (the others reuse a released one)
+    uint64_t nbPipelineDrops;//number of video frames or pictures dropped by the pipeline (QUEST_PIPELINE_DROP)
+    uint64_t nbSkippedVideoFrames;//number of non-keyframes skipped (QUEST_DECODE_MODE_KEYFRAMES)
+    uint64_t nbAudioOverflows;//number of audio packets dropped because the audio ring was full
+    uint64_t nbSubscriptionDrops;//number of events dropped because a QUEST_SUBSCRIPTION_ALL queue stayed full for 2 s
+    uint64_t recordingQueuedBytes;//received but not yet written to the recording
+    uint64_t recordingBytesWritten;
+    double recordingWriteThroughput;//MB/s while writing to the recording file
+    uint64_t nbRecordingStalls;//number of times the reception waited for the disk (all the recording buffers were full)
+};
+
 class LQMR_EXPORTS QuestVideoMngr
 {
 public:
@@ -81,12 +252,59 @@ public:
 
 	virtual bool isRecording() const = 0;//return true if the stream is currently recorded
 	virtual void setRecording(const char *folder, const char *filenameWithoutExt) = 0;//set folder and filename (without extension) for recording 
+	//The recording is written by a thread from nbBuffers buffers of bufferSize bytes (default : 32 x 1 MB),
+	//the reception only waits for the disk if they are all full. directIO : bypass the OS cache (O_DIRECT, Linux only).
+	//Call it before setRecording()
+	virtual void setRecordingBuffers(int nbBuffers, int bufferSize, bool directIO = false) = 0;
+	//Segmented recording for long sessions : a new segment starts at the first keyframe after maxSegmentSize bytes or maxSegmentDurationMs
+	//(0 : no limit), as filenameWithoutExt_0000.questMRVideo + filenameWithoutExt_0000_questTimestamp.txt, ...
+	//Each segment can be played on its own and ends with an index, filenameWithoutExt.questMRManifest lists them (see loadQuestRecordingManifest).
+	//0 for both (default) : a single file. Call it before setRecording()
+	virtual void setRecordingSegments(uint64_t maxSegmentSize, int maxSegmentDurationMs) = 0;
 	virtual void setRecordedTimestampFile(const char *filename, bool use_rectifyTimestamps = true) = 0;//set timestamp file (for playback)
 	virtual void setRecordedTimestamp(const std::vector<uint64_t>& listTimestamp) = 0;//set timestamps (for playback)
-	virtual void setVideoDecoding(bool videoDecoding) = 0;//to disable video decoding (useful if we want to record without preview)
+	//to disable video decoding (useful if we want to record without preview), the audio is still output
+	virtual void setVideoDecoding(bool videoDecoding) = 0;
+	//Live streams only : when a video frame was received more than latencyBudgetMs ago, drop the video up to the next keyframe
+	//(audio and dimension frames are kept). 0 to disable (default), ignored on playback with recorded timestamps
+	virtual void setLatencyBudget(int latencyBudgetMs) = 0;
+	//QuestDecoderProfile and number of threads (0 : number of cores, max 16).
+	//If the decoder is already started (attachSource), it is restarted and the decoding resumes at the next keyframe.
+	//Thread-safe, applied by the next VideoTickImpl(), attachSource() or startPipeline()
+	virtual void setDecoderProfile(int profile, int nbThreads = 0) = 0;
+	//QuestDecodeMode. When switching back to QUEST_DECODE_MODE_ALL, the decoding resumes at the next keyframe.
+	//Thread-safe, applied like setDecoderProfile()
+	virtual void setDecodeMode(int decodeMode) = 0;
+	virtual void getStats(QuestVideoMngrStats *stats) = 0;//thread-safe
+
+	//Latency tracing, thread-safe functions.
+	//Call notifyFrameConsumed() when the image frameId (see getMostRecentImg) is handed to the consumer, to close its trace.
+	virtual void notifyFrameConsumed(int frameId) = 0;
+	//rolling percentiles of the time between the previous stage and the given stage (>= QUEST_FRAME_STAGE_PARSED)
+	virtual bool getStageLatencyStats(int stage, QuestLatencyStats *stats) = 0;
+	//rolling percentiles of the time between the reception of the frame and its consumption
+	virtual void getTotalLatencyStats(QuestLatencyStats *stats) = 0;
 
     virtual void ReceiveData() = 0;
     virtual void VideoTickImpl(bool skipOldFrames = false) = 0;//process the received data
+    //Run the parsing, the decoding and the conversion on 3 threads connected by queues of queueSize frames (QuestPipelinePolicy),
+    //call it after attachSource(). VideoTickImpl() then does nothing, use waitForNewImg() and getMostRecentImg().
+    //The audio is output by the parsing thread. seek() is not available.
+    //Returns false if no decoder is started.
+    virtual bool startPipeline(int policy = QUEST_PIPELINE_DROP, int queueSize = 8) = 0;
+    virtual void stopPipeline() = 0;//also called by detachSource() and attachSource()
+    //block until VideoTickImpl() has something to process. Returns false on timeout,
+    //and at once if no source is attached or its end was processed
+    virtual bool waitForData(int timeoutMs) = 0;
+    //call VideoTickImpl() until a new frame is decoded, returns false on timeout (timeoutMs < 0 : no timeout)
+    //or as soon as no new frame can come (no source attached, or the end of the source was processed)
+    virtual bool waitForNewImg(int timeoutMs) = 0;
+    //block until a source whose end was not processed is attached, returns false on timeout (timeoutMs < 0 : no timeout)
+    virtual bool waitForSource(int timeoutMs) = 0;
+    //Playback with recorded timestamps only : decode the video frame at timestampMs (same time base as getMostRecentImg)
+    //starting from the preceding keyframe. Synchronous, returns false if the source is not seekable.
+    //A file source stays attached at the end of the stream, so seek() also works once the playback reached the end.
+    virtual bool seek(uint64_t timestampMs) = 0;
     virtual void attachSource(std::shared_ptr<QuestVideoSource> videoSource) = 0;//attach the data source (socket, file,...)
     virtual void detachSource() = 0;//detach the data source
 
@@ -95,10 +313,55 @@ public:
 	virtual uint32_t getHeight() = 0;//get img height
 	
 	#ifdef LIBQUESTMR_USE_OPENCV
+    //The image buffer is reused for a next frame once all its references are released : do not modify it, clone it if needed.
+    //Thread-safe. The picture is converted to BGR on the first call for each frame, the frames never asked for are not converted
     virtual cv::Mat getMostRecentImg(uint64_t *timestamp = NULL, int *frameId = NULL) = 0;
 	#endif
+	//Most recent decoded picture without color conversion (NULL if none), thread-safe
+	virtual std::shared_ptr<QuestYUVFrame> getMostRecentFrameYUV() = 0;
+	#ifdef LIBQUESTMR_USE_OPENCV
+	//BGR conversion of any frame (for example from getMostRecentFrameYUV()), same image pool as getMostRecentImg, thread-safe
+	virtual cv::Mat convertImg(const QuestYUVFrame& frame) = 0;
+	#endif
+	#ifdef LIBQUESTMR_USE_OPENCV
+	//Thread-safe : convert the most recent picture to the layers of the mixed reality stream (NULL to skip one),
+	//each one scaled directly to width x height (<= 0 : size of the background, half the stream width).
+	//The Mats are only reallocated if needed, foregroundAlpha is CV_8UC1. Returns false if there is no picture yet.
+	virtual bool getMostRecentLayers(cv::Mat *background, cv::Mat *foreground, cv::Mat *foregroundAlpha, int width = 0, int height = 0, uint64_t *timestamp = NULL, int *frameId = NULL) = 0;
+	//same for any frame (for example from a QuestStreamEvent), thread-safe
+	virtual bool convertLayers(const QuestYUVFrame& frame, cv::Mat *background, cv::Mat *foreground, cv::Mat *foregroundAlpha, int width = 0, int height = 0) = 0;
+	#endif
+
+	//Subscriptions : every decoded video frame and every audio packet is published to the subscribers, in the order of the sequence numbers.
+	//The audio is published as soon as it is received, so it can come before the video frames received earlier but not yet decoded.
+	//The callback is called on the thread calling VideoTickImpl, or on the pipeline parse (audio) and convert (video) threads,
+	//never by two threads at the same time. It must be fast.
+	//Returns the subscription id, thread-safe
+	virtual int subscribe(std::function<void(const QuestStreamEvent&)> callback) = 0;
+	//Queue of maxQueueSize events (QuestSubscriptionPolicy), read with waitEvent(). Returns the subscription id (-1 on error), thread-safe.
+	//With QUEST_SUBSCRIPTION_ALL, the decoding is blocked until the subscriber reads its events or unsubscribes :
+	//read the queue from another thread than the one calling VideoTickImpl. If the queue stays full for 2 s, the event is dropped (nbSubscriptionDrops)
+	virtual int subscribeQueue(int policy, int maxQueueSize = 64) = 0;
+	//pop the oldest event of the queue, returns false on timeout (timeoutMs < 0 : no timeout) or if unsubscribed
+	virtual bool waitEvent(int subscriptionId, QuestStreamEvent *event, int timeoutMs = -1) = 0;
+	virtual void unsubscribe(int subscriptionId) = 0;
+	//The audio received since the previous call (also without video decoding), valid until the next call.
+	//The audio is copied, and only kept while it is called : from the first call (that returns nothing) until 1024 packets
+	//are waiting, the next call then returns nothing again
 	virtual int getMostRecentAudio(QuestAudioData*** listAudioData) = 0;
-	
+
+	//Audio ring : the audio is written to a ring of nbFrames frames of float PCM as soon as it is parsed,
+	//independently of the video frames. 0 to disable (default), call it before attachSource().
+	//When the ring is full, the new packets are dropped (nbAudioOverflows)
+	virtual void setAudioRingSize(int nbFrames) = 0;
+	//Copy up to nbFrames interleaved frames to dst (room for nbFrames * 2 floats, the stream is mono or stereo),
+	//all in the format of info (can be NULL). Returns the number of frames copied.
+	//The audio* functions are thread-safe with the decoding, but must be called by a single reader thread
+	virtual int readAudio(float *dst, int nbFrames, QuestAudioReadInfo *info = NULL) = 0;
+	//Zero-copy read : points *data to the next contiguous frames in the ring and returns their number (0 if empty).
+	//They stay valid until consumeAudio(), which releases the first nbFrames of them
+	virtual int peekAudio(const float **data, QuestAudioReadInfo *info = NULL) = 0;
+	virtual void consumeAudio(int nbFrames) = 0;
 };
 
 class LQMR_EXPORTS QuestVideoMngrThreadData
@@ -117,6 +380,18 @@ public:
 #ifdef LIBQUESTMR_USE_OPENCV
     virtual cv::Mat getMostRecentImg(uint64_t *timestamp, int *frameId = NULL) = 0;
 #endif
+    //Thread-safe, the frame is published by threadFunc() without copy or lock, and stays valid while it is held
+    virtual std::shared_ptr<QuestYUVFrame> getMostRecentFrameYUV() = 0;
+
+    //same as the QuestVideoMngr subscriptions, the callbacks are called by threadFunc()
+    virtual int subscribe(std::function<void(const QuestStreamEvent&)> callback) = 0;
+    virtual int subscribeQueue(int policy, int maxQueueSize = 64) = 0;
+    virtual bool waitEvent(int subscriptionId, QuestStreamEvent *event, int timeoutMs = -1) = 0;
+    virtual void unsubscribe(int subscriptionId) = 0;
+
+    //Thread-safe function to wait for an image more recent than lastFrameId (-1 : more recent than the current one)
+    //Returns false on timeout (timeoutMs < 0 : no timeout) or if the thread is finished
+    virtual bool waitForNewImg(int timeoutMs, int lastFrameId = -1) = 0;
 };
 
 extern "C" 
@@ -131,6 +406,8 @@ extern "C"
 	LQMR_EXPORTS QuestVideoMngrThreadData *createQuestVideoMngrThreadDataRawPtr(std::shared_ptr<QuestVideoMngr> mngr);
 	LQMR_EXPORTS void deleteQuestVideoMngrThreadDataRawPtr(QuestVideoMngrThreadData *threadData);
 	
+	//segments of a segmented recording (.questMRManifest), in order. Returns false if the file is not a manifest of the supported version
+	LQMR_EXPORTS bool loadQuestRecordingManifest(const char *filename, std::vector<QuestRecordingSegment> *segments);
 	LQMR_EXPORTS bool loadQuestRecordedTimestamps(const char *filename, std::vector<uint64_t> *listTimestamp, std::vector<uint32_t> *listType = NULL, std::vector<uint32_t> *listSize = NULL, std::vector<std::vector<std::string> > *listExtraData = NULL);
 
 }
@@ -157,6 +434,8 @@ inline std::shared_ptr<QuestVideoMngrThreadData> createQuestVideoMngrThreadData(
 
 #ifdef LIBQUESTMR_USE_OPENCV
 	LQMR_EXPORTS cv::Mat composeMixedRealityImg(const cv::Mat& questImg, const cv::Mat& camImg, const cv::Mat& camAlpha);
+	//same with the layers from getMostRecentLayers() (same size, single-channel foregroundAlpha), composed in background
+	LQMR_EXPORTS void composeMixedRealityImg(cv::Mat& background, const cv::Mat& foreground, const cv::Mat& foregroundAlpha, const cv::Mat& camImg, const cv::Mat& camAlpha);
 #endif
 
 }
@@ -1,6 +1,7 @@
 #pragma once
 
 #include <libQuestMR/config.h>
+#include <libQuestMR/QuestTimestampIndex.h>
 
 namespace libQuestMR
 {
@@ -10,6 +11,8 @@ LQMR_EXPORTS std::vector<uint64_t> rectifyTimestamps(const std::vector<uint64_t>
 													 const std::vector<uint32_t>& listType, 
 													 const std::vector<uint32_t>& listDataLength, 
 													 const std::vector<std::vector<std::string> >& listExtraData);
+//same from the records of a binary index (or loadQuestTimestampRecords), without parsing the extra data
+LQMR_EXPORTS std::vector<uint64_t> rectifyTimestamps(const QuestTimestampRecord *records, size_t nbRecords);
 
 
 LQMR_EXPORTS void rectifyTimestamps(const char *filename, const char *outputFilename);
@@ -0,0 +1,47 @@
+#pragma once
+
+#include <libQuestMR/QuestVideoMngr.h>
+#include <stdint.h>
+#include <algorithm>
+#include <vector>
+
+namespace libQuestMR
+{
+
+//Rolling window of the last latency samples (in microseconds), not thread-safe
+class LatencyWindow
+{
+public:
+	LatencyWindow(size_t capacity = 1024)
+		:m_samples(capacity), m_nextId(0), m_size(0)
+	{
+	}
+
+	void add(uint64_t latencyUs)
+	{
+		m_samples[m_nextId] = latencyUs;
+		m_nextId = (m_nextId + 1) % m_samples.size();
+		m_size = std::min(m_size + 1, m_samples.size());
+	}
+
+	void getStats(QuestLatencyStats *stats) const
+	{
+		stats->nbSamples = static_cast<int>(m_size);
+		stats->p50Ms = stats->p95Ms = stats->p99Ms = stats->maxMs = 0;
+		if(m_size == 0)
+			return;
+		std::vector<uint64_t> sorted(m_samples.begin(), m_samples.begin() + m_size);
+		std::sort(sorted.begin(), sorted.end());
+		stats->p50Ms = sorted[(m_size - 1) * 50 / 100] / 1000.0;
+		stats->p95Ms = sorted[(m_size - 1) * 95 / 100] / 1000.0;
+		stats->p99Ms = sorted[(m_size - 1) * 99 / 100] / 1000.0;
+		stats->maxMs = sorted[m_size - 1] / 1000.0;
+	}
+
+private:
+	std::vector<uint64_t> m_samples;
+	size_t m_nextId;
+	size_t m_size;
+};
+
+}
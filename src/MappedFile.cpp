@@ -0,0 +1,122 @@
+#include "MappedFile.h"
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+namespace libQuestMR
+{
+
+MappedFile::MappedFile()
+	:m_data(NULL), m_size(0)
+{
+#ifdef _WIN32
+	m_fileHandle = INVALID_HANDLE_VALUE;
+	m_mappingHandle = NULL;
+#endif
+}
+
+MappedFile::~MappedFile()
+{
+	close();
+}
+
+#ifdef _WIN32
+
+bool MappedFile::open(const char *filename)
+{
+	close();
+	HANDLE fileHandle = CreateFileA(filename, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+	if(fileHandle == INVALID_HANDLE_VALUE)
+		return false;
+	LARGE_INTEGER fileSize;
+	if(!GetFileSizeEx(fileHandle, &fileSize) || fileSize.QuadPart == 0 || static_cast<uint64_t>(fileSize.QuadPart) > SIZE_MAX)
+	{
+		CloseHandle(fileHandle);
+		return false;
+	}
+	HANDLE mappingHandle = CreateFileMappingA(fileHandle, NULL, PAGE_READONLY, 0, 0, NULL);
+	if(mappingHandle == NULL)
+	{
+		CloseHandle(fileHandle);
+		return false;
+	}
+	void *data = MapViewOfFile(mappingHandle, FILE_MAP_READ, 0, 0, 0);
+	if(data == NULL)
+	{
+		CloseHandle(mappingHandle);
+		CloseHandle(fileHandle);
+		return false;
+	}
+	m_fileHandle = fileHandle;
+	m_mappingHandle = mappingHandle;
+	m_data = static_cast<const uint8_t*>(data);
+	m_size = static_cast<uint64_t>(fileSize.QuadPart);
+	return true;
+}
+
+void MappedFile::close()
+{
+	if(m_data != NULL)
+		UnmapViewOfFile(m_data);
+	if(m_mappingHandle != NULL)
+		CloseHandle(m_mappingHandle);
+	if(m_fileHandle != INVALID_HANDLE_VALUE)
+		CloseHandle(m_fileHandle);
+	m_data = NULL;
+	m_size = 0;
+	m_mappingHandle = NULL;
+	m_fileHandle = INVALID_HANDLE_VALUE;
+}
+
+void MappedFile::adviseSequential()
+{
+	//FILE_FLAG_SEQUENTIAL_SCAN is set when opening the file
+}
+
+#else
+
+bool MappedFile::open(const char *filename)
+{
+	close();
+	int fd = ::open(filename, O_RDONLY);
+	if(fd < 0)
+		return false;
+	struct stat fileStat;
+	if(fstat(fd, &fileStat) != 0 || fileStat.st_size <= 0 || static_cast<uint64_t>(fileStat.st_size) > SIZE_MAX)
+	{
+		::close(fd);
+		return false;
+	}
+	void *data = mmap(NULL, static_cast<size_t>(fileStat.st_size), PROT_READ, MAP_PRIVATE, fd, 0);
+	//the mapping stays valid after closing the descriptor
+	::close(fd);
+	if(data == MAP_FAILED)
+		return false;
+	m_data = static_cast<const uint8_t*>(data);
+	m_size = static_cast<uint64_t>(fileStat.st_size);
+	return true;
+}
+
+void MappedFile::close()
+{
+	if(m_data != NULL)
+		munmap(const_cast<uint8_t*>(m_data), static_cast<size_t>(m_size));
+	m_data = NULL;
+	m_size = 0;
+}
+
+void MappedFile::adviseSequential()
+{
+	if(m_data != NULL)
+		madvise(const_cast<uint8_t*>(m_data), static_cast<size_t>(m_size), MADV_SEQUENTIAL);
+}
+
+#endif
+
+}
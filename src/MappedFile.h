@@ -0,0 +1,50 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+
+namespace libQuestMR
+{
+
+//Read-only memory mapping of a whole file (mmap on POSIX, file mapping on Windows)
+class MappedFile
+{
+public:
+	MappedFile();
+	~MappedFile();
+
+	//returns false if the file can not be opened or mapped (for example a multi-GB file on a 32-bit system)
+	bool open(const char *filename);
+	void close();
+
+	bool isOpen() const
+	{
+		return m_data != NULL;
+	}
+
+	const uint8_t *data() const
+	{
+		return m_data;
+	}
+
+	uint64_t size() const
+	{
+		return m_size;
+	}
+
+	//hint that the file will be read sequentially from the start, so the OS reads ahead aggressively
+	void adviseSequential();
+
+private:
+	MappedFile(const MappedFile&);
+	MappedFile& operator=(const MappedFile&);
+
+	const uint8_t *m_data;
+	uint64_t m_size;
+#ifdef _WIN32
+	void *m_fileHandle;
+	void *m_mappingHandle;
+#endif
+};
+
+}
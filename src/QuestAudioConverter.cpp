@@ -0,0 +1,305 @@
+#include <libQuestMR/QuestAudioConverter.h>
+#include <string.h>
+#include <math.h>
+#include <vector>
+#include "log.h"
+
+#ifdef LIBQUESTMR_USE_FFMPEG
+extern "C" {
+#include <libswresample/swresample.h>
+#include <libavutil/channel_layout.h>
+#include <libavutil/opt.h>
+}
+#endif
+
+namespace libQuestMR
+{
+
+class QuestAudioConverterImpl : public QuestAudioConverter
+{
+public:
+    QuestAudioConverterImpl();
+    virtual ~QuestAudioConverterImpl();
+
+    virtual bool init(uint32_t sampleRate, int nbChannels, int sampleFormat, int blockSize);
+
+    virtual bool addAudio(const QuestAudioData& audioData);
+    virtual bool addAudio(const float *data, int nbFrames, int nbChannels, uint32_t sampleRate, uint64_t timestampMs);
+    virtual void flush();
+
+    virtual int getNbBlocks();
+    virtual const void *getBlock(uint64_t *timestampMs = NULL);
+    virtual int getBlockSize();
+    virtual int getBlockSizeInBytes();
+
+    virtual void reset();
+
+private:
+#ifdef LIBQUESTMR_USE_FFMPEG
+    bool initResampler(int inNbChannels, uint32_t inSampleRate);
+    void freeResampler();
+    bool convert(const float *data, int nbFrames);
+#endif
+    uint8_t *reserveOutput(int nbFrames);
+
+    uint32_t m_sampleRate = 0;
+    int m_nbChannels = 0;
+    int m_sampleFormat = QUEST_AUDIO_SAMPLE_FORMAT_FLOAT;
+    int m_blockSize = 0;
+    int m_frameSize = 0;//bytes per output frame
+
+    //input format of the resampler
+    int m_inNbChannels = 0;
+    uint32_t m_inSampleRate = 0;
+#ifdef LIBQUESTMR_USE_FFMPEG
+    SwrContext *m_swrContext = NULL;
+#endif
+
+    //converted frames not yet returned, between m_outputStart and m_outputEnd (bytes).
+    //The buffer only grows during the first packets, then the data is moved back to the start
+    std::vector<uint8_t> m_output;
+    size_t m_outputStart = 0;
+    size_t m_outputEnd = 0;
+    double m_outputStartTimeMs = 0;//time of the frame at m_outputStart
+    bool m_hasTimestamp = false;
+};
+
+QuestAudioConverter::~QuestAudioConverter()
+{
+}
+
+QuestAudioConverterImpl::QuestAudioConverterImpl()
+{
+}
+
+QuestAudioConverterImpl::~QuestAudioConverterImpl()
+{
+#ifdef LIBQUESTMR_USE_FFMPEG
+    freeResampler();
+#endif
+}
+
+bool QuestAudioConverterImpl::init(uint32_t sampleRate, int nbChannels, int sampleFormat, int blockSize)
+{
+#ifdef LIBQUESTMR_USE_FFMPEG
+    if (sampleRate == 0 || nbChannels < 1 || nbChannels > 2 || blockSize <= 0
+        || (sampleFormat != QUEST_AUDIO_SAMPLE_FORMAT_FLOAT && sampleFormat != QUEST_AUDIO_SAMPLE_FORMAT_S16))
+    {
+        OM_BLOG(LOG_ERROR, "unsupported audio output format");
+        return false;
+    }
+    m_sampleRate = sampleRate;
+    m_nbChannels = nbChannels;
+    m_sampleFormat = sampleFormat;
+    m_blockSize = blockSize;
+    m_frameSize = nbChannels * (sampleFormat == QUEST_AUDIO_SAMPLE_FORMAT_S16 ? 2 : 4);
+    reset();
+    return true;
+#else
+    OM_BLOG(LOG_ERROR, "QuestAudioConverter requires ffmpeg");
+    return false;
+#endif
+}
+
+bool QuestAudioConverterImpl::addAudio(const QuestAudioData& audioData)
+{
+    int nbChannels = audioData.getNbChannels();
+    if (nbChannels <= 0)
+        return false;
+    int nbFrames = audioData.getDataLength() / (int)sizeof(float) / nbChannels;
+    return addAudio((const float*)audioData.getData(), nbFrames, nbChannels, audioData.getSampleRate(), audioData.getLocalTimestamp());
+}
+
+bool QuestAudioConverterImpl::addAudio(const float *data, int nbFrames, int nbChannels, uint32_t sampleRate, uint64_t timestampMs)
+{
+#ifdef LIBQUESTMR_USE_FFMPEG
+    if (m_blockSize == 0 || nbChannels < 1 || nbChannels > 2 || sampleRate == 0)
+        return false;
+    if (m_swrContext == NULL || nbChannels != m_inNbChannels || sampleRate != m_inSampleRate)
+    {
+        //the frames of the previous format still in the resampler go first
+        if (m_swrContext != NULL)
+            convert(NULL, 0);
+        if (!initResampler(nbChannels, sampleRate))
+            return false;
+    }
+    //the first frame of the packet comes after the output not yet returned and the frames still in the resampler
+    double bufferedFrames = static_cast<double>((m_outputEnd - m_outputStart) / m_frameSize) + static_cast<double>(swr_get_delay(m_swrContext, m_sampleRate));
+    double bufferedMs = bufferedFrames * 1000.0 / m_sampleRate;
+    if (!m_hasTimestamp)
+    {
+        //the following blocks are contiguous
+        m_outputStartTimeMs = static_cast<double>(timestampMs) - bufferedMs;
+        m_hasTimestamp = true;
+    }
+    else
+    {
+        //re-anchored if the packet is more than one block away from its expected time (gap in the audio, clock drift)
+        double driftMs = static_cast<double>(timestampMs) - (m_outputStartTimeMs + bufferedMs);
+        if (fabs(driftMs) > m_blockSize * 1000.0 / m_sampleRate)
+            m_outputStartTimeMs += driftMs;
+    }
+    return convert(data, nbFrames);
+#else
+    return false;
+#endif
+}
+
+void QuestAudioConverterImpl::flush()
+{
+#ifdef LIBQUESTMR_USE_FFMPEG
+    if (m_swrContext != NULL)
+        convert(NULL, 0);
+#endif
+    size_t size = m_outputEnd - m_outputStart;
+    size_t blockBytes = (size_t)m_blockSize * m_frameSize;
+    if (blockBytes > 0 && size % blockBytes != 0)
+    {
+        //silence (0 in float and s16) up to a complete block
+        size_t nbPaddingFrames = (blockBytes - size % blockBytes) / m_frameSize;
+        uint8_t *dst = reserveOutput((int)nbPaddingFrames);
+        memset(dst, 0, nbPaddingFrames * m_frameSize);
+        m_outputEnd += nbPaddingFrames * m_frameSize;
+    }
+}
+
+int QuestAudioConverterImpl::getNbBlocks()
+{
+    if (m_blockSize == 0)
+        return 0;
+    return (int)((m_outputEnd - m_outputStart) / ((size_t)m_blockSize * m_frameSize));
+}
+
+const void *QuestAudioConverterImpl::getBlock(uint64_t *timestampMs)
+{
+    if (getNbBlocks() == 0)
+        return NULL;
+    const uint8_t *block = &m_output[m_outputStart];
+    if (timestampMs != NULL)
+        *timestampMs = static_cast<uint64_t>(m_outputStartTimeMs + 0.5);
+    m_outputStart += (size_t)m_blockSize * m_frameSize;
+    m_outputStartTimeMs += m_blockSize * 1000.0 / m_sampleRate;
+    return block;
+}
+
+int QuestAudioConverterImpl::getBlockSize()
+{
+    return m_blockSize;
+}
+
+int QuestAudioConverterImpl::getBlockSizeInBytes()
+{
+    return m_blockSize * m_frameSize;
+}
+
+void QuestAudioConverterImpl::reset()
+{
+#ifdef LIBQUESTMR_USE_FFMPEG
+    freeResampler();
+#endif
+    m_outputStart = 0;
+    m_outputEnd = 0;
+    m_hasTimestamp = false;
+}
+
+uint8_t *QuestAudioConverterImpl::reserveOutput(int nbFrames)
+{
+    size_t size = (size_t)nbFrames * m_frameSize;
+    if (m_output.size() - m_outputEnd < size)
+    {
+        //the returned blocks are no longer used, move the remaining data to the start
+        if (m_outputStart > 0)
+        {
+            memmove(&m_output[0], &m_output[m_outputStart], m_outputEnd - m_outputStart);
+            m_outputEnd -= m_outputStart;
+            m_outputStart = 0;
+        }
+        if (m_output.size() - m_outputEnd < size)
+            m_output.resize(m_outputEnd + size);
+    }
+    return m_output.data() + m_outputEnd;
+}
+
+#ifdef LIBQUESTMR_USE_FFMPEG
+bool QuestAudioConverterImpl::initResampler(int inNbChannels, uint32_t inSampleRate)
+{
+    freeResampler();
+    m_swrContext = swr_alloc();
+    if (m_swrContext == NULL)
+        return false;
+#if LIBSWRESAMPLE_VERSION_INT >= AV_VERSION_INT(4, 5, 100)
+    AVChannelLayout inLayout, outLayout;
+    av_channel_layout_default(&inLayout, inNbChannels);
+    av_channel_layout_default(&outLayout, m_nbChannels);
+    av_opt_set_chlayout(m_swrContext, "in_chlayout", &inLayout, 0);
+    av_opt_set_chlayout(m_swrContext, "out_chlayout", &outLayout, 0);
+#else
+    av_opt_set_int(m_swrContext, "in_channel_layout", av_get_default_channel_layout(inNbChannels), 0);
+    av_opt_set_int(m_swrContext, "out_channel_layout", av_get_default_channel_layout(m_nbChannels), 0);
+#endif
+    av_opt_set_int(m_swrContext, "in_sample_rate", inSampleRate, 0);
+    av_opt_set_int(m_swrContext, "out_sample_rate", m_sampleRate, 0);
+    av_opt_set_sample_fmt(m_swrContext, "in_sample_fmt", AV_SAMPLE_FMT_FLT, 0);
+    av_opt_set_sample_fmt(m_swrContext, "out_sample_fmt", m_sampleFormat == QUEST_AUDIO_SAMPLE_FORMAT_S16 ? AV_SAMPLE_FMT_S16 : AV_SAMPLE_FMT_FLT, 0);
+    if (inNbChannels == 1 && m_nbChannels == 2)
+    {
+        //copy the mono channel to both FL and FR at full level, instead of the default -3 dB upmix
+        const double matrix[2] = { 1.0, 1.0 };
+        if (swr_set_matrix(m_swrContext, matrix, 1) < 0)
+        {
+            OM_BLOG(LOG_ERROR, "Unable to set the audio upmix matrix");
+            freeResampler();
+            return false;
+        }
+    }
+    if (swr_init(m_swrContext) < 0)
+    {
+        OM_BLOG(LOG_ERROR, "Unable to init the audio resampler");
+        freeResampler();
+        return false;
+    }
+    m_inNbChannels = inNbChannels;
+    m_inSampleRate = inSampleRate;
+    return true;
+}
+
+void QuestAudioConverterImpl::freeResampler()
+{
+    swr_free(&m_swrContext);
+    m_inNbChannels = 0;
+    m_inSampleRate = 0;
+}
+
+//data = NULL : drain the resampler
+bool QuestAudioConverterImpl::convert(const float *data, int nbFrames)
+{
+    int maxOutputFrames = swr_get_out_samples(m_swrContext, nbFrames);
+    if (maxOutputFrames < 0)
+        return false;
+    uint8_t *dst = reserveOutput(maxOutputFrames);
+    const uint8_t *src = (const uint8_t*)data;
+    int nbOutputFrames = swr_convert(m_swrContext, &dst, maxOutputFrames, data != NULL ? &src : NULL, nbFrames);
+    if (nbOutputFrames < 0)
+    {
+        OM_BLOG(LOG_ERROR, "audio resampling failed");
+        return false;
+    }
+    m_outputEnd += (size_t)nbOutputFrames * m_frameSize;
+    return true;
+}
+#endif
+
+extern "C"
+{
+    QuestAudioConverter *createQuestAudioConverterRawPtr()
+    {
+        return new QuestAudioConverterImpl();
+    }
+
+    void deleteQuestAudioConverterRawPtr(QuestAudioConverter *converter)
+    {
+        delete converter;
+    }
+}
+
+}
@@ -0,0 +1,501 @@
+#include <libQuestMR/QuestStreamHub.h>
+#include <thread>
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
+#include <deque>
+#include <map>
+#include "log.h"
+#include "RingBuffer.h"
+#include "frame.h"
+#include "SocketUtil.h"
+
+namespace libQuestMR
+{
+
+//Video source fed by the I/O thread of the hub
+class QuestStreamHubSource : public QuestVideoSource
+{
+public:
+    QuestStreamHubSource(size_t bufferSize)
+    {
+        ring.allocate(bufferSize);
+    }
+
+    virtual ~QuestStreamHubSource()
+    {
+    }
+
+    virtual bool isValid()
+    {
+        return !ring.isClosed() || ring.size() > 0;
+    }
+
+    virtual int recv(char *buf, size_t bufferSize, uint64_t *timestamp)
+    {
+        const char *data;
+        int size = recvSpan(&data, bufferSize, timestamp, NULL);
+        if(size > 0) {
+            memcpy(buf, data, size);
+            releaseRecvSpan(size);
+        }
+        return size;
+    }
+
+    virtual bool hasRecvSpan()
+    {
+        return true;
+    }
+
+    virtual int recvSpan(const char **data, size_t maxSize, uint64_t *timestamp, uint64_t *recvTimeUs)
+    {
+        size_t size = ring.waitForReadSpan(data, timestamp, -1, recvTimeUs);
+        return static_cast<int>(std::min(size, maxSize));
+    }
+
+    virtual void releaseRecvSpan(size_t size)
+    {
+        ring.consume(size);
+    }
+
+    virtual bool waitForData(int timeoutMs)
+    {
+        const char *data;
+        return ring.waitForReadSpan(&data, NULL, timeoutMs) > 0;
+    }
+
+    RecvRingBuffer ring;
+};
+
+class QuestStreamHubStream
+{
+public:
+    QuestStreamHubStream()
+        :sock(INVALID_SOCKET_HANDLE), paused(false), scheduled(false), bytesReceived(0)
+    {
+        mostRecentTimestamp = 0;
+        mostRecentFrameId = -1;
+        nbLatencySamples = 0;
+        sumLatencyMs = 0;
+        maxLatencyMs = 0;
+    }
+
+    int id;
+    SocketHandle sock;
+    std::mutex sockMutex;//held by the I/O thread while reading, and when closing the socket
+    std::atomic<bool> paused;//true when the socket is removed from the poller because the ring is full
+    std::atomic<bool> scheduled;//true when the stream is in the job queue or processed by a worker
+    std::atomic<uint64_t> bytesReceived;
+
+    std::shared_ptr<QuestStreamHubSource> source;
+    std::shared_ptr<QuestVideoMngr> mngr;
+
+    //published image and stats, protected by imgMutex
+    std::mutex imgMutex;
+    std::condition_variable newImgCond;
+    uint64_t mostRecentTimestamp;
+    int mostRecentFrameId;
+    int nbLatencySamples;//one per output frame
+    double sumLatencyMs;
+    double maxLatencyMs;
+};
+
+class QuestStreamHubImpl : public QuestStreamHub
+{
+public:
+    QuestStreamHubImpl();
+    virtual ~QuestStreamHubImpl();
+
+    virtual int addStream(const char *ipaddr, uint32_t port = OM_DEFAULT_PORT);
+    virtual void removeStream(int streamId);
+    virtual int getNbStreams();
+
+    virtual bool start(int nbWorkers = 0);
+    virtual void stop();
+
+    virtual std::shared_ptr<QuestVideoMngr> getVideoMngr(int streamId);
+
+#ifdef LIBQUESTMR_USE_OPENCV
+    virtual cv::Mat getMostRecentImg(int streamId, uint64_t *timestamp = NULL, int *frameId = NULL);
+#endif
+    virtual bool waitForNewImg(int streamId, int timeoutMs, int lastFrameId = -1);
+    virtual bool getStreamStats(int streamId, QuestStreamStats *stats);
+
+private:
+    std::shared_ptr<QuestStreamHubStream> getStream(int streamId);
+    void ioThreadFunc();
+    void workerThreadFunc();
+    void readStream(QuestStreamHubStream& stream);
+    void processStream(QuestStreamHubStream& stream);
+    void schedule(const std::shared_ptr<QuestStreamHubStream>& stream);
+    void resumeIfPossible(QuestStreamHubStream& stream);
+    void closeStreamSocket(QuestStreamHubStream& stream);
+    static void onStreamEvent(QuestStreamHubStream& stream, const QuestStreamEvent& event);
+
+    //size of the receive ring of each stream
+    const size_t streamBufferSize = 16*1024*1024;
+
+    std::mutex streamsMutex;
+    std::map<int, std::shared_ptr<QuestStreamHubStream> > streams;
+    int nextStreamId;
+
+    SocketPoller poller;
+    std::atomic<bool> running;
+    std::thread *ioThread;
+    std::vector<std::thread*> workerThreads;
+
+    std::mutex jobMutex;
+    std::condition_variable jobCond;
+    std::deque<std::shared_ptr<QuestStreamHubStream> > jobQueue;
+};
+
+QuestStreamHub::~QuestStreamHub()
+{
+}
+
+QuestStreamHubImpl::QuestStreamHubImpl()
+{
+    nextStreamId = 0;
+    running = false;
+    ioThread = NULL;
+}
+
+QuestStreamHubImpl::~QuestStreamHubImpl()
+{
+    stop();
+    std::vector<int> listId;
+    {
+        std::lock_guard<std::mutex> lock(streamsMutex);
+        for(auto it = streams.begin(); it != streams.end(); ++it)
+            listId.push_back(it->first);
+    }
+    for(size_t i = 0; i < listId.size(); i++)
+        removeStream(listId[i]);
+}
+
+int QuestStreamHubImpl::addStream(const char *ipaddr, uint32_t port)
+{
+    SocketHandle sock = connectTcpSocket(ipaddr, static_cast<uint16_t>(port));
+    if(sock == INVALID_SOCKET_HANDLE)
+    {
+        OM_BLOG(LOG_ERROR, "Unable to connect to %s:%u", ipaddr, port);
+        return -1;
+    }
+    setSocketNonBlocking(sock, true);
+
+    std::shared_ptr<QuestStreamHubStream> stream = std::make_shared<QuestStreamHubStream>();
+    stream->sock = sock;
+    stream->source = std::make_shared<QuestStreamHubSource>(streamBufferSize);
+    stream->mngr = createQuestVideoMngr();
+    stream->mngr->attachSource(stream->source);
+    //called by the worker for each output frame, VideoTickImpl can output several per call.
+    //The mngr can outlive the stream (getVideoMngr)
+    std::weak_ptr<QuestStreamHubStream> weakStream = stream;
+    stream->mngr->subscribe([weakStream](const QuestStreamEvent& event) {
+        std::shared_ptr<QuestStreamHubStream> stream = weakStream.lock();
+        if(stream != NULL)
+            onStreamEvent(*stream, event);
+    });
+    {
+        std::lock_guard<std::mutex> lock(streamsMutex);
+        stream->id = nextStreamId++;
+        streams[stream->id] = stream;
+    }
+    poller.add(sock, static_cast<uint64_t>(stream->id));
+    return stream->id;
+}
+
+void QuestStreamHubImpl::removeStream(int streamId)
+{
+    std::shared_ptr<QuestStreamHubStream> stream;
+    {
+        std::lock_guard<std::mutex> lock(streamsMutex);
+        auto it = streams.find(streamId);
+        if(it == streams.end())
+            return;
+        stream = it->second;
+        streams.erase(it);
+    }
+    closeStreamSocket(*stream);
+    //the mngr is released by the last worker holding the stream
+}
+
+int QuestStreamHubImpl::getNbStreams()
+{
+    std::lock_guard<std::mutex> lock(streamsMutex);
+    return static_cast<int>(streams.size());
+}
+
+std::shared_ptr<QuestStreamHubStream> QuestStreamHubImpl::getStream(int streamId)
+{
+    std::lock_guard<std::mutex> lock(streamsMutex);
+    auto it = streams.find(streamId);
+    if(it == streams.end())
+        return NULL;
+    return it->second;
+}
+
+bool QuestStreamHubImpl::start(int nbWorkers)
+{
+    if(running)
+        return false;
+    if(nbWorkers <= 0)
+        nbWorkers = std::max(static_cast<int>(std::thread::hardware_concurrency()), 1);
+    running = true;
+    ioThread = new std::thread(&QuestStreamHubImpl::ioThreadFunc, this);
+    for(int i = 0; i < nbWorkers; i++)
+        workerThreads.push_back(new std::thread(&QuestStreamHubImpl::workerThreadFunc, this));
+
+    //data received before start(), or left by the previous stop()
+    std::lock_guard<std::mutex> lock(streamsMutex);
+    for(auto it = streams.begin(); it != streams.end(); ++it)
+    {
+        if(it->second->source->ring.size() > 0)
+            schedule(it->second);
+    }
+    return true;
+}
+
+void QuestStreamHubImpl::stop()
+{
+    if(!running)
+        return;
+    running = false;
+    {
+        std::lock_guard<std::mutex> lock(jobMutex);
+        jobCond.notify_all();
+    }
+    ioThread->join();
+    delete ioThread;
+    ioThread = NULL;
+    for(size_t i = 0; i < workerThreads.size(); i++)
+    {
+        workerThreads[i]->join();
+        delete workerThreads[i];
+    }
+    workerThreads.clear();
+
+    //streams still in the queue are scheduled again by the next start()
+    std::lock_guard<std::mutex> lock(jobMutex);
+    for(size_t i = 0; i < jobQueue.size(); i++)
+        jobQueue[i]->scheduled = false;
+    jobQueue.clear();
+}
+
+void QuestStreamHubImpl::closeStreamSocket(QuestStreamHubStream& stream)
+{
+    std::lock_guard<std::mutex> lock(stream.sockMutex);
+    if(stream.sock == INVALID_SOCKET_HANDLE)
+        return;
+    poller.remove(stream.sock);
+    closeSocket(stream.sock);
+    stream.sock = INVALID_SOCKET_HANDLE;
+    stream.source->ring.close();
+}
+
+void QuestStreamHubImpl::ioThreadFunc()
+{
+    const int maxEvents = 64;
+    uint64_t events[maxEvents];
+    while(running)
+    {
+        //the timeout only bounds the reaction time to stop()
+        int nbEvents = poller.wait(events, maxEvents, 100);
+        for(int i = 0; i < nbEvents; i++)
+        {
+            std::shared_ptr<QuestStreamHubStream> stream = getStream(static_cast<int>(events[i]));
+            if(stream == NULL)
+                continue;
+            readStream(*stream);
+            if(stream->source->ring.size() > 0 || stream->source->ring.isClosed())
+                schedule(stream);
+        }
+    }
+}
+
+void QuestStreamHubImpl::readStream(QuestStreamHubStream& stream)
+{
+    //bound the amount read per wakeup so that one fast stream does not starve the others,
+    //the poller is level-triggered so the rest is read at the next wait()
+    const size_t maxReadPerEvent = 1024*1024;
+    //limit the size of each read so that the timestamps stay accurate
+    const size_t maxReadSize = 256*1024;
+
+    std::lock_guard<std::mutex> lock(stream.sockMutex);
+    if(stream.sock == INVALID_SOCKET_HANDLE)
+        return;
+    RecvRingBuffer& ring = stream.source->ring;
+    size_t totalRead = 0;
+    while(totalRead < maxReadPerEvent)
+    {
+        char *buffer;
+        size_t freeSize = ring.getWriteSpan(&buffer);
+        if(freeSize == 0)
+        {
+            //the decoder is late : stop polling this socket until the workers release some space,
+            //TCP flow control then slows down the headset
+            poller.remove(stream.sock);
+            stream.paused = true;
+            //a worker may have drained the ring before seeing paused
+            resumeIfPossible(stream);
+            return;
+        }
+        int sizeRead = readSocket(stream.sock, buffer, std::min(freeSize, maxReadSize));
+        if(sizeRead == SOCKET_WOULD_BLOCK)
+            return;
+        if(sizeRead <= 0)
+        {
+            OM_BLOG(LOG_INFO, "stream %d : connection closed", stream.id);
+            poller.remove(stream.sock);
+            ring.close();
+            return;
+        }
+        ring.commitWrite(sizeRead, getTimestampMs(), getMonotonicTimeUs());
+        stream.bytesReceived += sizeRead;
+        totalRead += sizeRead;
+    }
+}
+
+void QuestStreamHubImpl::resumeIfPossible(QuestStreamHubStream& stream)
+{
+    RecvRingBuffer& ring = stream.source->ring;
+    if(stream.paused && ring.capacity() - ring.size() > ring.capacity() / 4 && stream.paused.exchange(false))
+        poller.add(stream.sock, static_cast<uint64_t>(stream.id));
+}
+
+void QuestStreamHubImpl::schedule(const std::shared_ptr<QuestStreamHubStream>& stream)
+{
+    //a stream is processed by only one worker at a time
+    if(stream->scheduled.exchange(true))
+        return;
+    std::lock_guard<std::mutex> lock(jobMutex);
+    jobQueue.push_back(stream);
+    jobCond.notify_one();
+}
+
+void QuestStreamHubImpl::workerThreadFunc()
+{
+    while(running)
+    {
+        std::shared_ptr<QuestStreamHubStream> stream;
+        {
+            std::unique_lock<std::mutex> lock(jobMutex);
+            jobCond.wait(lock, [&]() { return !jobQueue.empty() || !running; });
+            if(!running)
+                break;
+            stream = jobQueue.front();
+            jobQueue.pop_front();
+        }
+        processStream(*stream);
+        stream->scheduled = false;
+        //data pushed while we were finishing was not scheduled by the I/O thread
+        if(stream->source->ring.size() > 0)
+            schedule(stream);
+    }
+}
+
+void QuestStreamHubImpl::processStream(QuestStreamHubStream& stream)
+{
+    while(running && stream.source->ring.size() > 0)
+    {
+        stream.mngr->VideoTickImpl(true);
+        {
+            std::lock_guard<std::mutex> lock(stream.sockMutex);
+            if(stream.sock != INVALID_SOCKET_HANDLE)
+                resumeIfPossible(stream);
+        }
+    }
+    //wake up the waiters when the stream ends
+    if(!stream.source->isValid())
+    {
+        std::lock_guard<std::mutex> lock(stream.imgMutex);
+        stream.newImgCond.notify_all();
+    }
+}
+
+void QuestStreamHubImpl::onStreamEvent(QuestStreamHubStream& stream, const QuestStreamEvent& event)
+{
+    if(event.type != QUEST_STREAM_EVENT_VIDEO)
+        return;
+    //the BGR conversion is only done by getMostRecentImg()
+    const QuestYUVFrame& frame = *event.videoFrame;
+    uint64_t now = getTimestampMs();
+    double latencyMs = now > frame.getTimestamp() ? static_cast<double>(now - frame.getTimestamp()) : 0.0;
+    std::lock_guard<std::mutex> lock(stream.imgMutex);
+    stream.mostRecentTimestamp = frame.getTimestamp();
+    stream.mostRecentFrameId = frame.getFrameId();
+    stream.nbLatencySamples++;
+    stream.sumLatencyMs += latencyMs;
+    stream.maxLatencyMs = std::max(stream.maxLatencyMs, latencyMs);
+    stream.newImgCond.notify_all();
+}
+
+std::shared_ptr<QuestVideoMngr> QuestStreamHubImpl::getVideoMngr(int streamId)
+{
+    std::shared_ptr<QuestStreamHubStream> stream = getStream(streamId);
+    if(stream == NULL)
+        return NULL;
+    return stream->mngr;
+}
+
+#ifdef LIBQUESTMR_USE_OPENCV
+cv::Mat QuestStreamHubImpl::getMostRecentImg(int streamId, uint64_t *timestamp, int *frameId)
+{
+    std::shared_ptr<QuestStreamHubStream> stream = getStream(streamId);
+    if(stream == NULL)
+        return cv::Mat();
+    //converted by the mngr on the first call for each frame, the workers only decode
+    int imgFrameId;
+    cv::Mat img = stream->mngr->getMostRecentImg(timestamp, &imgFrameId);
+    if(frameId != NULL)
+        *frameId = imgFrameId;
+    stream->mngr->notifyFrameConsumed(imgFrameId);
+    return img;
+}
+#endif
+
+bool QuestStreamHubImpl::waitForNewImg(int streamId, int timeoutMs, int lastFrameId)
+{
+    std::shared_ptr<QuestStreamHubStream> stream = getStream(streamId);
+    if(stream == NULL)
+        return false;
+    std::unique_lock<std::mutex> lock(stream->imgMutex);
+    if(lastFrameId < 0)
+        lastFrameId = stream->mostRecentFrameId;
+    auto pred = [&]() { return stream->mostRecentFrameId != lastFrameId || !stream->source->isValid(); };
+    if(timeoutMs < 0)
+        stream->newImgCond.wait(lock, pred);
+    else stream->newImgCond.wait_for(lock, std::chrono::milliseconds(timeoutMs), pred);
+    return stream->mostRecentFrameId != lastFrameId;
+}
+
+bool QuestStreamHubImpl::getStreamStats(int streamId, QuestStreamStats *stats)
+{
+    std::shared_ptr<QuestStreamHubStream> stream = getStream(streamId);
+    if(stream == NULL)
+        return false;
+    stats->bytesReceived = stream->bytesReceived;
+    stats->connected = stream->source->isValid();
+    QuestVideoMngrStats mngrStats;
+    stream->mngr->getStats(&mngrStats);
+    stats->nbDecodedFrames = static_cast<int>(mngrStats.nbDecodedVideoFrames);
+    std::lock_guard<std::mutex> lock(stream->imgMutex);
+    stats->avgLatencyMs = stream->nbLatencySamples > 0 ? stream->sumLatencyMs / stream->nbLatencySamples : 0;
+    stats->maxLatencyMs = stream->maxLatencyMs;
+    return true;
+}
+
+extern "C"
+{
+    QuestStreamHub *createQuestStreamHubRawPtr()
+    {
+        return new QuestStreamHubImpl();
+    }
+
+    void deleteQuestStreamHubRawPtr(QuestStreamHub *hub)
+    {
+        delete hub;
+    }
+}
+
+}
@@ -0,0 +1,308 @@
+#include <libQuestMR/QuestStreamSimulator.h>
+#include <libQuestMR/QuestTimestampIndex.h>
+#include <thread>
+#include <atomic>
+#include <mutex>
+#include <list>
+#include "log.h"
+#include "frame.h"
+#include "SocketUtil.h"
+#include "MappedFile.h"
+
+namespace libQuestMR
+{
+
+class QuestStreamSimulatorSession
+{
+public:
+    QuestStreamSimulatorSession()
+        :sock(INVALID_SOCKET_HANDLE), thread(NULL), finished(false)
+    {
+    }
+
+    SocketHandle sock;
+    std::thread *thread;
+    std::atomic<bool> finished;
+};
+
+class QuestStreamSimulatorImpl : public QuestStreamSimulator
+{
+public:
+    QuestStreamSimulatorImpl();
+    virtual ~QuestStreamSimulatorImpl();
+
+    virtual bool load(const char *videoFilename, const char *timestampFilename = NULL, bool use_rectifyTimestamps = true);
+    virtual int getNbFrames();
+
+    virtual void setSpeed(double speed);
+    virtual void setLoop(bool loop);
+
+    virtual bool start(uint32_t port = OM_DEFAULT_PORT, bool localhostOnly = true, int maxSessions = 0);
+    virtual void stop();
+
+    virtual int getNbActiveSessions();
+    virtual uint64_t getBytesSent();
+
+private:
+    void acceptThreadFunc();
+    void sessionThreadFunc(QuestStreamSimulatorSession *session);
+    void joinFinishedSessions(bool all);
+
+    //the recording is memory-mapped, the sessions send directly from the mapping
+    MappedFile data;
+    std::vector<size_t> frameOffsets;//start of each frame in data, plus the end of the last frame
+    std::vector<uint64_t> frameTimestamps;//ms, empty if not paced
+
+    double speed;
+    bool loop;
+    int maxSessions;
+
+    SocketHandle listenSocket;
+    std::thread *acceptThread;
+    std::atomic<bool> running;
+    std::atomic<uint64_t> bytesSent;
+
+    std::mutex sessionsMutex;
+    std::list<QuestStreamSimulatorSession*> sessions;
+};
+
+QuestStreamSimulator::~QuestStreamSimulator()
+{
+}
+
+QuestStreamSimulatorImpl::QuestStreamSimulatorImpl()
+    :bytesSent(0)
+{
+    speed = 1.0;
+    loop = false;
+    maxSessions = 0;
+    listenSocket = INVALID_SOCKET_HANDLE;
+    acceptThread = NULL;
+    running = false;
+}
+
+QuestStreamSimulatorImpl::~QuestStreamSimulatorImpl()
+{
+    stop();
+}
+
+bool QuestStreamSimulatorImpl::load(const char *videoFilename, const char *timestampFilename, bool use_rectifyTimestamps)
+{
+    if(running)
+    {
+        OM_BLOG(LOG_ERROR, "Can not load a recording while the simulator is running");
+        return false;
+    }
+    data.close();
+    frameOffsets.clear();
+    frameTimestamps.clear();
+
+    if(!data.open(videoFilename))
+    {
+        OM_BLOG(LOG_ERROR, "Unable to open %s", videoFilename);
+        return false;
+    }
+    data.adviseSequential();
+    const size_t dataSize = static_cast<size_t>(data.size());
+
+    //split the recording in frames, so that the sessions can pace them
+    size_t offset = 0;
+    while(offset + sizeof(FrameHeader) <= dataSize)
+    {
+        FrameHeader frameHeader = FrameCollection::readFrameHeader(data.data() + offset);
+        size_t frameSize = sizeof(FrameHeader) + frameHeader.PayloadLength;
+        if(frameHeader.Magic != FrameMagic || frameHeader.PayloadLength != frameHeader.TotalDataLengthExcludingMagic + sizeof(uint32_t) - sizeof(FrameHeader))
+        {
+            OM_BLOG(LOG_ERROR, "Invalid frame at offset %llu, ignoring the end of the recording", static_cast<unsigned long long>(offset));
+            break;
+        }
+        if(offset + frameSize > dataSize)
+            break;
+        //index of a recording segment, after the last frame
+        if(frameHeader.PayloadType == static_cast<uint32_t>(Frame::PayloadType::SEGMENT_INDEX))
+            break;
+        frameOffsets.push_back(offset);
+        offset += frameSize;
+    }
+    frameOffsets.push_back(offset);
+
+    if(timestampFilename != NULL)
+    {
+        if(!loadQuestTimestamps(timestampFilename, &frameTimestamps, use_rectifyTimestamps))
+            OM_BLOG(LOG_ERROR, "Unable to open %s", timestampFilename);
+    }
+    return getNbFrames() > 0;
+}
+
+int QuestStreamSimulatorImpl::getNbFrames()
+{
+    return frameOffsets.empty() ? 0 : static_cast<int>(frameOffsets.size() - 1);
+}
+
+void QuestStreamSimulatorImpl::setSpeed(double speed)
+{
+    this->speed = speed;
+}
+
+void QuestStreamSimulatorImpl::setLoop(bool loop)
+{
+    this->loop = loop;
+}
+
+bool QuestStreamSimulatorImpl::start(uint32_t port, bool localhostOnly, int maxSessions)
+{
+    if(running || getNbFrames() == 0)
+        return false;
+    listenSocket = listenTcpSocket(static_cast<uint16_t>(port), localhostOnly);
+    if(listenSocket == INVALID_SOCKET_HANDLE)
+    {
+        OM_BLOG(LOG_ERROR, "Unable to listen on port %u", port);
+        return false;
+    }
+    this->maxSessions = maxSessions;
+    running = true;
+    acceptThread = new std::thread(&QuestStreamSimulatorImpl::acceptThreadFunc, this);
+    return true;
+}
+
+void QuestStreamSimulatorImpl::stop()
+{
+    if(!running)
+        return;
+    running = false;
+    //unblock accept() and the sessions blocked in send()
+    shutdownSocket(listenSocket);
+    closeSocket(listenSocket);
+    listenSocket = INVALID_SOCKET_HANDLE;
+    acceptThread->join();
+    delete acceptThread;
+    acceptThread = NULL;
+    {
+        std::lock_guard<std::mutex> lock(sessionsMutex);
+        for(auto it = sessions.begin(); it != sessions.end(); ++it)
+            shutdownSocket((*it)->sock);
+    }
+    joinFinishedSessions(true);
+}
+
+int QuestStreamSimulatorImpl::getNbActiveSessions()
+{
+    std::lock_guard<std::mutex> lock(sessionsMutex);
+    int count = 0;
+    for(auto it = sessions.begin(); it != sessions.end(); ++it)
+    {
+        if(!(*it)->finished)
+            count++;
+    }
+    return count;
+}
+
+uint64_t QuestStreamSimulatorImpl::getBytesSent()
+{
+    return bytesSent;
+}
+
+void QuestStreamSimulatorImpl::joinFinishedSessions(bool all)
+{
+    std::list<QuestStreamSimulatorSession*> finishedSessions;
+    {
+        std::lock_guard<std::mutex> lock(sessionsMutex);
+        for(auto it = sessions.begin(); it != sessions.end();)
+        {
+            if(all || (*it)->finished) {
+                finishedSessions.push_back(*it);
+                it = sessions.erase(it);
+            } else {
+                ++it;
+            }
+        }
+    }
+    for(auto it = finishedSessions.begin(); it != finishedSessions.end(); ++it)
+    {
+        (*it)->thread->join();
+        closeSocket((*it)->sock);
+        delete (*it)->thread;
+        delete *it;
+    }
+}
+
+void QuestStreamSimulatorImpl::acceptThreadFunc()
+{
+    while(running)
+    {
+        SocketHandle sock = acceptTcpSocket(listenSocket);
+        joinFinishedSessions(false);
+        if(sock == INVALID_SOCKET_HANDLE)
+            continue;
+        if(!running || (maxSessions > 0 && getNbActiveSessions() >= maxSessions))
+        {
+            closeSocket(sock);
+            continue;
+        }
+        QuestStreamSimulatorSession *session = new QuestStreamSimulatorSession();
+        session->sock = sock;
+        std::lock_guard<std::mutex> lock(sessionsMutex);
+        session->thread = new std::thread(&QuestStreamSimulatorImpl::sessionThreadFunc, this, session);
+        sessions.push_back(session);
+    }
+}
+
+void QuestStreamSimulatorImpl::sessionThreadFunc(QuestStreamSimulatorSession *session)
+{
+    //frames already due are sent with a single call, up to this size
+    const size_t maxSendSize = 4*1024*1024;
+    const size_t nbFrames = frameOffsets.size() - 1;
+    const double sessionSpeed = speed;
+    const bool paced = sessionSpeed > 0 && frameTimestamps.size() > 0;
+
+    //time at which frame i must be sent, relative to the start of the loop
+    auto getFrameTime = [&](size_t i) {
+        uint64_t ts = frameTimestamps[std::min(i, frameTimestamps.size() - 1)];
+        double delayMs = ts > frameTimestamps[0] ? (ts - frameTimestamps[0]) / sessionSpeed : 0;
+        return std::chrono::microseconds(static_cast<int64_t>(delayMs * 1000));
+    };
+
+    size_t frameId = 0;
+    auto startTime = std::chrono::steady_clock::now();
+    while(running)
+    {
+        if(frameId >= nbFrames)
+        {
+            if(!loop)
+                break;
+            frameId = 0;
+            startTime = std::chrono::steady_clock::now();
+        }
+        if(paced)
+            std::this_thread::sleep_until(startTime + getFrameTime(frameId));
+
+        size_t lastFrameId = frameId + 1;
+        auto now = std::chrono::steady_clock::now();
+        while(lastFrameId < nbFrames && frameOffsets[lastFrameId + 1] - frameOffsets[frameId] <= maxSendSize
+              && (!paced || startTime + getFrameTime(lastFrameId) <= now))
+            lastFrameId++;
+
+        size_t size = frameOffsets[lastFrameId] - frameOffsets[frameId];
+        if(!sendSocketAll(session->sock, reinterpret_cast<const char*>(data.data() + frameOffsets[frameId]), size))
+            break;
+        bytesSent += size;
+        frameId = lastFrameId;
+    }
+    shutdownSocket(session->sock);
+    session->finished = true;
+}
+
+extern "C"
+{
+    QuestStreamSimulator *createQuestStreamSimulatorRawPtr()
+    {
+        return new QuestStreamSimulatorImpl();
+    }
+
+    void deleteQuestStreamSimulatorRawPtr(QuestStreamSimulator *simulator)
+    {
+        delete simulator;
+    }
+}
+
+}
@@ -0,0 +1,386 @@
+#include <libQuestMR/QuestVideoMngr.h>
+#include <libQuestMR/QuestTimestampIndex.h>
+#include <libQuestMR/QuestVideoTimestampRectifier.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <fstream>
+#include <iterator>
+#include "log.h"
+#include "frame.h"
+#include "MappedFile.h"
+#include "RecordingWriter.h"
+
+namespace libQuestMR
+{
+
+static const char timestampIndexMagic[8] = {'Q', 'M', 'R', 'T', 'S', 'I', 'D', 'X'};
+//fields of a line of the timestamp file : timestamp, type, size and up to 3 extra fields
+static const int maxTimestampFileFields = 6;
+
+struct TimestampFileField
+{
+	const char *data;
+	size_t size;
+};
+
+//decimal number at the start of the field (0 if there is none)
+static uint64_t parseUInt64(const TimestampFileField& field)
+{
+	uint64_t val = 0;
+	for(size_t i = 0; i < field.size && field.data[i] >= '0' && field.data[i] <= '9'; i++)
+		val = val * 10 + (field.data[i] - '0');
+	return val;
+}
+
+static int32_t parseInt32(const TimestampFileField& field)
+{
+	if(field.size > 0 && field.data[0] == '-')
+	{
+		TimestampFileField digits = { field.data + 1, field.size - 1 };
+		return -static_cast<int32_t>(parseUInt64(digits));
+	}
+	return static_cast<int32_t>(parseUInt64(field));
+}
+
+//Calls lineFunc(fields, nbFields) for each line of the timestamp file, in place (the whole file is mapped or read at once).
+//Stops at the first line with less than 3 fields, like the previous istringstream parser.
+template<typename LineFunc>
+static bool parseTimestampFile(const char *filename, LineFunc lineFunc)
+{
+	MappedFile mappedFile;
+	std::string content;
+	const char *data;
+	size_t size;
+	if(mappedFile.open(filename))
+	{
+		mappedFile.adviseSequential();
+		data = reinterpret_cast<const char*>(mappedFile.data());
+		size = static_cast<size_t>(mappedFile.size());
+	}
+	else
+	{
+		//empty file, or mapping not possible
+		std::ifstream input(filename, std::ios::binary);
+		if(!input.good())
+			return false;
+		content.assign(std::istreambuf_iterator<char>(input), std::istreambuf_iterator<char>());
+		data = content.data();
+		size = content.size();
+	}
+
+	TimestampFileField fields[maxTimestampFileFields];
+	const char *end = data + size;
+	const char *line = data;
+	while(line < end)
+	{
+		const char *lineEnd = static_cast<const char*>(memchr(line, '\n', end - line));
+		if(lineEnd == NULL)
+			lineEnd = end;
+		const char *next = lineEnd + (lineEnd < end ? 1 : 0);
+		if(lineEnd > line && lineEnd[-1] == '\r')
+			lineEnd--;
+
+		int nbFields = 0;
+		const char *field = line;
+		while(nbFields < maxTimestampFileFields)
+		{
+			const char *fieldEnd = static_cast<const char*>(memchr(field, ',', lineEnd - field));
+			if(fieldEnd == NULL)
+				fieldEnd = lineEnd;
+			fields[nbFields].data = field;
+			fields[nbFields].size = fieldEnd - field;
+			nbFields++;
+			if(fieldEnd == lineEnd)
+				break;
+			field = fieldEnd + 1;
+		}
+		if(nbFields < 3 || lineEnd == line)
+			break;
+		lineFunc(fields, nbFields);
+		line = next;
+	}
+	return true;
+}
+
+static bool getFileInfo(const char *filename, uint64_t *size, int64_t *mtime)
+{
+#ifdef _WIN32
+	struct _stat64 st;
+	if(_stat64(filename, &st) != 0)
+		return false;
+#else
+	struct stat st;
+	if(stat(filename, &st) != 0)
+		return false;
+#endif
+	*size = static_cast<uint64_t>(st.st_size);
+	*mtime = static_cast<int64_t>(st.st_mtime);
+	return true;
+}
+
+//written to a temporary file then renamed, so an interrupted write or a concurrent reader never sees a partial index
+static bool writeTimestampIndex(const char *filename, const std::vector<QuestTimestampRecord>& records, uint64_t sourceSize, int64_t sourceMtime, uint32_t flags)
+{
+	QuestTimestampIndexHeader header;
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, timestampIndexMagic, sizeof(header.magic));
+	header.version = QUEST_TIMESTAMP_INDEX_VERSION;
+	header.recordSize = sizeof(QuestTimestampRecord);
+	header.nbRecords = records.size();
+	header.sourceSize = sourceSize;
+	header.sourceMtime = sourceMtime;
+	header.flags = flags;
+
+	std::string content;
+	content.reserve(sizeof(header) + records.size() * sizeof(QuestTimestampRecord));
+	content.append(reinterpret_cast<const char*>(&header), sizeof(header));
+	if(!records.empty())
+		content.append(reinterpret_cast<const char*>(&records[0]), records.size() * sizeof(QuestTimestampRecord));
+	return RecordingWriter::replaceFile(filename, content);
+}
+
+static void fillRectifiedTimestamps(std::vector<QuestTimestampRecord> *records)
+{
+	std::vector<uint64_t> rectified = rectifyTimestamps(records->empty() ? NULL : &(*records)[0], records->size());
+	for(size_t i = 0; i < records->size() && i < rectified.size(); i++)
+		(*records)[i].rectifiedTimestamp = rectified[i];
+}
+
+class QuestTimestampIndexImpl : public QuestTimestampIndex
+{
+public:
+	virtual ~QuestTimestampIndexImpl();
+	virtual bool open(const char *filename);
+	virtual void close();
+	virtual int getNbRecords();
+	virtual const QuestTimestampRecord *getRecords();
+	virtual bool hasRectifiedTimestamps();
+	virtual uint64_t getSourceSize();
+	virtual int64_t getSourceMtime();
+
+private:
+	MappedFile m_file;
+	const QuestTimestampIndexHeader *m_header = NULL;
+};
+
+QuestTimestampIndex::~QuestTimestampIndex()
+{
+}
+
+QuestTimestampIndexImpl::~QuestTimestampIndexImpl()
+{
+	close();
+}
+
+bool QuestTimestampIndexImpl::open(const char *filename)
+{
+	close();
+	if(!m_file.open(filename))
+		return false;
+	const QuestTimestampIndexHeader *header = reinterpret_cast<const QuestTimestampIndexHeader*>(m_file.data());
+	//an interrupted write leaves a file shorter than announced
+	if(m_file.size() < sizeof(QuestTimestampIndexHeader)
+		|| memcmp(header->magic, timestampIndexMagic, sizeof(header->magic)) != 0
+		|| header->version != QUEST_TIMESTAMP_INDEX_VERSION
+		|| header->recordSize != sizeof(QuestTimestampRecord)
+		|| m_file.size() != sizeof(QuestTimestampIndexHeader) + header->nbRecords * sizeof(QuestTimestampRecord))
+	{
+		OM_BLOG(LOG_ERROR, "%s is not a valid timestamp index", filename);
+		m_file.close();
+		return false;
+	}
+	m_header = header;
+	return true;
+}
+
+void QuestTimestampIndexImpl::close()
+{
+	m_file.close();
+	m_header = NULL;
+}
+
+int QuestTimestampIndexImpl::getNbRecords()
+{
+	return m_header != NULL ? static_cast<int>(m_header->nbRecords) : 0;
+}
+
+const QuestTimestampRecord *QuestTimestampIndexImpl::getRecords()
+{
+	return m_header != NULL ? reinterpret_cast<const QuestTimestampRecord*>(m_header + 1) : NULL;
+}
+
+bool QuestTimestampIndexImpl::hasRectifiedTimestamps()
+{
+	return m_header != NULL && (m_header->flags & QUEST_TIMESTAMP_INDEX_RECTIFIED) != 0;
+}
+
+uint64_t QuestTimestampIndexImpl::getSourceSize()
+{
+	return m_header != NULL ? m_header->sourceSize : 0;
+}
+
+int64_t QuestTimestampIndexImpl::getSourceMtime()
+{
+	return m_header != NULL ? m_header->sourceMtime : 0;
+}
+
+std::string getQuestTimestampIndexFilename(const char *timestampFilename)
+{
+	std::string filename = timestampFilename;
+	if(filename.size() >= 4 && filename.compare(filename.size() - 4, 4, ".txt") == 0)
+		filename.resize(filename.size() - 4);
+	return filename + ".idx";
+}
+
+static bool isTimestampIndexFilename(const char *filename)
+{
+	size_t len = strlen(filename);
+	return len >= 4 && strcmp(filename + len - 4, ".idx") == 0;
+}
+
+bool loadQuestTimestamps(const char *filename, std::vector<uint64_t> *listTimestamp, bool rectified)
+{
+	listTimestamp->clear();
+	QuestTimestampIndexImpl index;
+	std::vector<QuestTimestampRecord> records;
+	const QuestTimestampRecord *indexRecords = NULL;
+	size_t nbRecords = 0;
+	bool hasRectified = false;
+	if(isTimestampIndexFilename(filename))
+	{
+		if(!index.open(filename))
+			return false;
+		indexRecords = index.getRecords();
+		nbRecords = index.getNbRecords();
+		hasRectified = index.hasRectifiedTimestamps();
+		if(rectified && !hasRectified)
+		{
+			records.assign(indexRecords, indexRecords + nbRecords);
+			fillRectifiedTimestamps(&records);
+			indexRecords = records.empty() ? NULL : &records[0];
+			hasRectified = true;
+		}
+	}
+	else
+	{
+		//the index is up to date if it was built from a file of the same size and modification time
+		uint64_t sourceSize = 0;
+		int64_t sourceMtime = 0;
+		getFileInfo(filename, &sourceSize, &sourceMtime);
+		std::string indexFilename = getQuestTimestampIndexFilename(filename);
+		if(sourceSize > 0 && index.open(indexFilename.c_str()) && index.getSourceSize() == sourceSize && index.getSourceMtime() == sourceMtime
+			&& (!rectified || index.hasRectifiedTimestamps()))
+		{
+			indexRecords = index.getRecords();
+			nbRecords = index.getNbRecords();
+			hasRectified = index.hasRectifiedTimestamps();
+		}
+		else
+		{
+			index.close();
+			if(!loadQuestTimestampRecords(filename, &records))
+				return false;
+			if(rectified)
+				fillRectifiedTimestamps(&records);
+			hasRectified = rectified;
+			//cache for the next time, the recording folder can be read-only
+			if(!writeTimestampIndex(indexFilename.c_str(), records, sourceSize, sourceMtime, rectified ? QUEST_TIMESTAMP_INDEX_RECTIFIED : 0))
+				OM_BLOG(LOG_INFO, "Unable to save the timestamp index %s", indexFilename.c_str());
+			indexRecords = records.empty() ? NULL : &records[0];
+			nbRecords = records.size();
+		}
+	}
+
+	listTimestamp->resize(nbRecords);
+	for(size_t i = 0; i < nbRecords; i++)
+		(*listTimestamp)[i] = rectified && hasRectified ? indexRecords[i].rectifiedTimestamp : indexRecords[i].timestamp;
+	return true;
+}
+
+extern "C"
+{
+	QuestTimestampIndex *createQuestTimestampIndexRawPtr()
+	{
+		return new QuestTimestampIndexImpl();
+	}
+
+	void deleteQuestTimestampIndexRawPtr(QuestTimestampIndex *index)
+	{
+		delete index;
+	}
+
+	bool loadQuestTimestampRecords(const char *timestampFilename, std::vector<QuestTimestampRecord> *records)
+	{
+		records->clear();
+		return parseTimestampFile(timestampFilename, [&](const TimestampFileField *fields, int nbFields) {
+			QuestTimestampRecord record;
+			memset(&record, 0, sizeof(record));
+			record.timestamp = parseUInt64(fields[0]);
+			record.rectifiedTimestamp = record.timestamp;
+			record.type = static_cast<uint32_t>(parseUInt64(fields[1]));
+			record.size = static_cast<uint32_t>(parseUInt64(fields[2]));
+			if(nbFields > 3)
+			{
+				record.flags = QUEST_TIMESTAMP_RECORD_HAS_EXTRA_DATA;
+				if((Frame::PayloadType)record.type == Frame::PayloadType::AUDIO_DATA)
+				{
+					record.audioTimestamp = parseUInt64(fields[3]);
+					record.param0 = nbFields > 4 ? parseInt32(fields[4]) : 0;
+					record.param1 = nbFields > 5 ? parseInt32(fields[5]) : 0;
+				}
+				else
+				{
+					record.param0 = parseInt32(fields[3]);
+					record.param1 = nbFields > 4 ? parseInt32(fields[4]) : 0;
+				}
+			}
+			records->push_back(record);
+		});
+	}
+
+	bool convertQuestTimestampFile(const char *timestampFilename, const char *indexFilename, bool rectify)
+	{
+		std::vector<QuestTimestampRecord> records;
+		if(!loadQuestTimestampRecords(timestampFilename, &records))
+		{
+			OM_BLOG(LOG_ERROR, "Unable to open %s", timestampFilename);
+			return false;
+		}
+		if(rectify)
+			fillRectifiedTimestamps(&records);
+		uint64_t sourceSize = 0;
+		int64_t sourceMtime = 0;
+		getFileInfo(timestampFilename, &sourceSize, &sourceMtime);
+		return writeTimestampIndex(indexFilename, records, sourceSize, sourceMtime, rectify ? QUEST_TIMESTAMP_INDEX_RECTIFIED : 0);
+	}
+
+	bool loadQuestRecordedTimestamps(const char *filename, std::vector<uint64_t> *listTimestamp, std::vector<uint32_t> *listType, std::vector<uint32_t> *listSize, std::vector<std::vector<std::string> > *listExtraData)
+	{
+		if(listTimestamp != NULL)
+			listTimestamp->clear();
+		if(listType != NULL)
+			listType->clear();
+		if(listSize != NULL)
+			listSize->clear();
+		if(listExtraData != NULL)
+			listExtraData->clear();
+
+		return parseTimestampFile(filename, [&](const TimestampFileField *fields, int nbFields) {
+			if(listTimestamp != NULL)
+				listTimestamp->push_back(parseUInt64(fields[0]));
+			if(listType != NULL)
+				listType->push_back(static_cast<uint32_t>(parseUInt64(fields[1])));
+			if(listSize != NULL)
+				listSize->push_back(static_cast<uint32_t>(parseUInt64(fields[2])));
+			if(listExtraData != NULL) {
+				listExtraData->push_back(std::vector<std::string>());
+				std::vector<std::string>& data = listExtraData->back();
+				for(int i = 3; i < nbFields; i++)
+					data.push_back(std::string(fields[i].data, fields[i].size));
+			}
+		});
+	}
+}
+
+}
@@ -16,12 +16,20 @@
 
 #include <libQuestMR/QuestVideoMngr.h>
 #include <libQuestMR/QuestVideoTimestampRectifier.h>
+#include <libQuestMR/QuestTimestampIndex.h>
 #include <fcntl.h>
 #include <thread>
+#include <atomic>
+#include <condition_variable>
+#include <functional>
+#include <deque>
 #include <fstream>
 #include <chrono>
 #include "log.h"
 #include "frame.h"
+#include "RingBuffer.h"
+#include "LatencyStats.h"
+#include "MappedFile.h"
 #include <BufferedSocket/DataPacket.h>
 
 
@@ -43,11 +51,39 @@ std::string GetAvErrorString(int errNum)
 }
 #endif
 
+//header of the AUDIO_DATA payloads, followed by dataLength bytes of interleaved float samples
+struct AudioDataHeader {
+    uint64_t timestamp;
+    int channels;
+    int dataLength;
+};
+
+//returns a pointer to the samples, NULL if the payload is invalid
+static const uint8_t *parseAudioDataHeader(const Frame& frame, AudioDataHeader *header)
+{
+    const int headerSize = 16;
+    if (frame.m_payload.size() < headerSize)
+        return NULL;
+    header->timestamp = convertBytesToUInt64(frame.m_payload.data(), false);
+    header->channels = convertBytesToInt32(frame.m_payload.data() + 8, false);
+    header->dataLength = convertBytesToInt32(frame.m_payload.data() + 12, false);
+    if (header->dataLength < 0 || header->dataLength > (int)frame.m_payload.size() - headerSize)
+        return NULL;
+    return frame.m_payload.data() + headerSize;
+}
+
 class LQMR_EXPORTS QuestAudioDataImpl : public QuestAudioData
 {
 public:
-    QuestAudioDataImpl(uint64_t deviceTimestamp, uint64_t localTimestamp, int nbChannels, uint32_t sampleRate, unsigned char *data, int dataLength);
+    //references the samples in the payload of the frame (no copy), unless there is no frame or they are not aligned for float
+    QuestAudioDataImpl(uint64_t deviceTimestamp, uint64_t localTimestamp, int nbChannels, uint32_t sampleRate, const std::shared_ptr<Frame>& frame, const unsigned char *data, int dataLength);
+    //dataCapacity : bytes reserved for the copied samples
+    explicit QuestAudioDataImpl(int dataCapacity = 0);
 	virtual ~QuestAudioDataImpl();
+    //reuse the object for another packet
+    void set(uint64_t deviceTimestamp, uint64_t localTimestamp, int nbChannels, uint32_t sampleRate, const std::shared_ptr<Frame>& frame, const unsigned char *data, int dataLength);
+    //release the frame, so that it can return to the pool while the object is not used. The copy storage is kept
+    void release();
 	virtual uint64_t getLocalTimestamp() const;//timestamp when received the data
 	virtual uint64_t getDeviceTimestamp() const;//timestamp recorded on the device before transfer
 	virtual int getNbChannels() const;//number of channels
@@ -57,7 +93,9 @@ public:
 protected:
     uint64_t deviceTimestamp, localTimestamp;
     int nbChannels;
-    unsigned char *data;
+    std::shared_ptr<Frame> frame;//owner of data
+    const unsigned char *data;
+    std::vector<float> alignedData;//copy of the samples
     int dataLength;
     uint32_t sampleRate;
 };
@@ -66,21 +104,49 @@ QuestAudioData::~QuestAudioData()
 {
 }
 
-QuestAudioDataImpl::QuestAudioDataImpl(uint64_t deviceTimestamp, uint64_t localTimestamp, int nbChannels, uint32_t sampleRate, unsigned char *data, int dataLength)
-    :deviceTimestamp(deviceTimestamp), localTimestamp(localTimestamp), nbChannels(nbChannels), sampleRate(sampleRate), dataLength(dataLength)
+QuestAudioDataImpl::QuestAudioDataImpl(uint64_t deviceTimestamp, uint64_t localTimestamp, int nbChannels, uint32_t sampleRate, const std::shared_ptr<Frame>& frame, const unsigned char *data, int dataLength)
+{
+    set(deviceTimestamp, localTimestamp, nbChannels, sampleRate, frame, data, dataLength);
+}
+
+QuestAudioDataImpl::QuestAudioDataImpl(int dataCapacity)
+    :deviceTimestamp(0), localTimestamp(0), nbChannels(0), data(NULL), dataLength(0), sampleRate(0)
+{
+    alignedData.reserve((std::max(dataCapacity, 0) + sizeof(float) - 1) / sizeof(float));
+}
+
+void QuestAudioDataImpl::set(uint64_t deviceTimestamp, uint64_t localTimestamp, int nbChannels, uint32_t sampleRate, const std::shared_ptr<Frame>& frame, const unsigned char *data, int dataLength)
 {
-    if(data == NULL)
-        this->data = NULL;
-    else {
-        this->data = new unsigned char[dataLength];
-        memcpy(this->data, data, dataLength);
+    this->deviceTimestamp = deviceTimestamp;
+    this->localTimestamp = localTimestamp;
+    this->nbChannels = nbChannels;
+    this->sampleRate = sampleRate;
+    this->dataLength = dataLength;
+    //copied without frame, or if the payload is not aligned for float (view of a memory-mapped file, at any offset)
+    if (data != NULL && (frame == NULL || reinterpret_cast<uintptr_t>(data) % sizeof(float) != 0))
+    {
+        //the capacity is kept when the object is reused
+        alignedData.resize((dataLength + sizeof(float) - 1) / sizeof(float));
+        memcpy(alignedData.data(), data, dataLength);
+        this->data = reinterpret_cast<const unsigned char*>(alignedData.data());
+        this->frame.reset();
+    }
+    else
+    {
+        this->data = data;
+        this->frame = frame;
     }
 }
 
+void QuestAudioDataImpl::release()
+{
+    frame.reset();
+    data = NULL;
+    dataLength = 0;
+}
+
 QuestAudioDataImpl::~QuestAudioDataImpl()
 {
-    if(data != NULL)
-        delete [] data;
 }
 
 uint64_t QuestAudioDataImpl::getLocalTimestamp() const
@@ -113,6 +179,142 @@ int QuestAudioDataImpl::getDataLength() const
     return dataLength;
 }
 
+QuestYUVFrame::~QuestYUVFrame()
+{
+}
+
+#ifdef LIBQUESTMR_USE_FFMPEG
+//reference to the decoded picture, the buffers are not copied. Reused by the manager for the next pictures
+class QuestYUVFrameImpl : public QuestYUVFrame
+{
+public:
+    QuestYUVFrameImpl()
+        :timestamp(0), frameId(0)
+    {
+        picture = av_frame_alloc();
+    }
+    virtual ~QuestYUVFrameImpl()
+    {
+        av_frame_free(&picture);
+    }
+    //take the reference of the decoder (the picture is empty after the call)
+    void set(AVFrame *picture, uint64_t timestamp, int frameId)
+    {
+        av_frame_unref(this->picture);
+        av_frame_move_ref(this->picture, picture);
+        this->timestamp = timestamp;
+        this->frameId = frameId;
+    }
+    //give the buffers back to the decoder while the object is not used
+    void release()
+    {
+        av_frame_unref(picture);
+    }
+    virtual int getWidth() const
+    {
+        return picture->width;
+    }
+    virtual int getHeight() const
+    {
+        return picture->height;
+    }
+    virtual int getPixelFormat() const
+    {
+        return picture->format;
+    }
+    virtual int getNbPlanes() const
+    {
+        int nbPlanes = 0;
+        while(nbPlanes < AV_NUM_DATA_POINTERS && picture->data[nbPlanes] != NULL)
+            nbPlanes++;
+        return nbPlanes;
+    }
+    virtual const uint8_t *getPlane(int plane) const
+    {
+        return picture->data[plane];
+    }
+    virtual int getStride(int plane) const
+    {
+        return picture->linesize[plane];
+    }
+    virtual bool isFlipped() const
+    {
+        //the stream is upside down, getMostRecentImg() flips it during the conversion
+        return true;
+    }
+    virtual uint64_t getTimestamp() const
+    {
+        return timestamp;
+    }
+    virtual int getFrameId() const
+    {
+        return frameId;
+    }
+    const AVFrame *getAVFrame() const
+    {
+        return picture;
+    }
+private:
+    AVFrame *picture;
+    uint64_t timestamp;
+    int frameId;
+};
+#endif
+
+//subscriber of QuestVideoMngr::subscribe() or subscribeQueue()
+struct QuestSubscription
+{
+    int id;
+    int policy;
+    size_t maxQueueSize;
+    std::function<void(const QuestStreamEvent&)> callback;//empty for the queues
+    //queue, protected by mutex
+    std::mutex mutex;
+    std::condition_variable cond;//signaled when an event is pushed or popped, and when unsubscribed
+    std::deque<QuestStreamEvent> events;
+    bool closed = false;
+};
+
+//Objects reused once they are only referenced by the pool, as the FramePool.
+//Only used by one thread (the one producing the objects)
+template<typename T>
+class SharedObjectPool
+{
+public:
+    SharedObjectPool(size_t maxSize)
+        :m_maxSize(maxSize)
+    {
+        m_objects.reserve(maxSize);
+    }
+
+    //the other unused objects release their resources (payload, decoder buffers), they are not held by the pool
+    std::shared_ptr<T> acquire()
+    {
+        std::shared_ptr<T> object;
+        for (size_t i = 0; i < m_objects.size(); i++)
+        {
+            if (m_objects[i].use_count() != 1)
+                continue;
+            //synchronize with the release of the last reference by the consumer thread
+            std::atomic_thread_fence(std::memory_order_acquire);
+            if (object == NULL)
+                object = m_objects[i];
+            else m_objects[i]->release();
+        }
+        if (object != NULL)
+            return object;
+        //more objects in use than the pool size : not pooled
+        object = std::make_shared<T>();
+        if (m_objects.size() < m_maxSize)
+            m_objects.push_back(object);
+        return object;
+    }
+
+private:
+    std::vector<std::shared_ptr<T>> m_objects;
+    size_t m_maxSize;
+};
+
 class QuestVideoMngrImpl : public QuestVideoMngr
 {
 public:
@@ -123,12 +325,28 @@ public:
 
     virtual bool isRecording() const;//return true if the stream is currently recorded
 	virtual void setRecording(const char *folder, const char *filenameWithoutExt);//set folder and filename (without extension) for recording 
+    virtual void setRecordingBuffers(int nbBuffers, int bufferSize, bool directIO = false);
+    virtual void setRecordingSegments(uint64_t maxSegmentSize, int maxSegmentDurationMs);
 	virtual void setRecordedTimestampFile(const char *filename, bool use_rectifyTimestamps = true);//set timestamp file (for playback)
     virtual void setRecordedTimestamp(const std::vector<uint64_t>& listTimestamp);//set timestamps (for playback)
 	virtual void setVideoDecoding(bool videoDecoding);//to disable video decoding (useful if we want to record without preview)
+    virtual void setLatencyBudget(int latencyBudgetMs);
+    virtual void setDecoderProfile(int profile, int nbThreads = 0);
+    virtual void setDecodeMode(int decodeMode);
+    virtual void getStats(QuestVideoMngrStats *stats);
+    virtual void notifyFrameConsumed(int frameId);
+    virtual bool getStageLatencyStats(int stage, QuestLatencyStats *stats);
+    virtual void getTotalLatencyStats(QuestLatencyStats *stats);
 
     virtual void ReceiveData();
+    void endOfSource();
     virtual void VideoTickImpl(bool skipOldFrames = false);//process the received data
+    virtual bool startPipeline(int policy = QUEST_PIPELINE_DROP, int queueSize = 8);
+    virtual void stopPipeline();
+    virtual bool waitForData(int timeoutMs);
+    virtual bool waitForNewImg(int timeoutMs);
+    virtual bool waitForSource(int timeoutMs);
+    virtual bool seek(uint64_t timestampMs);
     virtual void attachSource(std::shared_ptr<QuestVideoSource> videoSource);//attach the data source (socket, file,...)
     virtual void detachSource();//detach the data source
 
@@ -139,28 +357,162 @@ public:
 	#ifdef LIBQUESTMR_USE_OPENCV
     virtual cv::Mat getMostRecentImg(uint64_t *timestamp = NULL, int *frameId = NULL);
 	#endif
+    virtual std::shared_ptr<QuestYUVFrame> getMostRecentFrameYUV();
+	#ifdef LIBQUESTMR_USE_OPENCV
+    virtual cv::Mat convertImg(const QuestYUVFrame& frame);
+    virtual bool getMostRecentLayers(cv::Mat *background, cv::Mat *foreground, cv::Mat *foregroundAlpha, int width = 0, int height = 0, uint64_t *timestamp = NULL, int *frameId = NULL);
+    virtual bool convertLayers(const QuestYUVFrame& frame, cv::Mat *background, cv::Mat *foreground, cv::Mat *foregroundAlpha, int width = 0, int height = 0);
+	#endif
+    virtual int subscribe(std::function<void(const QuestStreamEvent&)> callback);
+    virtual int subscribeQueue(int policy, int maxQueueSize = 64);
+    virtual bool waitEvent(int subscriptionId, QuestStreamEvent *event, int timeoutMs = -1);
+    virtual void unsubscribe(int subscriptionId);
     virtual int getMostRecentAudio(QuestAudioData*** listAudioData);
+    virtual void setAudioRingSize(int nbFrames);
+    virtual int readAudio(float *dst, int nbFrames, QuestAudioReadInfo *info = NULL);
+    virtual int peekAudio(const float **data, QuestAudioReadInfo *info = NULL);
+    virtual void consumeAudio(int nbFrames);
 
 private:
     void clearMostRecentAudioFrameList();
+    void clearPendingAudioFrameList();
+    void enablePendingAudio();
+    void disablePendingAudio();
+    bool dropVideoFrame(const Frame& frame);
+    void restartFromKeyFrame();
+    void applyDecoderSettings();
+    int receiveChunk();
+    bool processFrame(const std::shared_ptr<Frame>& frame);//return true if a new image was output (or would be if decoding)
+    void processAudioFrame(const std::shared_ptr<Frame>& frame);//output the audio as soon as it is received
+    void publishEvent(QuestStreamEvent& event);
+#ifdef LIBQUESTMR_USE_FFMPEG
+    struct DecoderPacketInfo;
+    bool setPacketPayload(const std::shared_ptr<Frame>& frame);
+    void releaseDecoderFrames(bool decoderFreed);
+    void freeDecoder();
+    bool decodeVideoFrame(const std::shared_ptr<Frame>& frame);
+    int drainDecoder(DecoderPacketInfo& lastPacketInfo);
+    void flushDecoder();
+    void outputPicture(AVFrame *picture, DecoderPacketInfo& pictureInfo, bool convert);//the picture is moved to the output
+    cv::Mat convertPicture(const AVFrame *picture);
+    bool convertPictureLayers(const AVFrame *picture, cv::Mat *background, cv::Mat *foreground, cv::Mat *foregroundAlpha, int width, int height);
+    bool convertLayer(const AVFrame *picture, int layer, int x, int regionWidth, int width, int height, cv::Mat *output);
+    void queueParsedFrame(const std::shared_ptr<Frame>& frame);
+    void queueDecodedPicture(AVFrame *picture, const DecoderPacketInfo& pictureInfo);
+    void freePipelinePictures();
+    void parseThreadFunc();
+    void decodeThreadFunc();
+    void convertThreadFunc();
+#endif
+#ifdef LIBQUESTMR_USE_OPENCV
+    cv::Mat acquireOutputImg(int width, int height);
+#endif
+    void addLatencySamples(const uint64_t *stageTimeUs, int frameId);
 #ifdef LIBQUESTMR_USE_FFMPEG
     const AVCodec* m_codec = nullptr;
 	AVCodecContext* m_codecContext = nullptr;
 	SwsContext* m_swsContext = nullptr;
 	AVPixelFormat m_swsContext_SrcPixelFormat = AV_PIX_FMT_NONE;
+	//reused for all the frames of the session
+	AVPacket* m_packet = nullptr;
+	AVFrame* m_picture = nullptr;
+	std::vector<uint8_t> m_packetScratch;//padded copy of the payloads that can not be decoded in place
+	//frames whose payload is referenced by the decoder, kept out of the pool until it releases them
+	std::vector<std::shared_ptr<Frame>> m_framesInDecoder;
+	//reference given to the decoder for the payloads in the memory-mapped file m_viewBufOwner, keeps it alive
+	AVBufferRef *m_viewBuf = nullptr;
+	const void *m_viewBufOwner = nullptr;
+	//most recent output picture (protected by m_outputMutex), shared with the subscribers and the readers
+	std::shared_ptr<QuestYUVFrameImpl> m_mostRecentYUVFrame;
+	static const size_t maxPooledYUVFrames = 8;
+	SharedObjectPool<QuestYUVFrameImpl> m_yuvFramePool{maxPooledYUVFrames};//only used by the thread calling outputPicture()
+	//getMostRecentLayers() : one conversion per layer (background, foreground, foreground alpha), protected by m_layerMutex
+	std::mutex m_layerMutex;
+	SwsContext* m_layerSwsContext[3] = { nullptr, nullptr, nullptr };
 #endif
 
     FrameCollection m_frameCollection;
     
     bool videoDecoding;
 
+    int latencyBudgetMs = 0;
+    bool waitingForKeyFrame = false;//true while dropping the video until the next keyframe
+    int m_seekTargetFrame = 0;//frames before it are decoded without being converted or output
+    std::atomic<uint64_t> nbDecodedVideoFrames;
+    std::atomic<uint64_t> nbDroppedVideoFrames;
+    std::atomic<uint64_t> nbCatchUps;
+    std::atomic<uint64_t> nbPacketCopies;
+    std::atomic<uint64_t> nbOutputImgAllocations;
+    std::atomic<uint64_t> nbPipelineDrops;
+    std::atomic<uint64_t> nbSkippedVideoFrames;
+    std::atomic<uint64_t> nbAudioOverflows;
+    std::atomic<uint64_t> nbSubscriptionDrops;
+
+    //only used by the decoding thread
+    int decoderProfile = QUEST_DECODER_PROFILE_DEFAULT;
+    int decodeMode = QUEST_DECODE_MODE_ALL;
+    int decoderNbThreads = 0;
+    //requested by setDecoderProfile() and setDecodeMode(), applied by the decoding thread (applyDecoderSettings)
+    std::mutex m_decoderSettingsMutex;
+    int m_requestedDecoderProfile = QUEST_DECODER_PROFILE_DEFAULT;
+    int m_requestedDecodeMode = QUEST_DECODE_MODE_ALL;
+    int m_requestedDecoderNbThreads = 0;
+    std::atomic<bool> m_decoderSettingsChanged;
+
+    //the packets in the decoder, indexed by packet pts (sequence number) % maxPacketsInDecoder.
+    //The decoded picture can come out a few packets later (frame threads)
+    struct DecoderPacketInfo
+    {
+        uint64_t stageTimeUs[QUEST_FRAME_STAGE_COUNT];
+        uint64_t localTimestamp;
+        int streamFrameId;
+    };
+    static const int maxPacketsInDecoder = 64;
+    DecoderPacketInfo m_packetInfo[maxPacketsInDecoder];
+    int64_t m_packetSeq = 0;
+
+    //pipeline : parse thread -> m_parsedQueue -> decode thread -> m_decodedQueue -> convert thread
+    std::atomic<bool> m_pipelineRunning;
+    int m_pipelinePolicy = QUEST_PIPELINE_DROP;
+#ifdef LIBQUESTMR_USE_FFMPEG
+    struct PipelinePicture
+    {
+        AVFrame *picture = nullptr;
+        DecoderPacketInfo info;
+    };
+    //used in turn by the decode thread, there are enough for the queue plus the ones held by the convert thread
+    std::vector<PipelinePicture> m_pipelinePictures;
+    uint64_t m_nbQueuedPictures = 0;
+    SpscBlockingQueue<std::shared_ptr<Frame>> m_parsedQueue;
+    SpscBlockingQueue<PipelinePicture*> m_decodedQueue;
+    bool m_parseDroppingVideo = false;//only used by the parse thread
+    bool m_parseResyncPending = false;//only used by the parse thread
+    std::thread *m_parseThread = NULL;
+    std::thread *m_decodeThread = NULL;
+    std::thread *m_convertThread = NULL;
+#endif
+
+    //latency tracing, protected by latencyMutex
+    struct PendingConsumerTrace
+    {
+        int frameId;//-1 if free
+        uint64_t recvTimeUs;
+        uint64_t convertedTimeUs;
+    };
+    static const int maxPendingConsumerTraces = 8;
+    std::mutex latencyMutex;
+    LatencyWindow stageLatency[QUEST_FRAME_STAGE_COUNT];
+    LatencyWindow totalLatency;
+    PendingConsumerTrace pendingConsumerTraces[maxPendingConsumerTraces];
+    int nextPendingConsumerTrace = 0;
+
 	int m_swsContext_SrcWidth = 0;
 	int m_swsContext_SrcHeight = 0;
 	int m_swsContext_DestWidth = 0;
 	int m_swsContext_DestHeight = 0;
 
-	std::vector<std::pair<int, std::shared_ptr<Frame>>> m_cachedAudioFrames;
-	int m_audioFrameIndex = 0;
+	//written by the parsing thread (processFrame), read by the audio reader (readAudio, peekAudio)
+	AudioRingBuffer m_audioRing;
 	int m_videoFrameIndex = 0;
 
     uint32_t m_width = OM_DEFAULT_WIDTH;
@@ -168,13 +520,51 @@ private:
     uint32_t m_audioSampleRate = OM_DEFAULT_AUDIO_SAMPLERATE;
 
 #ifdef LIBQUESTMR_USE_OPENCV
+	//BGR conversion of the frame m_convertedFrameId, protected by m_convertMutex (also protects m_swsContext)
+	std::mutex m_convertMutex;
 	cv::Mat mostRecentImg;
-	cv::Mat m_temp_texture;
+	int m_convertedFrameId = -1;
+	//output images, reused once the consumers have released them
+	static const size_t maxPooledOutputImgs = 4;
+	std::vector<cv::Mat> m_outputImgPool;
 #endif
     std::vector<QuestAudioData*> mostRecentAudioFrames;
     uint64_t mostRecentTimestamp;
+    //subscribers (subscribe, subscribeQueue), the events are published by the thread that outputs the pictures
+    std::mutex m_subscriptionMutex;
+    std::vector<std::shared_ptr<QuestSubscription>> m_subscriptions;
+    std::atomic<int> m_nbSubscriptions;
+    int m_nextSubscriptionId = 0;
+    uint64_t m_nextEventSeq = 0;//protected by m_publishMutex
+    //the audio and the video can be published by different threads (pipeline), publishEvent() keeps them in sequence
+    std::mutex m_publishMutex;
+    std::vector<std::shared_ptr<QuestSubscription>> m_publishList;//protected by m_publishMutex
+    static const int subscriptionWaitMs = 2000;//maximum wait of the publisher for a full QUEST_SUBSCRIPTION_ALL queue
+
+    //protects the output (image, timestamp, audio, frame index) written by the convert thread
+    std::mutex m_outputMutex;
+    std::condition_variable m_outputCond;
+    //audio not yet returned by getMostRecentAudio(), only kept while it is called : ring of maxPendingAudioFrames entries,
+    //turned off when it is full. The samples are copied, so the frames return to their pool at once
+    bool m_pendingAudioEnabled = false;
+    std::vector<QuestAudioDataImpl*> m_pendingAudioRing;
+    size_t m_pendingAudioStart = 0;
+    size_t m_pendingAudioCount = 0;
+    //the objects of the ring and of the returned list, allocated with their storage when the list is turned on
+    std::vector<QuestAudioDataImpl*> m_freeAudioData;
+    static const int audioDataCapacity = 8192;//bytes reserved per packet : 1024 stereo frames, a larger packet grows its object
+    static const size_t maxPooledAudioEvents = 64;
+    SharedObjectPool<QuestAudioDataImpl> m_audioEventPool{maxPooledAudioEvents};//audio of the events, only used by the thread parsing the audio
+    static const size_t maxPendingAudioFrames = 1024;
+    bool m_pipelineFinished = false;
 
 	std::shared_ptr<QuestVideoSource> videoSource = NULL;
+	//all the data of the source was processed. A file stays attached at the end so that seek() can go back in it
+	bool sourceEnded = false;
+    //signaled when a source is attached, to wake up waitForSource()
+    std::mutex sourceMutex;
+    std::condition_variable sourceCond;
+    int sourceAttachCount = 0;
 
     FILE *debugAudioFile;
     FILE *debugAudioHeaderFile;
@@ -186,8 +576,11 @@ QuestVideoMngr::~QuestVideoMngr()
 }
 
 QuestVideoMngrImpl::QuestVideoMngrImpl()
+    :nbDecodedVideoFrames(0), nbDroppedVideoFrames(0), nbCatchUps(0), nbPacketCopies(0), nbOutputImgAllocations(0), nbPipelineDrops(0), nbSkippedVideoFrames(0), nbAudioOverflows(0), nbSubscriptionDrops(0), m_decoderSettingsChanged(false), m_pipelineRunning(false), m_nbSubscriptions(0)
 {
 	videoDecoding = true;
+    for(int i = 0; i < maxPendingConsumerTraces; i++)
+        pendingConsumerTraces[i].frameId = -1;
 	#ifdef LIBQUESTMR_USE_FFMPEG
     m_codec = avcodec_find_decoder(AV_CODEC_ID_H264);
     if (!m_codec)
@@ -206,18 +599,71 @@ QuestVideoMngrImpl::QuestVideoMngrImpl()
 
 QuestVideoMngrImpl::~QuestVideoMngrImpl()
 {
+    stopPipeline();
+    m_subscriptions.clear();
+    #ifdef LIBQUESTMR_USE_FFMPEG
+    freePipelinePictures();
+    av_buffer_unref(&m_viewBuf);
+    sws_freeContext(m_swsContext);
+    for (int i = 0; i < 3; i++)
+        sws_freeContext(m_layerSwsContext[i]);
+    #endif
+    clearMostRecentAudioFrameList();
+    clearPendingAudioFrameList();
+    for(size_t i = 0; i < m_freeAudioData.size(); i++)
+        delete m_freeAudioData[i];
     //fclose(debugAudioFile);
     //fclose(debugAudioHeaderFile);
     //fclose(debugAudioTimestampFile);
 }
 
+//the objects return to m_freeAudioData (m_outputMutex must be locked)
 void QuestVideoMngrImpl::clearMostRecentAudioFrameList()
 {
     for(size_t i = 0; i < mostRecentAudioFrames.size(); i++)
-        delete mostRecentAudioFrames[i];
+    {
+        QuestAudioDataImpl *audioData = static_cast<QuestAudioDataImpl*>(mostRecentAudioFrames[i]);
+        audioData->release();
+        m_freeAudioData.push_back(audioData);
+    }
     mostRecentAudioFrames.clear();
 }
 
+void QuestVideoMngrImpl::clearPendingAudioFrameList()
+{
+    for(size_t i = 0; i < m_pendingAudioCount; i++)
+    {
+        QuestAudioDataImpl *audioData = m_pendingAudioRing[(m_pendingAudioStart + i) % maxPendingAudioFrames];
+        audioData->release();
+        m_freeAudioData.push_back(audioData);
+    }
+    m_pendingAudioStart = 0;
+    m_pendingAudioCount = 0;
+}
+
+//allocate all the objects of the audio list and their storage (m_outputMutex must be locked)
+void QuestVideoMngrImpl::enablePendingAudio()
+{
+    m_pendingAudioEnabled = true;
+    m_pendingAudioRing.resize(maxPendingAudioFrames, NULL);
+    mostRecentAudioFrames.reserve(maxPendingAudioFrames);
+    //the ring and the returned list are full at most
+    m_freeAudioData.reserve(2 * maxPendingAudioFrames);
+    while (m_freeAudioData.size() + mostRecentAudioFrames.size() < 2 * maxPendingAudioFrames)
+        m_freeAudioData.push_back(new QuestAudioDataImpl(audioDataCapacity));
+}
+
+//free the audio list, except the one returned by the last getMostRecentAudio() (m_outputMutex must be locked)
+void QuestVideoMngrImpl::disablePendingAudio()
+{
+    clearPendingAudioFrameList();
+    for (size_t i = 0; i < m_freeAudioData.size(); i++)
+        delete m_freeAudioData[i];
+    std::vector<QuestAudioDataImpl*>().swap(m_freeAudioData);
+    std::vector<QuestAudioDataImpl*>().swap(m_pendingAudioRing);
+    m_pendingAudioEnabled = false;
+}
+
 bool QuestVideoMngrImpl::isRecording() const
 {
     return m_frameCollection.isRecording();
@@ -228,6 +674,16 @@ void QuestVideoMngrImpl::setRecording(const char *folder, const char *filenameWi
     m_frameCollection.setRecording(folder, filenameWithoutExt);
 }
 
+void QuestVideoMngrImpl::setRecordingBuffers(int nbBuffers, int bufferSize, bool directIO)
+{
+    m_frameCollection.setRecordingBuffers(nbBuffers, bufferSize > 0 ? (size_t)bufferSize : 0, directIO);
+}
+
+void QuestVideoMngrImpl::setRecordingSegments(uint64_t maxSegmentSize, int maxSegmentDurationMs)
+{
+    m_frameCollection.setRecordingSegments(maxSegmentSize, std::max(maxSegmentDurationMs, 0));
+}
+
 void QuestVideoMngrImpl::StartDecoder()
 {
 	#ifdef LIBQUESTMR_USE_FFMPEG
@@ -250,6 +706,22 @@ void QuestVideoMngrImpl::StartDecoder()
         return;
     }
 
+    if (decoderProfile == QUEST_DECODER_PROFILE_LOW_LATENCY)
+    {
+        //each picture is output as soon as it is decoded, slice threads only help if the encoder uses several slices
+        m_codecContext->thread_type = FF_THREAD_SLICE;
+        m_codecContext->thread_count = decoderNbThreads;
+        m_codecContext->flags |= AV_CODEC_FLAG_LOW_DELAY;
+    }
+    else if (decoderProfile == QUEST_DECODER_PROFILE_THROUGHPUT)
+    {
+        //one picture per thread, output thread_count-1 packets later
+        m_codecContext->thread_type = FF_THREAD_FRAME;
+        m_codecContext->thread_count = decoderNbThreads;
+    }
+    if (decodeMode == QUEST_DECODE_MODE_KEYFRAMES)
+        m_codecContext->skip_frame = AVDISCARD_NONKEY;
+
     AVDictionary* dict = nullptr;
     int ret = avcodec_open2(m_codecContext, m_codec, &dict);
     av_dict_free(&dict);
@@ -259,8 +731,11 @@ void QuestVideoMngrImpl::StartDecoder()
         avcodec_free_context(&m_codecContext);
         return;
     }
+    m_packet = av_packet_alloc();
+    m_picture = av_frame_alloc();
+    m_framesInDecoder.reserve(maxPacketsInDecoder);
 
-    OM_BLOG(LOG_INFO, "m_codecContext constructed and opened");
+    OM_BLOG(LOG_INFO, "m_codecContext constructed and opened, profile %d, %d threads (type %d)", decoderProfile, m_codecContext->thread_count, m_codecContext->active_thread_type);
     #endif
 }
 
@@ -269,8 +744,7 @@ void QuestVideoMngrImpl::StopDecoder()
 	#ifdef LIBQUESTMR_USE_FFMPEG
     if (m_codecContext)
     {
-        avcodec_close(m_codecContext);
-        avcodec_free_context(&m_codecContext);
+        freeDecoder();
         OM_BLOG(LOG_INFO, "m_codecContext freed");
     }
     #endif
@@ -286,62 +760,65 @@ void QuestVideoMngrImpl::StopDecoder()
     }*/
 }
 
+//read one chunk from the source into the frame collection, return the recv result
+int QuestVideoMngrImpl::receiveChunk()
+{
+    /*fd_set socketSet = { 0 };
+    FD_ZERO(&socketSet);
+    FD_SET(m_connectSocket, &socketSet);
+
+    timeval t = { 0, 0 };
+    int num = select(0, &socketSet, nullptr, nullptr, &t);*/
+    const int bufferSize = 65536;
+    uint8_t buf[bufferSize];
+    uint64_t timestamp;
+    uint64_t recvTimeUs = 0;
+    //buffered sources give direct access to their ring buffer, saving one copy
+    const char *spanData = NULL;
+    bool useSpan = videoSource->hasRecvSpan();
+    int iResult = useSpan ? videoSource->recvSpan(&spanData, 1024*1024, &timestamp, &recvTimeUs)
+                          : videoSource->recv((char*)buf, bufferSize, &timestamp);
+    if (iResult < 0)
+    {
+        OM_BLOG(LOG_ERROR, "recv error %d, closing socket", iResult);
+    }
+    else if (iResult == 0)
+    {
+        OM_BLOG(LOG_INFO, "recv 0 bytes, closing socket");
+    }
+    else
+    {
+        OM_BLOG(LOG_INFO, "recv: %d bytes received", iResult);
+        if(useSpan) {
+            //a memory-mapped file stays readable after the span, up to its end
+            size_t spanTailSize = 0;
+            QuestVideoSourceFile *file = dynamic_cast<QuestVideoSourceFile*>(videoSource.get());
+            if(file != NULL)
+                spanTailSize = static_cast<size_t>(std::min<uint64_t>(file->getFileSize() - file->getReadPosition() - iResult, FramePayloadPadding));
+            m_frameCollection.AddData((const uint8_t*)spanData, iResult, timestamp, recvTimeUs, videoSource->getRecvSpanOwner(), spanTailSize);
+            videoSource->releaseRecvSpan(iResult);
+        } else {
+            m_frameCollection.AddData(buf, iResult, timestamp, getMonotonicTimeUs());
+        }
+    }
+    return iResult;
+}
+
 void QuestVideoMngrImpl::ReceiveData()
 {
     if (videoSource != NULL && videoSource->isValid())
     {
-        for (;;)
-        {
-            /*fd_set socketSet = { 0 };
-            FD_ZERO(&socketSet);
-            FD_SET(m_connectSocket, &socketSet);
-
-            timeval t = { 0, 0 };
-            int num = select(0, &socketSet, nullptr, nullptr, &t);*/
-            //if (num >= 1)
-            {
-                const int bufferSize = 65536;
-                uint8_t buf[bufferSize];
-                uint64_t timestamp;
-                int iResult = videoSource->recv((char*)buf, bufferSize, &timestamp);
-                if (iResult < 0)
-                {
-                    OM_BLOG(LOG_ERROR, "recv error %d, closing socket", iResult);
-                    detachSource();
-                    break;
-                }
-                else if (iResult == 0)
-                {
-                    OM_BLOG(LOG_INFO, "recv 0 bytes, closing socket");
-                    detachSource();
-                    break;
-                }
-                else
-                {
-                    OM_BLOG(LOG_INFO, "recv: %d bytes received", iResult);
-                    m_frameCollection.AddData(buf, iResult, timestamp);
-                    break;
-                }
-            }
-            /*else
-            {
-                printf("no data\n");
-                break;
-            }*/
-        }
+        if (receiveChunk() <= 0)
+            endOfSource();
     }
 }
 
 void QuestVideoMngrImpl::setRecordedTimestampFile(const char *filename, bool use_rectifyTimestamps)
 {
+    //uses the binary index next to the timestamp file, built the first time
     std::vector<uint64_t> recordedTimestamp;
-    std::vector<uint32_t> listType;
-    std::vector<uint32_t> listSize;
-    std::vector<std::vector<std::string> > listExtraData;
-    loadQuestRecordedTimestamps(filename, &recordedTimestamp, &listType, &listSize, &listExtraData);
-    //loadQuestRecordedTimestamps(filename, &recordedTimestamp, &listType);
-    if(use_rectifyTimestamps)
-        recordedTimestamp = rectifyTimestamps(recordedTimestamp, listType, listSize, listExtraData);
+    if(!loadQuestTimestamps(filename, &recordedTimestamp, use_rectifyTimestamps))
+        OM_BLOG(LOG_ERROR, "Unable to open %s", filename);
     setRecordedTimestamp(recordedTimestamp);
 }
 
@@ -355,263 +832,1381 @@ void QuestVideoMngrImpl::setVideoDecoding(bool videoDecoding)
 	this->videoDecoding = videoDecoding;
 }
 
-void QuestVideoMngrImpl::VideoTickImpl(bool skipOldFrames)
+void QuestVideoMngrImpl::setLatencyBudget(int latencyBudgetMs)
 {
-    if (videoSource != NULL && videoSource->isValid())
+    this->latencyBudgetMs = latencyBudgetMs;
+}
+
+void QuestVideoMngrImpl::setDecoderProfile(int profile, int nbThreads)
+{
+    if (profile < QUEST_DECODER_PROFILE_DEFAULT || profile > QUEST_DECODER_PROFILE_THROUGHPUT)
     {
-        if(!m_frameCollection.HasCompletedFrame())
-            ReceiveData();
+        OM_BLOG(LOG_ERROR, "Unknown decoder profile %d", profile);
+        return;
+    }
+    if (m_pipelineRunning)
+    {
+        OM_BLOG(LOG_ERROR, "Can not change the decoder profile while the pipeline is running");
+        return;
+    }
+    std::lock_guard<std::mutex> lock(m_decoderSettingsMutex);
+    m_requestedDecoderProfile = profile;
+    //the pictures of the packets in flight must fit in m_packetInfo
+    m_requestedDecoderNbThreads = std::max(0, std::min(nbThreads, 16));
+    m_decoderSettingsChanged = true;
+}
 
-        if (videoSource == NULL || !videoSource->isValid())	// socket disconnected
-            return;
+void QuestVideoMngrImpl::setDecodeMode(int decodeMode)
+{
+    if (decodeMode < QUEST_DECODE_MODE_ALL || decodeMode > QUEST_DECODE_MODE_KEYFRAMES)
+    {
+        OM_BLOG(LOG_ERROR, "Unknown decode mode %d", decodeMode);
+        return;
+    }
+    if (m_pipelineRunning)
+    {
+        OM_BLOG(LOG_ERROR, "Can not change the decode mode while the pipeline is running");
+        return;
+    }
+    std::lock_guard<std::mutex> lock(m_decoderSettingsMutex);
+    m_requestedDecodeMode = decodeMode;
+    m_decoderSettingsChanged = true;
+}
 
-        //std::chrono::time_point<std::chrono::system_clock> startTime = std::chrono::system_clock::now();
-        while (m_frameCollection.HasCompletedFrame())
+//called by the decoding thread, the setters can be called from any thread while it decodes
+void QuestVideoMngrImpl::applyDecoderSettings()
+{
+    if (!m_decoderSettingsChanged.exchange(false))
+        return;
+    int profile, nbThreads, mode;
+    {
+        std::lock_guard<std::mutex> lock(m_decoderSettingsMutex);
+        profile = m_requestedDecoderProfile;
+        nbThreads = m_requestedDecoderNbThreads;
+        mode = m_requestedDecodeMode;
+    }
+    bool profileChanged = profile != decoderProfile || nbThreads != decoderNbThreads;
+    bool modeChanged = mode != decodeMode;
+    decoderProfile = profile;
+    decoderNbThreads = nbThreads;
+    decodeMode = mode;
+
+    #ifdef LIBQUESTMR_USE_FFMPEG
+    if (m_codecContext == nullptr)
+        return;
+    if (profileChanged)
+    {
+        //restart the running decoder with the new settings, decoding restarts at the next keyframe
+        freeDecoder();
+        StartDecoder();
+        waitingForKeyFrame = true;
+    }
+    else if (modeChanged)
+    {
+        //the references of the next frames were skipped, restart at the next keyframe
+        m_codecContext->skip_frame = decodeMode == QUEST_DECODE_MODE_KEYFRAMES ? AVDISCARD_NONKEY : AVDISCARD_DEFAULT;
+        restartFromKeyFrame();
+    }
+    #endif
+}
+
+void QuestVideoMngrImpl::getStats(QuestVideoMngrStats *stats)
+{
+    stats->nbDecodedVideoFrames = nbDecodedVideoFrames;
+    stats->nbDroppedVideoFrames = nbDroppedVideoFrames;
+    stats->nbCatchUps = nbCatchUps;
+    stats->nbResyncs = m_frameCollection.GetNbResyncs();
+    stats->nbResyncSkippedBytes = m_frameCollection.GetNbResyncSkippedBytes();
+    stats->nbPacketCopies = nbPacketCopies;
+    stats->nbOutputImgAllocations = nbOutputImgAllocations;
+    stats->nbPipelineDrops = nbPipelineDrops;
+    stats->nbSkippedVideoFrames = nbSkippedVideoFrames;
+    stats->nbAudioOverflows = nbAudioOverflows;
+    stats->nbSubscriptionDrops = nbSubscriptionDrops;
+    const RecordingWriter& recordingWriter = m_frameCollection.getRecordingWriter();
+    stats->recordingQueuedBytes = recordingWriter.getQueuedBytes();
+    stats->recordingBytesWritten = recordingWriter.getBytesWritten();
+    stats->recordingWriteThroughput = recordingWriter.getWriteThroughput();
+    stats->nbRecordingStalls = recordingWriter.getNbStalls();
+}
+
+#ifdef LIBQUESTMR_USE_FFMPEG
+static_assert(FramePayloadPadding >= AV_INPUT_BUFFER_PADDING_SIZE, "FramePayloadPadding too small for the decoder");
+
+//the storage belongs to the frame, kept by m_framesInDecoder while the decoder references it
+static void keepFramePayload(void *opaque, uint8_t *data)
+{
+}
+
+//last reference to a memory-mapped file released by the decoder
+static void releaseViewOwner(void *opaque, uint8_t *data)
+{
+    delete static_cast<std::shared_ptr<const void>*>(opaque);
+}
+
+bool QuestVideoMngrImpl::setPacketPayload(const std::shared_ptr<Frame>& frame)
+{
+    const FramePayload& payload = frame->m_payload;
+    if (payload.hasPadding())
+    {
+        //the decoder uses the payload in place (parser storage or memory-mapped file), through a reference
+        //created once and pointed to each payload : the decoder makes its own references from it
+        AVBufferRef *buf;
+        if (payload.owner() == nullptr)
         {
-            //std::chrono::duration<double> timePassed = std::chrono::system_clock::now() - startTime;
-            //if (timePassed.count() > 0.05)
-            //	break;
+            if (frame->decoderBuf == NULL)
+                frame->decoderBuf = av_buffer_create(const_cast<uint8_t*>(payload.data()), payload.size() + FramePayloadPadding,
+                                                     keepFramePayload, NULL, AV_BUFFER_FLAG_READONLY);
+            buf = frame->decoderBuf;
+            //the frame returns to the pool once the decoder released its references (releaseDecoderFrames)
+            if (buf != nullptr)
+                m_framesInDecoder.push_back(frame);
+        }
+        else
+        {
+            //one reference for all the payloads of the file, the decoder keeps the mapping alive
+            if (m_viewBuf == nullptr || m_viewBufOwner != payload.owner().get())
+            {
+                av_buffer_unref(&m_viewBuf);
+                std::shared_ptr<const void> *owner = new std::shared_ptr<const void>(payload.owner());
+                m_viewBuf = av_buffer_create(const_cast<uint8_t*>(payload.data()), payload.size() + FramePayloadPadding,
+                                             releaseViewOwner, owner, AV_BUFFER_FLAG_READONLY);
+                if (m_viewBuf == nullptr)
+                    delete owner;
+                m_viewBufOwner = payload.owner().get();
+            }
+            buf = m_viewBuf;
+        }
+        if (buf == nullptr)
+            return false;
+        buf->data = const_cast<uint8_t*>(payload.data());
+        buf->size = payload.size() + FramePayloadPadding;
+        //borrowed, detached before av_packet_unref()
+        m_packet->buf = buf;
+        m_packet->data = buf->data;
+        m_packet->size = (int)payload.size();
+        return true;
+    }
+    //last frame of a memory-mapped recording, the mapping ends right after the payload :
+    //copy it in the scratch buffer, the decoder makes its own copy of a packet without buffer
+    nbPacketCopies++;
+    if (m_packetScratch.size() < payload.size() + FramePayloadPadding)
+        m_packetScratch.resize(payload.size() + FramePayloadPadding);
+    memcpy(m_packetScratch.data(), payload.data(), payload.size());
+    memset(m_packetScratch.data() + payload.size(), 0, FramePayloadPadding);
+    m_packet->buf = nullptr;
+    m_packet->data = m_packetScratch.data();
+    m_packet->size = (int)payload.size();
+    return true;
+}
 
-            auto frame = m_frameCollection.PopFrame();
+//give back to the pool the frames whose payload is not referenced by the decoder anymore (all of them if it was freed)
+void QuestVideoMngrImpl::releaseDecoderFrames(bool decoderFreed)
+{
+    for (size_t i = 0; i < m_framesInDecoder.size();)
+    {
+        if (decoderFreed || av_buffer_get_ref_count(m_framesInDecoder[i]->decoderBuf) == 1)
+        {
+            m_framesInDecoder[i].swap(m_framesInDecoder.back());
+            m_framesInDecoder.pop_back();
+        }
+        else i++;
+    }
+    if (decoderFreed)
+        av_buffer_unref(&m_viewBuf);
+}
+
+//free the decoder and the frames it referenced
+void QuestVideoMngrImpl::freeDecoder()
+{
+    avcodec_close(m_codecContext);
+    avcodec_free_context(&m_codecContext);
+    av_packet_free(&m_packet);
+    av_frame_free(&m_picture);
+    releaseDecoderFrames(true);
+}
+#endif
+
+#ifdef LIBQUESTMR_USE_OPENCV
+cv::Mat QuestVideoMngrImpl::acquireOutputImg(int width, int height)
+{
+    for (size_t i = 0; i < m_outputImgPool.size(); i++)
+    {
+        cv::Mat& img = m_outputImgPool[i];
+        if (img.cols != width || img.rows != height)
+        {
+            //resolution changed
+            m_outputImgPool.erase(m_outputImgPool.begin() + i);
+            i--;
+        }
+        else if (CV_XADD(&img.u->refcount, 0) == 1)//only referenced by the pool
+        {
+            return img;
+        }
+    }
+    //cv::Mat buffers are aligned by OpenCV
+    nbOutputImgAllocations++;
+    cv::Mat img(height, width, CV_8UC3);
+    if (m_outputImgPool.size() < maxPooledOutputImgs)
+        m_outputImgPool.push_back(img);
+    return img;
+}
+#endif
+
+void QuestVideoMngrImpl::restartFromKeyFrame()
+{
+    waitingForKeyFrame = true;
+    #ifdef LIBQUESTMR_USE_FFMPEG
+    //the references of the next frames are lost anyway
+    if(m_codecContext != nullptr)
+        avcodec_flush_buffers(m_codecContext);
+    #endif
+}
+
+bool QuestVideoMngrImpl::dropVideoFrame(const Frame& frame)
+{
+    //keyframe-only mode : the other frames are not even sent to the decoder
+    if(decodeMode == QUEST_DECODE_MODE_KEYFRAMES && !isH264KeyFrame(frame.m_payload.data(), frame.m_payload.size()))
+    {
+        nbSkippedVideoFrames++;
+        return true;
+    }
+    if(!waitingForKeyFrame)
+    {
+        if(latencyBudgetMs <= 0 || m_frameCollection.useRecordedTimestamp())
+            return false;
+        uint64_t now = getTimestampMs();
+        if(now <= frame.localTimestamp || now - frame.localTimestamp <= static_cast<uint64_t>(latencyBudgetMs))
+            return false;
+        OM_BLOG(LOG_INFO, "video late by %llu ms, dropping until the next keyframe", static_cast<unsigned long long>(now - frame.localTimestamp));
+        nbCatchUps++;
+        restartFromKeyFrame();
+    }
+    //dropping is fast, so the keyframe we restart from is usually close to the live position
+    if(isH264KeyFrame(frame.m_payload.data(), frame.m_payload.size()))
+    {
+        waitingForKeyFrame = false;
+        return false;
+    }
+    nbDroppedVideoFrames++;
+    return true;
+}
+
+void QuestVideoMngrImpl::addLatencySamples(const uint64_t *stageTimeUs, int frameId)
+{
+    std::lock_guard<std::mutex> lock(latencyMutex);
+    for(int i = QUEST_FRAME_STAGE_PARSED; i <= QUEST_FRAME_STAGE_CONVERTED; i++)
+    {
+        if(stageTimeUs[i] >= stageTimeUs[i-1] && stageTimeUs[i-1] != 0)
+            stageLatency[i].add(stageTimeUs[i] - stageTimeUs[i-1]);
+    }
+    //the consumer stage is known once notifyFrameConsumed() is called
+    PendingConsumerTrace& trace = pendingConsumerTraces[nextPendingConsumerTrace];
+    nextPendingConsumerTrace = (nextPendingConsumerTrace + 1) % maxPendingConsumerTraces;
+    trace.frameId = frameId;
+    trace.recvTimeUs = stageTimeUs[QUEST_FRAME_STAGE_RECV];
+    trace.convertedTimeUs = stageTimeUs[QUEST_FRAME_STAGE_CONVERTED];
+}
+
+void QuestVideoMngrImpl::notifyFrameConsumed(int frameId)
+{
+    uint64_t now = getMonotonicTimeUs();
+    std::lock_guard<std::mutex> lock(latencyMutex);
+    for(int i = 0; i < maxPendingConsumerTraces; i++)
+    {
+        PendingConsumerTrace& trace = pendingConsumerTraces[i];
+        if(trace.frameId == frameId && frameId >= 0)
+        {
+            stageLatency[QUEST_FRAME_STAGE_CONSUMER].add(now - trace.convertedTimeUs);
+            totalLatency.add(now - trace.recvTimeUs);
+            trace.frameId = -1;//only the first consumption is traced
+            break;
+        }
+    }
+}
+
+bool QuestVideoMngrImpl::getStageLatencyStats(int stage, QuestLatencyStats *stats)
+{
+    if(stage <= QUEST_FRAME_STAGE_RECV || stage >= QUEST_FRAME_STAGE_COUNT)
+        return false;
+    std::lock_guard<std::mutex> lock(latencyMutex);
+    stageLatency[stage].getStats(stats);
+    return true;
+}
+
+void QuestVideoMngrImpl::getTotalLatencyStats(QuestLatencyStats *stats)
+{
+    std::lock_guard<std::mutex> lock(latencyMutex);
+    totalLatency.getStats(stats);
+}
+
+void QuestVideoMngrImpl::processAudioFrame(const std::shared_ptr<Frame>& frame)
+{
+    if (frame->m_type == Frame::PayloadType::AUDIO_SAMPLERATE)
+    {
+        m_audioSampleRate = *(uint32_t*)(frame->m_payload.data());
+        OM_BLOG(LOG_DEBUG, "[AUDIO_SAMPLERATE] %d", m_audioSampleRate);
+        return;
+    }
+    //seeking : skip the audio before the target
+    if (frame->streamFrameId < m_seekTargetFrame)
+        return;
+#if _DEBUG
+    double timePassed = m_frameCollection.GetNbTickSinceFirstFrame();
+    OM_BLOG(LOG_DEBUG, "[%lf][AUDIO_DATA] timestamp", timePassed);
+#endif
+
+    AudioDataHeader audioDataHeader;
+    const uint8_t *audioSamples = parseAudioDataHeader(*frame, &audioDataHeader);
+    if (audioSamples == NULL)
+    {
+        OM_BLOG(LOG_ERROR, "[AUDIO_DATA] invalid payload");
+        return;
+    }
+    if (audioDataHeader.channels != 1 && audioDataHeader.channels != 2)
+    {
+        OM_BLOG(LOG_ERROR, "[AUDIO_DATA] unimplemented audio channels %d", audioDataHeader.channels);
+        return;
+    }
+    //fwrite(frame->m_payload.data(), 1, frame->m_payload.size(), debugAudioFile);
+    //fprintf(debugAudioTimestampFile, "%llu,%d\n", (unsigned long long)frame->localTimestamp, audioDataHeader.dataLength);
+
+    if (m_audioRing.capacity() > 0)
+    {
+        size_t nbAudioFrames = audioDataHeader.dataLength / sizeof(float) / audioDataHeader.channels;
+        if (!m_audioRing.write(audioSamples, nbAudioFrames, audioDataHeader.channels, m_audioSampleRate, audioDataHeader.timestamp, frame->localTimestamp))
+            nbAudioOverflows++;
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(m_outputMutex);
+        if (m_pendingAudioEnabled && m_pendingAudioCount == maxPendingAudioFrames)
+        {
+            OM_BLOG(LOG_INFO, "getMostRecentAudio() not called during %d audio packets, the audio list is off until its next call", (int)maxPendingAudioFrames);
+            disablePendingAudio();
+        }
+        if (m_pendingAudioEnabled)
+        {
+            //there is always one : the ring is not full, and the returned list is not larger
+            QuestAudioDataImpl *audioData = m_freeAudioData.back();
+            m_freeAudioData.pop_back();
+            //copied (no frame), the list never holds the frames of the pool
+            audioData->set(audioDataHeader.timestamp, frame->localTimestamp, audioDataHeader.channels, m_audioSampleRate, std::shared_ptr<Frame>(), audioSamples, audioDataHeader.dataLength);
+            m_pendingAudioRing[(m_pendingAudioStart + m_pendingAudioCount) % maxPendingAudioFrames] = audioData;
+            m_pendingAudioCount++;
+        }
+    }
+    if (m_nbSubscriptions > 0)
+    {
+        QuestStreamEvent event;
+        event.type = QUEST_STREAM_EVENT_AUDIO;
+        std::shared_ptr<QuestAudioDataImpl> audioData = m_audioEventPool.acquire();
+        audioData->set(audioDataHeader.timestamp, frame->localTimestamp, audioDataHeader.channels, m_audioSampleRate, frame, audioSamples, audioDataHeader.dataLength);
+        event.audioData = audioData;
+        publishEvent(event);
+    }
+}
+
+void QuestVideoMngrImpl::VideoTickImpl(bool skipOldFrames)
+{
+    //the pipeline threads do the work
+    if (m_pipelineRunning)
+        return;
+    applyDecoderSettings();
+    if (videoSource != NULL && !sourceEnded)
+    {
+        if(!m_frameCollection.HasCompletedFrame() && videoSource->isValid())
+            ReceiveData();
+
+        if (videoSource == NULL || sourceEnded)	// socket disconnected
+            return;
+
+        //the last frames are still processed once the source has given all its data
+        //std::chrono::time_point<std::chrono::system_clock> startTime = std::chrono::system_clock::now();
+        while (m_frameCollection.HasCompletedFrame())
+        {
+            //std::chrono::duration<double> timePassed = std::chrono::system_clock::now() - startTime;
+            //if (timePassed.count() > 0.05)
+            //	break;
+
+            auto frame = m_frameCollection.PopFrame();
+            if (processFrame(frame) && !skipOldFrames)
+                return;
+        }
+        if (!videoSource->isValid())
+            endOfSource();
+    }
+}
+
+bool QuestVideoMngrImpl::processFrame(const std::shared_ptr<Frame>& frame)
+{
+    //frames were lost in the corrupted data
+    if (frame->afterResync)
+    {
+        OM_BLOG(LOG_INFO, "stream resynchronized, decoding restarts at the next keyframe");
+        restartFromKeyFrame();
+    }
+
+    //auto current_time = std::chrono::system_clock::now();
+    //auto seconds_since_epoch = std::chrono::duration<double>(current_time.time_since_epoch()).count();
+    //double latency = seconds_since_epoch - frame->m_secondsSinceEpoch;
+
+    if (frame->m_type == Frame::PayloadType::VIDEO_DIMENSION)
+    {
+        m_width = convertBytesToInt32(frame->m_payload.data(), false);
+        m_height = convertBytesToInt32(frame->m_payload.data() + 4, false);
+
+        OM_BLOG(LOG_INFO, "[VIDEO_DIMENSION] width %d height %d", m_width, m_height);
+    }
+    else if (frame->m_type == Frame::PayloadType::VIDEO_DATA)
+    {
+        if (!videoDecoding)
+        {
+            std::lock_guard<std::mutex> lock(m_outputMutex);
+            ++m_videoFrameIndex;
+            return true;
+        }
+        if (dropVideoFrame(*frame))
+            return false;
+        nbDecodedVideoFrames++;
+        #ifdef LIBQUESTMR_USE_FFMPEG
+        //auto start = std::chrono::steady_clock::now();
+        bool decoded = decodeVideoFrame(frame);
+        //auto end = std::chrono::steady_clock::now();
+        //printf("decode frame: %lf ms\n", std::chrono::duration_cast<std::chrono::microseconds>(end - start).count()/1000.0);
+        return decoded;
+        #else
+        return true;
+        #endif
+    }
+    else if (frame->m_type == Frame::PayloadType::AUDIO_SAMPLERATE || frame->m_type == Frame::PayloadType::AUDIO_DATA)
+    {
+        processAudioFrame(frame);
+    }
+    else
+    {
+        OM_BLOG(LOG_ERROR, "Unknown payload type: %u", frame->m_type);
+    }
+    return false;
+}
+
+#ifdef LIBQUESTMR_USE_FFMPEG
+bool QuestVideoMngrImpl::decodeVideoFrame(const std::shared_ptr<Frame>& frame)
+{
+    OM_BLOG(LOG_ERROR, "[VIDEO_DATA]");
+    AVPacket* packet = m_packet;
+    if (!setPacketPayload(frame))
+    {
+        OM_BLOG(LOG_ERROR, "Unable to create the packet");
+        return false;
+    }
+
+    //the pts is only used to find the stage times of the decoded picture
+    packet->pts = m_packetSeq;
+    DecoderPacketInfo& packetInfo = m_packetInfo[m_packetSeq % maxPacketsInDecoder];
+    memcpy(packetInfo.stageTimeUs, frame->stageTimeUs, sizeof(frame->stageTimeUs));
+    packetInfo.localTimestamp = frame->localTimestamp;
+    packetInfo.streamFrameId = frame->streamFrameId;
+    m_packetSeq++;
+
+    int ret = avcodec_send_packet(m_codecContext, packet);
+    //the decoder is full : take its pictures to make room, then send the packet again
+    while (ret == AVERROR(EAGAIN) && drainDecoder(packetInfo) > 0)
+        ret = avcodec_send_packet(m_codecContext, packet);
+    packetInfo.stageTimeUs[QUEST_FRAME_STAGE_SEND_PACKET] = getMonotonicTimeUs();
+    if (ret < 0)
+    {
+        OM_BLOG(LOG_ERROR, "avcodec_send_packet error %s", GetAvErrorString(ret).c_str());
+    }
+    //take all the pictures available, they can belong to previous packets
+    drainDecoder(packetInfo);
+
+    //the buffer of the payload is kept for the next packets
+    packet->buf = nullptr;
+    av_packet_unref(packet);
+    releaseDecoderFrames(false);
+    return true;
+}
+
+//receive all the pictures available, returns the number of pictures received
+int QuestVideoMngrImpl::drainDecoder(DecoderPacketInfo& lastPacketInfo)
+{
+    AVFrame* picture = m_picture;
+    int nbPictures = 0;
+    for (;;)
+    {
+        int ret = avcodec_receive_frame(m_codecContext, picture);
+        if (ret == AVERROR(EAGAIN) || ret == AVERROR_EOF)
+        {
+            //the decoder needs more packets
+            break;
+        }
+        else if (ret < 0)
+        {
+            OM_BLOG(LOG_ERROR, "avcodec_receive_frame error %s", GetAvErrorString(ret).c_str());
+            break;
+        }
+        nbPictures++;
+        DecoderPacketInfo& pictureInfo = picture->pts != AV_NOPTS_VALUE ? m_packetInfo[picture->pts % maxPacketsInDecoder] : lastPacketInfo;
+        if (pictureInfo.streamFrameId < m_seekTargetFrame)
+        {
+            //seeking : the frame is only decoded as a reference for the next ones
+        }
+        else
+        {
+            pictureInfo.stageTimeUs[QUEST_FRAME_STAGE_RECEIVE_FRAME] = getMonotonicTimeUs();
+	#if _DEBUG
+            double timePassed = m_frameCollection.GetNbTickSinceFirstFrame();
+            OM_BLOG(LOG_DEBUG, "[%lf][VIDEO_DATA] width %d height %d format %d", timePassed, picture->width, picture->height, picture->format);
+	#endif
+            if (m_pipelineRunning)
+                queueDecodedPicture(picture, pictureInfo);
+            else outputPicture(picture, pictureInfo, false);
+        }
+        av_frame_unref(picture);
+    }
+    return nbPictures;
+}
+
+//end of the stream : output the pictures still in the decoder (several with frame threads)
+void QuestVideoMngrImpl::flushDecoder()
+{
+    if (m_codecContext == nullptr || m_packetSeq == 0 || !videoDecoding)
+        return;
+    int ret = avcodec_send_packet(m_codecContext, NULL);
+    if (ret < 0)
+    {
+        OM_BLOG(LOG_ERROR, "avcodec_send_packet (flush) error %s", GetAvErrorString(ret).c_str());
+        return;
+    }
+    drainDecoder(m_packetInfo[(m_packetSeq - 1) % maxPacketsInDecoder]);
+    //leave the draining mode, so that the decoder can be used again (seek)
+    avcodec_flush_buffers(m_codecContext);
+}
+
+//convert to BGR, in an image of the pool (m_convertMutex must be locked)
+cv::Mat QuestVideoMngrImpl::convertPicture(const AVFrame *picture)
+{
+    if (m_swsContext != nullptr)
+    {
+        if (m_swsContext_SrcWidth != picture->width ||
+            m_swsContext_SrcHeight != picture->height ||
+            m_swsContext_SrcPixelFormat != picture->format ||
+            m_swsContext_DestWidth != picture->width ||
+            m_swsContext_DestHeight != picture->height)
+        {
+            OM_BLOG(LOG_DEBUG, "Need recreate m_swsContext");
+            sws_freeContext(m_swsContext);
+            m_swsContext = nullptr;
+        }
+    }
+
+    if (m_swsContext == nullptr)
+    {
+        m_swsContext = sws_getContext(
+            picture->width,
+            picture->height,
+            (AVPixelFormat)picture->format,
+            picture->width,
+            picture->height,
+            AV_PIX_FMT_BGR24,
+            SWS_POINT,
+            nullptr, nullptr, nullptr
+        );
+        m_swsContext_SrcWidth = picture->width;
+        m_swsContext_SrcHeight = picture->height;
+        m_swsContext_SrcPixelFormat = (AVPixelFormat)picture->format;
+        m_swsContext_DestWidth = picture->width;
+        m_swsContext_DestHeight = picture->height;
+        OM_BLOG(LOG_DEBUG, "sws_getContext(%d, %d, %d)", picture->width, picture->height, picture->format);
+    }
+
+    assert(m_swsContext);
+
+    cv::Mat outputImg = acquireOutputImg(picture->width, picture->height);
+    //the image is upside down : write it from the last row, with a negative stride
+    uint8_t* data[1] = { outputImg.ptr<uint8_t>(outputImg.rows - 1) };
+    int stride[1] = { -(int)outputImg.step };
+    sws_scale(m_swsContext, picture->data,
+        picture->linesize,
+        0,
+        picture->height,
+        data,
+        stride);
+
+    //cv::imshow("img", outputImg);
+    //cv::waitKey(10);
+    return outputImg;
+}
+
+void QuestVideoMngrImpl::outputPicture(AVFrame *picture, DecoderPacketInfo& pictureInfo, bool convert)
+{
+    //the conversion is done now (pipeline convert thread), or by getMostRecentImg() if it is ever called for this frame
+    std::unique_lock<std::mutex> convertLock(m_convertMutex, std::defer_lock);
+    cv::Mat outputImg;
+    if (convert)
+    {
+        convertLock.lock();
+        outputImg = convertPicture(picture);
+    }
+
+    int frameIndex;
+    bool hasSubscribers = m_nbSubscriptions > 0;
+    QuestStreamEvent event;
+    std::shared_ptr<QuestYUVFrameImpl> yuvFrame = m_yuvFramePool.acquire();
+    {
+        std::lock_guard<std::mutex> lock(m_outputMutex);
+        frameIndex = ++m_videoFrameIndex;
+        mostRecentTimestamp = pictureInfo.localTimestamp;
+        //the handle takes the reference of the decoder, that uses other buffers for the next pictures
+        yuvFrame->set(picture, pictureInfo.localTimestamp, frameIndex);
+        m_mostRecentYUVFrame = yuvFrame;
+    }
+    if (hasSubscribers)
+    {
+        event.type = QUEST_STREAM_EVENT_VIDEO;
+        event.videoFrame = yuvFrame;
+    }
+    if (convert)
+    {
+        mostRecentImg = outputImg;
+        m_convertedFrameId = frameIndex;
+        convertLock.unlock();
+    }
+    m_outputCond.notify_all();
+
+    //without lock, a subscriber can make us wait
+    if (hasSubscribers)
+        publishEvent(event);
+
+    pictureInfo.stageTimeUs[QUEST_FRAME_STAGE_CONVERTED] = getMonotonicTimeUs();
+    addLatencySamples(pictureInfo.stageTimeUs, frameIndex);
+}
+
+bool QuestVideoMngrImpl::startPipeline(int policy, int queueSize)
+{
+    if (m_pipelineRunning || videoSource == NULL || m_codecContext == nullptr)
+    {
+        OM_BLOG(LOG_ERROR, "Unable to start the pipeline (already running or no source)");
+        return false;
+    }
+    //the settings can not change while the pipeline runs
+    applyDecoderSettings();
+    queueSize = std::max(queueSize, 1);
+    m_pipelinePolicy = policy;
+    m_parsedQueue.allocate(queueSize);
+    m_decodedQueue.allocate(queueSize);
+    //a picture can be in the queue or held by the convert thread (2 when skipping to the most recent one)
+    freePipelinePictures();
+    m_pipelinePictures.resize(queueSize + 2);
+    for (size_t i = 0; i < m_pipelinePictures.size(); i++)
+        m_pipelinePictures[i].picture = av_frame_alloc();
+    m_nbQueuedPictures = 0;
+    m_parseDroppingVideo = false;
+    m_parseResyncPending = false;
+    {
+        std::lock_guard<std::mutex> lock(m_outputMutex);
+        m_pipelineFinished = false;
+    }
+
+    m_pipelineRunning = true;
+    m_parseThread = new std::thread(&QuestVideoMngrImpl::parseThreadFunc, this);
+    m_decodeThread = new std::thread(&QuestVideoMngrImpl::decodeThreadFunc, this);
+    m_convertThread = new std::thread(&QuestVideoMngrImpl::convertThreadFunc, this);
+    return true;
+}
+
+void QuestVideoMngrImpl::freePipelinePictures()
+{
+    for (size_t i = 0; i < m_pipelinePictures.size(); i++)
+        av_frame_free(&m_pipelinePictures[i].picture);
+    m_pipelinePictures.clear();
+}
+
+void QuestVideoMngrImpl::queueParsedFrame(const std::shared_ptr<Frame>& frame)
+{
+    //the audio is output by the parse thread, without waiting for the video before it
+    if (frame->m_type == Frame::PayloadType::AUDIO_SAMPLERATE || frame->m_type == Frame::PayloadType::AUDIO_DATA)
+    {
+        //the decoder restarts with the next queued frame
+        if (frame->afterResync)
+            m_parseResyncPending = true;
+        processAudioFrame(frame);
+        return;
+    }
+    if (m_parseResyncPending)
+    {
+        frame->afterResync = true;
+        m_parseResyncPending = false;
+    }
+    if (m_pipelinePolicy == QUEST_PIPELINE_DROP && frame->m_type == Frame::PayloadType::VIDEO_DATA)
+    {
+        //after a drop, the decoding can only restart at a keyframe
+        if (m_parseDroppingVideo && !isH264KeyFrame(frame->m_payload.data(), frame->m_payload.size()))
+        {
+            nbPipelineDrops++;
+            return;
+        }
+        m_parseDroppingVideo = !m_parsedQueue.tryPush(frame);
+        if (m_parseDroppingVideo)
+            nbPipelineDrops++;
+        return;
+    }
+    //the other frames are small and needed to decode the next ones
+    m_parsedQueue.push(frame);
+}
+
+void QuestVideoMngrImpl::queueDecodedPicture(AVFrame *picture, const DecoderPacketInfo& pictureInfo)
+{
+    if (m_pipelinePolicy == QUEST_PIPELINE_DROP && m_decodedQueue.full())
+    {
+        nbPipelineDrops++;
+        return;
+    }
+    //free : see startPipeline()
+    PipelinePicture& item = m_pipelinePictures[m_nbQueuedPictures % m_pipelinePictures.size()];
+    m_nbQueuedPictures++;
+    av_frame_move_ref(item.picture, picture);
+    item.info = pictureInfo;
+    if (!m_decodedQueue.push(&item))
+    {
+        //stopped
+        av_frame_unref(item.picture);
+    }
+}
+
+void QuestVideoMngrImpl::parseThreadFunc()
+{
+    while (m_pipelineRunning)
+    {
+        if (!m_frameCollection.HasCompletedFrame())
+        {
+            //the timeout only bounds the reaction time to stopPipeline()
+            if (!videoSource->waitForData(100))
+            {
+                if (!videoSource->isValid())
+                    break;
+                continue;
+            }
+            if (receiveChunk() <= 0)
+                break;
+        }
+        while (m_pipelineRunning && m_frameCollection.HasCompletedFrame())
+            queueParsedFrame(m_frameCollection.PopFrame());
+    }
+    m_parsedQueue.close();
+}
+
+void QuestVideoMngrImpl::decodeThreadFunc()
+{
+    std::shared_ptr<Frame> frame;
+    while (m_pipelineRunning && m_parsedQueue.pop(&frame))
+    {
+        processFrame(frame);
+        frame.reset();
+    }
+    //end of the source (not stopPipeline)
+    if (m_pipelineRunning)
+        flushDecoder();
+    m_decodedQueue.close();
+}
+
+void QuestVideoMngrImpl::convertThreadFunc()
+{
+    PipelinePicture *item;
+    while (m_pipelineRunning && m_decodedQueue.pop(&item))
+    {
+        //only convert the most recent picture
+        PipelinePicture *next;
+        while (m_pipelinePolicy == QUEST_PIPELINE_DROP && m_decodedQueue.tryPop(&next))
+        {
+            av_frame_unref(item->picture);
+            nbPipelineDrops++;
+            item = next;
+        }
+        outputPicture(item->picture, item->info, true);
+        av_frame_unref(item->picture);
+    }
+    std::lock_guard<std::mutex> lock(m_outputMutex);
+    m_pipelineFinished = true;
+    m_outputCond.notify_all();
+}
+#endif
+
+void QuestVideoMngrImpl::stopPipeline()
+{
+    #ifdef LIBQUESTMR_USE_FFMPEG
+    if (m_parseThread == NULL)
+        return;
+    m_pipelineRunning = false;
+    m_parsedQueue.close();
+    m_decodedQueue.close();
+    std::thread **threads[] = { &m_parseThread, &m_decodeThread, &m_convertThread };
+    for (int i = 0; i < 3; i++)
+    {
+        (*threads[i])->join();
+        delete *threads[i];
+        *threads[i] = NULL;
+    }
+
+    //release what is left in the queues
+    std::shared_ptr<Frame> frame;
+    while (m_parsedQueue.tryPop(&frame))
+        frame.reset();
+    PipelinePicture *item;
+    while (m_decodedQueue.tryPop(&item))
+        av_frame_unref(item->picture);
+    #endif
+}
+
+bool QuestVideoMngrImpl::waitForData(int timeoutMs)
+{
+    //the data is consumed by the pipeline threads, wait for their output instead
+    if(m_pipelineRunning)
+        return waitForNewImg(timeoutMs);
+    std::shared_ptr<QuestVideoSource> source = videoSource;
+    //nothing more to process until another source is attached
+    if(source == NULL || sourceEnded)
+        return false;
+    if(m_frameCollection.HasCompletedFrame())
+        return true;
+    if(source->isValid())
+        return source->waitForData(timeoutMs);
+    //the source just ended : VideoTickImpl() processes the end of the stream
+    return true;
+}
+
+bool QuestVideoMngrImpl::waitForNewImg(int timeoutMs)
+{
+    if(m_pipelineRunning)
+    {
+        std::unique_lock<std::mutex> lock(m_outputMutex);
+        int frameId = m_videoFrameIndex;
+        auto pred = [&]() { return m_videoFrameIndex != frameId || m_pipelineFinished; };
+        if(timeoutMs < 0)
+            m_outputCond.wait(lock, pred);
+        else m_outputCond.wait_for(lock, std::chrono::milliseconds(timeoutMs), pred);
+        return m_videoFrameIndex != frameId;
+    }
+    int frameId = m_videoFrameIndex;
+    auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(timeoutMs);
+    while(m_videoFrameIndex == frameId)
+    {
+        //no new frame until another source is attached
+        if(videoSource == NULL || sourceEnded)
+            return false;
+        int remainingMs = -1;
+        if(timeoutMs >= 0) {
+            remainingMs = static_cast<int>(std::chrono::duration_cast<std::chrono::milliseconds>(deadline - std::chrono::steady_clock::now()).count());
+            if(remainingMs <= 0)
+                return false;
+        }
+        if(waitForData(remainingMs))
+            VideoTickImpl();
+    }
+    return true;
+}
+
+bool QuestVideoMngrImpl::waitForSource(int timeoutMs)
+{
+    std::unique_lock<std::mutex> lock(sourceMutex);
+    if(videoSource != NULL && !sourceEnded)
+        return true;
+    int attachCount = sourceAttachCount;
+    auto pred = [&]() { return sourceAttachCount != attachCount; };
+    if(timeoutMs < 0)
+        sourceCond.wait(lock, pred);
+    else sourceCond.wait_for(lock, std::chrono::milliseconds(timeoutMs), pred);
+    return sourceAttachCount != attachCount;
+}
+
+bool QuestVideoMngrImpl::seek(uint64_t timestampMs)
+{
+    if (videoSource == NULL || m_pipelineRunning)
+        return false;
+    int nbFrames = 0;
+    const QuestFrameIndexEntry *frameIndex = videoSource->getFrameIndex(&nbFrames);
+    const std::vector<uint64_t>& listTimestamp = m_frameCollection.getRecordedTimestamp();
+    if (frameIndex == NULL || listTimestamp.empty())
+        return false;
+
+    //first video frame at timestampMs or after (the last one if timestampMs is after the end)
+    int targetFrame = -1;
+    for (int i = 0; i < nbFrames; i++)
+    {
+        if (frameIndex[i].payloadType != static_cast<uint32_t>(Frame::PayloadType::VIDEO_DATA))
+            continue;
+        targetFrame = i;
+        if (listTimestamp[std::min(i, (int)listTimestamp.size()-1)] >= timestampMs)
+            break;
+    }
+    if (targetFrame < 0)
+        return false;
+    int keyFrame = targetFrame;
+    while (keyFrame > 0 && !frameIndex[keyFrame].keyFrame)
+        keyFrame--;
+
+    //restore the state set by the frames before the keyframe
+    bool dimensionFound = false, sampleRateFound = false;
+    for (int i = keyFrame - 1; i >= 0 && !(dimensionFound && sampleRateFound); i--)
+    {
+        if (!dimensionFound && frameIndex[i].payloadType == static_cast<uint32_t>(Frame::PayloadType::VIDEO_DIMENSION)) {
+            m_width = frameIndex[i].width;
+            m_height = frameIndex[i].height;
+            dimensionFound = true;
+        } else if (!sampleRateFound && frameIndex[i].payloadType == static_cast<uint32_t>(Frame::PayloadType::AUDIO_SAMPLERATE)) {
+            m_audioSampleRate = frameIndex[i].sampleRate;
+            sampleRateFound = true;
+        }
+    }
+
+    if (!videoSource->seekToFrame(keyFrame))
+        return false;
+    m_frameCollection.restartAt(keyFrame);
+    sourceEnded = false;
+    #ifdef LIBQUESTMR_USE_FFMPEG
+    if (m_codecContext != nullptr)
+        avcodec_flush_buffers(m_codecContext);
+    #endif
+    {
+        std::lock_guard<std::mutex> lock(m_outputMutex);
+        clearMostRecentAudioFrameList();
+        clearPendingAudioFrameList();
+    }
+    //no keyframe before the target (the recording does not start with one) : the decoding starts at the next one
+    waitingForKeyFrame = !frameIndex[keyFrame].keyFrame;
+    m_seekTargetFrame = targetFrame;
+
+    OM_BLOG(LOG_INFO, "seek to frame %d from keyframe %d", targetFrame, keyFrame);
+    int frameId = m_videoFrameIndex;
+    while (m_videoFrameIndex == frameId && videoSource != NULL && !sourceEnded)
+        VideoTickImpl();
+    return m_videoFrameIndex != frameId;
+}
+
+uint32_t QuestVideoMngrImpl::getWidth()//get img width
+{
+	return m_width;
+}
+
+uint32_t QuestVideoMngrImpl::getHeight()//get img height
+{
+	return m_height;
+}
+
+#ifdef LIBQUESTMR_USE_OPENCV
+cv::Mat QuestVideoMngrImpl::getMostRecentImg(uint64_t *timestamp, int *frameId)
+{
+    std::lock_guard<std::mutex> convertLock(m_convertMutex);
+    int imgFrameId;
+    #ifdef LIBQUESTMR_USE_FFMPEG
+    std::shared_ptr<QuestYUVFrameImpl> yuvFrame;
+    #endif
+    {
+        std::lock_guard<std::mutex> lock(m_outputMutex);
+        imgFrameId = m_videoFrameIndex;
+        if(timestamp != NULL)
+            *timestamp = mostRecentTimestamp;
+        #ifdef LIBQUESTMR_USE_FFMPEG
+        //only the frames that are asked for are converted, once
+        if(imgFrameId != m_convertedFrameId)
+            yuvFrame = m_mostRecentYUVFrame;
+        #endif
+    }
+    if(frameId != NULL)
+        *frameId = imgFrameId;
+    #ifdef LIBQUESTMR_USE_FFMPEG
+    if(yuvFrame != NULL)
+    {
+        mostRecentImg = convertPicture(yuvFrame->getAVFrame());
+        m_convertedFrameId = imgFrameId;
+    }
+    #endif
+	return mostRecentImg;
+}
+#endif
+
+std::shared_ptr<QuestYUVFrame> QuestVideoMngrImpl::getMostRecentFrameYUV()
+{
+    #ifdef LIBQUESTMR_USE_FFMPEG
+    std::lock_guard<std::mutex> lock(m_outputMutex);
+    return m_mostRecentYUVFrame;
+    #else
+    return NULL;
+    #endif
+}
+
+int QuestVideoMngrImpl::subscribe(std::function<void(const QuestStreamEvent&)> callback)
+{
+    std::shared_ptr<QuestSubscription> subscription = std::make_shared<QuestSubscription>();
+    subscription->policy = QUEST_SUBSCRIPTION_ALL;
+    subscription->maxQueueSize = 0;
+    subscription->callback = callback;
+    std::lock_guard<std::mutex> lock(m_subscriptionMutex);
+    subscription->id = m_nextSubscriptionId++;
+    m_subscriptions.push_back(subscription);
+    m_nbSubscriptions = (int)m_subscriptions.size();
+    return subscription->id;
+}
+
+int QuestVideoMngrImpl::subscribeQueue(int policy, int maxQueueSize)
+{
+    if (policy < QUEST_SUBSCRIPTION_ALL || policy > QUEST_SUBSCRIPTION_LATEST)
+    {
+        OM_BLOG(LOG_ERROR, "Unknown subscription policy %d", policy);
+        return -1;
+    }
+    std::shared_ptr<QuestSubscription> subscription = std::make_shared<QuestSubscription>();
+    subscription->policy = policy;
+    subscription->maxQueueSize = std::max(maxQueueSize, 1);
+    std::lock_guard<std::mutex> lock(m_subscriptionMutex);
+    subscription->id = m_nextSubscriptionId++;
+    m_subscriptions.push_back(subscription);
+    m_nbSubscriptions = (int)m_subscriptions.size();
+    return subscription->id;
+}
+
+bool QuestVideoMngrImpl::waitEvent(int subscriptionId, QuestStreamEvent *event, int timeoutMs)
+{
+    std::shared_ptr<QuestSubscription> subscription;
+    {
+        std::lock_guard<std::mutex> lock(m_subscriptionMutex);
+        for (size_t i = 0; i < m_subscriptions.size(); i++)
+        {
+            if (m_subscriptions[i]->id == subscriptionId)
+                subscription = m_subscriptions[i];
+        }
+    }
+    if (subscription == NULL || subscription->callback)
+        return false;
+
+    std::unique_lock<std::mutex> lock(subscription->mutex);
+    auto pred = [&]() { return !subscription->events.empty() || subscription->closed; };
+    if (timeoutMs < 0)
+        subscription->cond.wait(lock, pred);
+    else subscription->cond.wait_for(lock, std::chrono::milliseconds(timeoutMs), pred);
+    if (subscription->events.empty())
+        return false;
+    *event = subscription->events.front();
+    subscription->events.pop_front();
+    //wake up the publisher waiting for space (QUEST_SUBSCRIPTION_ALL)
+    subscription->cond.notify_all();
+    return true;
+}
+
+void QuestVideoMngrImpl::unsubscribe(int subscriptionId)
+{
+    std::shared_ptr<QuestSubscription> subscription;
+    {
+        std::lock_guard<std::mutex> lock(m_subscriptionMutex);
+        for (size_t i = 0; i < m_subscriptions.size(); i++)
+        {
+            if (m_subscriptions[i]->id == subscriptionId)
+            {
+                subscription = m_subscriptions[i];
+                m_subscriptions.erase(m_subscriptions.begin() + i);
+                break;
+            }
+        }
+        m_nbSubscriptions = (int)m_subscriptions.size();
+    }
+    if (subscription == NULL)
+        return;
+    std::lock_guard<std::mutex> lock(subscription->mutex);
+    subscription->closed = true;
+    subscription->events.clear();
+    subscription->cond.notify_all();
+}
+
+void QuestVideoMngrImpl::publishEvent(QuestStreamEvent& event)
+{
+    std::lock_guard<std::mutex> publishLock(m_publishMutex);
+    event.sequenceNumber = m_nextEventSeq++;
+    {
+        std::lock_guard<std::mutex> lock(m_subscriptionMutex);
+        m_publishList = m_subscriptions;
+    }
+    for (size_t i = 0; i < m_publishList.size(); i++)
+    {
+        QuestSubscription& subscription = *m_publishList[i];
+        if (subscription.callback)
+        {
+            subscription.callback(event);
+            continue;
+        }
+        std::unique_lock<std::mutex> lock(subscription.mutex);
+        if (subscription.policy == QUEST_SUBSCRIPTION_LATEST)
+        {
+            //only the most recent video frame is worth reading
+            if (event.type == QUEST_STREAM_EVENT_VIDEO)
+            {
+                for (std::deque<QuestStreamEvent>::iterator it = subscription.events.begin(); it != subscription.events.end();)
+                {
+                    if (it->type == QUEST_STREAM_EVENT_VIDEO)
+                        it = subscription.events.erase(it);
+                    else ++it;
+                }
+            }
+            if (subscription.events.size() >= subscription.maxQueueSize)
+                subscription.events.pop_front();
+        }
+        else
+        {
+            //wait for the subscriber to read its queue, the timeout only avoids blocking the decoding forever
+            //(subscriber reading from the thread calling VideoTickImpl, or not reading anymore)
+            if (!subscription.cond.wait_for(lock, std::chrono::milliseconds((int)subscriptionWaitMs),
+                    [&]() { return subscription.events.size() < subscription.maxQueueSize || subscription.closed; }))
+            {
+                OM_BLOG(LOG_ERROR, "subscription %d : queue full for %d ms, event %llu dropped", subscription.id, subscriptionWaitMs, (unsigned long long)event.sequenceNumber);
+                nbSubscriptionDrops++;
+                continue;
+            }
+        }
+        if (subscription.closed)
+            continue;
+        subscription.events.push_back(event);
+        subscription.cond.notify_all();
+    }
+    m_publishList.clear();
+}
+
+#ifdef LIBQUESTMR_USE_OPENCV
+bool QuestVideoMngrImpl::getMostRecentLayers(cv::Mat *background, cv::Mat *foreground, cv::Mat *foregroundAlpha, int width, int height, uint64_t *timestamp, int *frameId)
+{
+    #ifdef LIBQUESTMR_USE_FFMPEG
+    std::lock_guard<std::mutex> layerLock(m_layerMutex);
+    std::shared_ptr<QuestYUVFrameImpl> yuvFrame;
+    {
+        //the handle keeps the picture, the decoder can output the next pictures during the conversion
+        std::lock_guard<std::mutex> lock(m_outputMutex);
+        if (m_mostRecentYUVFrame == NULL)
+            return false;
+        yuvFrame = m_mostRecentYUVFrame;
+        if (timestamp != NULL)
+            *timestamp = mostRecentTimestamp;
+        if (frameId != NULL)
+            *frameId = m_videoFrameIndex;
+    }
+    return convertPictureLayers(yuvFrame->getAVFrame(), background, foreground, foregroundAlpha, width, height);
+    #else
+    return false;
+    #endif
+}
+
+cv::Mat QuestVideoMngrImpl::convertImg(const QuestYUVFrame& frame)
+{
+    #ifdef LIBQUESTMR_USE_FFMPEG
+    const QuestYUVFrameImpl *frameImpl = dynamic_cast<const QuestYUVFrameImpl*>(&frame);
+    if (frameImpl == NULL)
+        return cv::Mat();
+    std::lock_guard<std::mutex> convertLock(m_convertMutex);
+    return convertPicture(frameImpl->getAVFrame());
+    #else
+    return cv::Mat();
+    #endif
+}
+
+bool QuestVideoMngrImpl::convertLayers(const QuestYUVFrame& frame, cv::Mat *background, cv::Mat *foreground, cv::Mat *foregroundAlpha, int width, int height)
+{
+    #ifdef LIBQUESTMR_USE_FFMPEG
+    const QuestYUVFrameImpl *frameImpl = dynamic_cast<const QuestYUVFrameImpl*>(&frame);
+    if (frameImpl == NULL)
+        return false;
+    std::lock_guard<std::mutex> layerLock(m_layerMutex);
+    return convertPictureLayers(frameImpl->getAVFrame(), background, foreground, foregroundAlpha, width, height);
+    #else
+    return false;
+    #endif
+}
+#endif
 
-            //auto current_time = std::chrono::system_clock::now();
-            //auto seconds_since_epoch = std::chrono::duration<double>(current_time.time_since_epoch()).count();
-            //double latency = seconds_since_epoch - frame->m_secondsSinceEpoch;
+#ifdef LIBQUESTMR_USE_FFMPEG
+//m_layerMutex must be locked
+bool QuestVideoMngrImpl::convertPictureLayers(const AVFrame *picture, cv::Mat *background, cv::Mat *foreground, cv::Mat *foregroundAlpha, int width, int height)
+{
+    //the stream is [background (1/2), foreground (1/4), foreground alpha (1/4)]
+    int streamWidth = picture->width;
+    if (width <= 0 || height <= 0)
+    {
+        width = streamWidth / 2;
+        height = picture->height;
+    }
+    return (background == NULL || convertLayer(picture, 0, 0, streamWidth/2, width, height, background))
+        && (foreground == NULL || convertLayer(picture, 1, streamWidth/2, streamWidth/4, width, height, foreground))
+        && (foregroundAlpha == NULL || convertLayer(picture, 2, streamWidth*3/4, streamWidth/4, width, height, foregroundAlpha));
+}
+#endif
 
-            if (frame->m_type == Frame::PayloadType::VIDEO_DIMENSION)
-            {
-                m_width = convertBytesToInt32(frame->m_payload.data(), false);
-                m_height = convertBytesToInt32(frame->m_payload.data() + 4, false);
+#ifdef LIBQUESTMR_USE_FFMPEG
+//convert and scale the columns [x, x+regionWidth) of the picture in one sws_scale, the alpha layer to GRAY8
+bool QuestVideoMngrImpl::convertLayer(const AVFrame *picture, int layer, int x, int regionWidth, int width, int height, cv::Mat *output)
+{
+    //the chroma has half the horizontal resolution : start the region on an even column,
+    //or the chroma would be shifted (YUV420P) or U and V swapped (NV12)
+    x &= ~1;
+    regionWidth = std::min(regionWidth, picture->width - x);
+    //crop by moving the plane pointers to the first column of the region
+    const uint8_t *srcData[3] = { picture->data[0] + x, NULL, NULL };
+    switch (picture->format)
+    {
+    case AV_PIX_FMT_YUV420P:
+    case AV_PIX_FMT_YUVJ420P:
+        srcData[1] = picture->data[1] + x/2;
+        srcData[2] = picture->data[2] + x/2;
+        break;
+    case AV_PIX_FMT_NV12:
+        //interleaved U and V at half resolution
+        srcData[1] = picture->data[1] + x;
+        break;
+    default:
+        OM_BLOG(LOG_ERROR, "getMostRecentLayers : unsupported pixel format %d", picture->format);
+        return false;
+    }
 
-                OM_BLOG(LOG_INFO, "[VIDEO_DIMENSION] width %d height %d", m_width, m_height);
-            }
-            else if (frame->m_type == Frame::PayloadType::VIDEO_DATA)
-            {
-                //auto start = std::chrono::steady_clock::now();
-		
-            	if(videoDecoding)
-            	{
-		        	#ifdef LIBQUESTMR_USE_FFMPEG
-		            OM_BLOG(LOG_ERROR, "[VIDEO_DATA]");
-		            AVPacket* packet = av_packet_alloc();
-		            AVFrame* picture = av_frame_alloc();
-
-		            av_new_packet(packet, (int)frame->m_payload.size());
-		            assert(packet->data);
-		            memcpy(packet->data, frame->m_payload.data(), frame->m_payload.size());
-
-		            int ret = avcodec_send_packet(m_codecContext, packet);
-		            if (ret < 0)
-		            {
-		                OM_BLOG(LOG_ERROR, "avcodec_send_packet error %s", GetAvErrorString(ret).c_str());
-		            }
-		            else
-		            {
-		                ret = avcodec_receive_frame(m_codecContext, picture);
-		                if (ret < 0)
-		                {
-		                    OM_BLOG(LOG_ERROR, "avcodec_receive_frame error %s", GetAvErrorString(ret).c_str());
-		                }
-		                else
-		                {
-	#if _DEBUG
-		                    double timePassed = m_frameCollection.GetNbTickSinceFirstFrame();
-		                    OM_BLOG(LOG_DEBUG, "[%lf][VIDEO_DATA] size %d width %d height %d format %d", timePassed, packet->size, picture->width, picture->height, picture->format);
-	#endif
+    bool isAlpha = (layer == 2);
+    m_layerSwsContext[layer] = sws_getCachedContext(m_layerSwsContext[layer],
+        regionWidth, picture->height, (AVPixelFormat)picture->format,
+        width, height, isAlpha ? AV_PIX_FMT_GRAY8 : AV_PIX_FMT_BGR24,
+        SWS_BILINEAR, nullptr, nullptr, nullptr);
+    if (m_layerSwsContext[layer] == nullptr)
+    {
+        OM_BLOG(LOG_ERROR, "getMostRecentLayers : unable to create the conversion %dx%d -> %dx%d", regionWidth, picture->height, width, height);
+        return false;
+    }
 
-                            clearMostRecentAudioFrameList();
-		                    while (m_cachedAudioFrames.size() > 0 /*&& m_cachedAudioFrames[0].first <= m_videoFrameIndex*/)
-		                    {
-		                        std::shared_ptr<Frame> audioFrame = m_cachedAudioFrames[0].second;
-
-		                        struct AudioDataHeader {
-		                            uint64_t timestamp;
-		                            int channels;
-		                            int dataLength;
-		                        };
-                                AudioDataHeader audioDataHeader;
-                                audioDataHeader.timestamp = convertBytesToUInt64(audioFrame->m_payload.data(), false);
-                                audioDataHeader.channels = convertBytesToInt32(audioFrame->m_payload.data() + 8, false);
-                                audioDataHeader.dataLength = convertBytesToInt32(audioFrame->m_payload.data() + 12, false);
-
-                                //fprintf(debugAudioHeaderFile, "%lf,%d\n", (double)audioDataHeader.timestamp, audioDataHeader.dataLength);
-
-		                        if (audioDataHeader.channels == 1 || audioDataHeader.channels == 2)
-		                        {
-		                            /*obs_source_audio audio = { 0 };
-		                            audio.data[0] = (uint8_t*)audioFrame.m_payload.data() + sizeof(AudioDataHeader);
-		                            audio.frames = audioDataHeader.dataLength / sizeof(float) / audioDataHeader.channels;
-		                            audio.speakers = audioDataHeader.channels == 1 ? SPEAKERS_MONO : SPEAKERS_STEREO;
-		                            audio.format = AUDIO_FORMAT_FLOAT;
-		                            audio.samples_per_sec = m_audioSampleRate;
-		                            audio.timestamp = audioDataHeader.timestamp;
-		                            obs_source_output_audio(m_src, &audio);*/
-                                    //fprintf(debugAudioTimestampFile, "%llu,%d\n", (unsigned long long)audioFrame->localTimestamp, audioDataHeader.dataLength);
-                                    mostRecentAudioFrames.push_back(new QuestAudioDataImpl(audioDataHeader.timestamp, audioFrame->localTimestamp, audioDataHeader.channels, m_audioSampleRate, (uint8_t*)audioFrame->m_payload.data() + sizeof(AudioDataHeader), audioDataHeader.dataLength));
-                                    //FILE *debugTimestamp = fopen("debugTimestamp2.csv", "a");
-                                    //fprintf(debugTimestamp, "%llu,%llu\n", audioDataHeader.timestamp, audioFrame.localTimestamp);
-                                    //fclose(debugTimestamp);
-		                        }
-		                        else
-		                        {
-		                            OM_BLOG(LOG_ERROR, "[AUDIO_DATA] unimplemented audio channels %d", audioDataHeader.channels);
-		                        }
-
-		                        m_cachedAudioFrames.erase(m_cachedAudioFrames.begin());
-		                    }
-
-		                    ++m_videoFrameIndex;
-
-		                    if (m_swsContext != nullptr)
-		                    {
-		                        if (m_swsContext_SrcWidth != m_codecContext->width ||
-		                            m_swsContext_SrcHeight != m_codecContext->height ||
-		                            m_swsContext_SrcPixelFormat != m_codecContext->pix_fmt ||
-		                            m_swsContext_DestWidth != m_codecContext->width ||
-		                            m_swsContext_DestHeight != m_codecContext->height)
-		                        {
-		                            OM_BLOG(LOG_DEBUG, "Need recreate m_swsContext");
-		                            sws_freeContext(m_swsContext);
-		                            m_swsContext = nullptr;
-		                        }
-		                    }
-
-		                    if (m_swsContext == nullptr)
-		                    {
-		                        m_swsContext = sws_getContext(
-		                            m_codecContext->width,
-		                            m_codecContext->height,
-		                            m_codecContext->pix_fmt,
-		                            m_codecContext->width,
-		                            m_codecContext->height,
-		                            AV_PIX_FMT_BGR24,
-		                            SWS_POINT,
-		                            nullptr, nullptr, nullptr
-		                        );
-		                        m_swsContext_SrcWidth = m_codecContext->width;
-		                        m_swsContext_SrcHeight = m_codecContext->height;
-		                        m_swsContext_SrcPixelFormat = m_codecContext->pix_fmt;
-		                        m_swsContext_DestWidth = m_codecContext->width;
-		                        m_swsContext_DestHeight = m_codecContext->height;
-		                        OM_BLOG(LOG_DEBUG, "sws_getContext(%d, %d, %d)", m_codecContext->width, m_codecContext->height, m_codecContext->pix_fmt);
-		                    }
-
-		                    assert(m_swsContext);
-
-		                    m_temp_texture = cv::Mat(m_codecContext->height, m_codecContext->width, CV_8UC3);
-		                    //uint8_t* data[1] = { new uint8_t[m_codecContext->width * m_codecContext->height * 4] };
-		                    uint8_t* data[1] = { m_temp_texture.ptr<uint8_t>(0) };
-		                    int stride[1] = { (int)m_codecContext->width * 3 };
-		                    sws_scale(m_swsContext, picture->data,
-		                        picture->linesize,
-		                        0,
-		                        picture->height,
-		                        data,
-		                        stride);
-		                
-		                    //cv::cvtColor(m_temp_texture, m_temp_texture, cv::COLOR_RGBA2BGR);
-		                    cv::flip(m_temp_texture, m_temp_texture, 0);
-
-		                    mostRecentImg = m_temp_texture;
-		                    mostRecentTimestamp = frame->localTimestamp;
-
-		                    //cv::imshow("img", m_temp_texture);
-		                    //cv::waitKey(10);
-
-		                    /*obs_enter_graphics();
-		                    if (m_temp_texture)
-		                    {
-		                        gs_texture_destroy(m_temp_texture);
-		                        m_temp_texture = nullptr;
-		                    }
-		                    m_temp_texture = gs_texture_create(m_codecContext->width,
-		                        m_codecContext->height,
-		                        GS_RGBA,
-		                        1,
-		                        const_cast<const uint8_t**>(&data[0]),
-		                        0);
-		                    obs_leave_graphics();
-
-		                    delete data[0];*/
-		                }
-		            }
-
-		            av_frame_free(&picture);
-		            av_packet_free(&packet);
-		            
-		            #endif
-		        } else {
-		        	++m_videoFrameIndex;
-		        }
-
-                //auto end = std::chrono::steady_clock::now();
-		        //printf("decode frame: %lf ms\n", std::chrono::duration_cast<std::chrono::microseconds>(end - start).count()/1000.0);
-
-                if(!skipOldFrames)
-                    break;
-            }
-            else if (frame->m_type == Frame::PayloadType::AUDIO_SAMPLERATE)
-            {
-                m_audioSampleRate = *(uint32_t*)(frame->m_payload.data());
-                OM_BLOG(LOG_DEBUG, "[AUDIO_SAMPLERATE] %d", m_audioSampleRate);
-            }
-            else if (frame->m_type == Frame::PayloadType::AUDIO_DATA)
-            {
-                m_cachedAudioFrames.push_back(std::make_pair(m_audioFrameIndex, frame));
-                //fwrite(frame->m_payload.data(), 1, frame->m_payload.size(), debugAudioFile);
-                ++m_audioFrameIndex;
-#if _DEBUG
-                double timePassed = m_frameCollection.GetNbTickSinceFirstFrame();
-                OM_BLOG(LOG_DEBUG, "[%lf][AUDIO_DATA] timestamp", timePassed);
+    //reallocated only if the size or type changed
+    output->create(height, width, isAlpha ? CV_8UC1 : CV_8UC3);
+    //the image is upside down : write it from the last row, with a negative stride
+    uint8_t* data[1] = { output->ptr<uint8_t>(height - 1) };
+    int stride[1] = { -(int)output->step };
+    sws_scale(m_layerSwsContext[layer], srcData, picture->linesize, 0, picture->height, data, stride);
+    return true;
+}
 #endif
-            }
-            else
-            {
-                OM_BLOG(LOG_ERROR, "Unknown payload type: %u", frame->m_type);
-            }
-        }
+
+int QuestVideoMngrImpl::getMostRecentAudio(QuestAudioData*** listAudioData)
+{
+    //the audio received since the last call
+    {
+        std::lock_guard<std::mutex> lock(m_outputMutex);
+        clearMostRecentAudioFrameList();
+        //the audio is only kept from the first call
+        if (!m_pendingAudioEnabled)
+            enablePendingAudio();
+        for (size_t i = 0; i < m_pendingAudioCount; i++)
+            mostRecentAudioFrames.push_back(m_pendingAudioRing[(m_pendingAudioStart + i) % maxPendingAudioFrames]);
+        m_pendingAudioStart = 0;
+        m_pendingAudioCount = 0;
     }
+    *listAudioData = mostRecentAudioFrames.data();
+    return (int)mostRecentAudioFrames.size();
 }
 
-uint32_t QuestVideoMngrImpl::getWidth()//get img width
+void QuestVideoMngrImpl::setAudioRingSize(int nbFrames)
 {
-	return m_width;
+    //room for stereo
+    m_audioRing.allocate(nbFrames > 0 ? 2 * (size_t)nbFrames : 0);
 }
 
-uint32_t QuestVideoMngrImpl::getHeight()//get img height
+int QuestVideoMngrImpl::readAudio(float *dst, int nbFrames, QuestAudioReadInfo *info)
 {
-	return m_height;
+    QuestAudioReadInfo firstInfo;
+    int nbRead = 0;
+    while (nbRead < nbFrames)
+    {
+        const float *data;
+        QuestAudioReadInfo spanInfo;
+        int n = peekAudio(&data, &spanInfo);
+        if (n <= 0)
+            break;
+        if (nbRead == 0)
+            firstInfo = spanInfo;
+        else if (spanInfo.nbChannels != firstInfo.nbChannels || spanInfo.sampleRate != firstInfo.sampleRate)
+            break;//the format changed, returned by the next call
+        n = std::min(n, nbFrames - nbRead);
+        memcpy(dst + (size_t)nbRead * firstInfo.nbChannels, data, (size_t)n * firstInfo.nbChannels * sizeof(float));
+        consumeAudio(n);
+        nbRead += n;
+    }
+    if (info != NULL && nbRead > 0)
+        *info = firstInfo;
+    return nbRead;
 }
 
-#ifdef LIBQUESTMR_USE_OPENCV
-cv::Mat QuestVideoMngrImpl::getMostRecentImg(uint64_t *timestamp, int *frameId)
+int QuestVideoMngrImpl::peekAudio(const float **data, QuestAudioReadInfo *info)
 {
-	if(timestamp != NULL)
-		*timestamp = mostRecentTimestamp;
-    if(frameId != NULL)
-        *frameId = m_videoFrameIndex;
-	return mostRecentImg;
+    const AudioRingBuffer::Packet *packet;
+    size_t frameOffset;
+    size_t nbFrames = m_audioRing.peek(data, &packet, &frameOffset);
+    if (nbFrames == 0)
+        return 0;
+    if (info != NULL)
+    {
+        info->nbChannels = packet->nbChannels;
+        info->sampleRate = packet->sampleRate;
+        info->localTimestamp = packet->localTimestamp;
+        info->deviceTimestamp = packet->deviceTimestamp;
+        info->packetFrameOffset = (int)frameOffset;
+    }
+    return (int)nbFrames;
 }
-#endif
 
-int QuestVideoMngrImpl::getMostRecentAudio(QuestAudioData*** listAudioData)
+void QuestVideoMngrImpl::consumeAudio(int nbFrames)
 {
-    *listAudioData = &mostRecentAudioFrames[0];
-    return (int)mostRecentAudioFrames.size();
+    if (nbFrames > 0)
+        m_audioRing.consume(nbFrames);
 }
 
 
 void QuestVideoMngrImpl::attachSource(std::shared_ptr<QuestVideoSource> videoSource)
 {
+    stopPipeline();
     this->videoSource = videoSource;
     m_frameCollection.Reset();
 
-    m_audioFrameIndex = 0;
-    m_videoFrameIndex = 0;
-    m_cachedAudioFrames.clear();
+    {
+        std::lock_guard<std::mutex> lock(m_outputMutex);
+        m_videoFrameIndex = 0;
+        #ifdef LIBQUESTMR_USE_FFMPEG
+        m_mostRecentYUVFrame.reset();
+        #endif
+    }
+    #ifdef LIBQUESTMR_USE_OPENCV
+    {
+        //the frame ids restart from 0
+        std::lock_guard<std::mutex> lock(m_convertMutex);
+        m_convertedFrameId = -1;
+    }
+    #endif
+    {
+        //the audio of the previous source
+        std::lock_guard<std::mutex> lock(m_outputMutex);
+        clearPendingAudioFrameList();
+    }
+    waitingForKeyFrame = false;
+    m_seekTargetFrame = 0;
+    sourceEnded = false;
 
+    //the new decoder starts with the requested settings
+    applyDecoderSettings();
     if (videoSource->isValid())
         StartDecoder();
+
+    std::lock_guard<std::mutex> lock(sourceMutex);
+    sourceAttachCount++;
+    sourceCond.notify_all();
+}
+
+void QuestVideoMngrImpl::endOfSource()
+{
+    if (sourceEnded)
+        return;
+    sourceEnded = true;
+    #ifdef LIBQUESTMR_USE_FFMPEG
+    flushDecoder();
+    #endif
+    if (dynamic_cast<QuestVideoSourceFile*>(videoSource.get()) == NULL)
+        detachSource();
 }
 
 void QuestVideoMngrImpl::detachSource()
@@ -622,6 +2217,7 @@ void QuestVideoMngrImpl::detachSource()
         return;
     }
 
+    stopPipeline();
     StopDecoder();
 
     videoSource = NULL;
@@ -632,6 +2228,42 @@ QuestVideoSource::~QuestVideoSource()
 {
 }
 
+bool QuestVideoSource::hasRecvSpan()
+{
+    return false;
+}
+
+int QuestVideoSource::recvSpan(const char **data, size_t maxSize, uint64_t *timestamp, uint64_t *recvTimeUs)
+{
+    return -1;
+}
+
+void QuestVideoSource::releaseRecvSpan(size_t size)
+{
+}
+
+std::shared_ptr<const void> QuestVideoSource::getRecvSpanOwner()
+{
+    return NULL;
+}
+
+const QuestFrameIndexEntry *QuestVideoSource::getFrameIndex(int *nbFrames)
+{
+    *nbFrames = 0;
+    return NULL;
+}
+
+bool QuestVideoSource::seekToFrame(int frameId)
+{
+    return false;
+}
+
+bool QuestVideoSource::waitForData(int timeoutMs)
+{
+    //unbuffered sources block in recv()
+    return isValid();
+}
+
 class QuestVideoSourceFileImpl : public QuestVideoSourceFile
 {
 public:
@@ -639,14 +2271,52 @@ public:
 	virtual ~QuestVideoSourceFileImpl();
 	virtual bool isValid();
 	virtual int recv(char *buf, size_t bufferSize, uint64_t *timestamp);
-
-    void open(const char *filename);
+    virtual bool hasRecvSpan();
+    virtual int recvSpan(const char **data, size_t maxSize, uint64_t *timestamp, uint64_t *recvTimeUs);
+    virtual void releaseRecvSpan(size_t size);
+    virtual std::shared_ptr<const void> getRecvSpanOwner();
+    virtual const QuestFrameIndexEntry *getFrameIndex(int *nbFrames);
+    virtual bool seekToFrame(int frameId);
+
+    void open(const char *filename, bool useMemoryMapping = true);
     void close();
 
+    virtual uint64_t getReadPosition();
+    virtual uint64_t getFileSize();
+
 private:
+    void buildFrameIndex();
+    bool loadSegmentIndex();
+    size_t readAt(uint64_t offset, unsigned char *buffer, size_t size);
+
     FILE *file = NULL;
+    //if the file is memory-mapped, it is read directly from the mapping and file is NULL
+    std::shared_ptr<MappedFile> mappedFile;
+    uint64_t mappedReadPos = 0;
+    uint64_t fileSize = 0;
+    std::vector<QuestFrameIndexEntry> frameIndex;
+    bool frameIndexBuilt = false;
 };
 
+//64-bit file positions, recordings can be larger than 2GB
+static bool fseek64(FILE *file, uint64_t offset, int origin = SEEK_SET)
+{
+#ifdef _WIN32
+    return _fseeki64(file, static_cast<__int64>(offset), origin) == 0;
+#else
+    return fseeko(file, static_cast<off_t>(offset), origin) == 0;
+#endif
+}
+
+static uint64_t ftell64(FILE *file)
+{
+#ifdef _WIN32
+    return static_cast<uint64_t>(_ftelli64(file));
+#else
+    return static_cast<uint64_t>(ftello(file));
+#endif
+}
+
 QuestVideoSourceFile::~QuestVideoSourceFile()
 {
 }
@@ -660,19 +2330,181 @@ QuestVideoSourceFileImpl::~QuestVideoSourceFileImpl()
     close();
 }
 
-void QuestVideoSourceFileImpl::open(const char *filename)
+void QuestVideoSourceFileImpl::open(const char *filename, bool useMemoryMapping)
 {
-    if (file != NULL)
+    if (file != NULL || mappedFile != NULL)
     {
         OM_BLOG(LOG_ERROR, "Already opened");
         return;
     }
 
+    frameIndex.clear();
+    frameIndexBuilt = false;
+    if (useMemoryMapping)
+    {
+        std::shared_ptr<MappedFile> mapping = std::make_shared<MappedFile>();
+        if (mapping->open(filename))
+        {
+            mapping->adviseSequential();
+            mappedFile = mapping;
+            mappedReadPos = 0;
+            fileSize = mapping->size();
+            return;
+        }
+        OM_BLOG(LOG_INFO, "Unable to map %s, reading it with fread", filename);
+    }
+
     file = fopen(filename, "rb");
+    fileSize = 0;
+    if (file != NULL && fseek64(file, 0, SEEK_END))
+    {
+        fileSize = ftell64(file);
+        fseek64(file, 0);
+    }
+}
+
+size_t QuestVideoSourceFileImpl::readAt(uint64_t offset, unsigned char *buffer, size_t size)
+{
+    if (mappedFile != NULL)
+    {
+        if (offset >= fileSize)
+            return 0;
+        size = static_cast<size_t>(std::min(static_cast<uint64_t>(size), fileSize - offset));
+        memcpy(buffer, mappedFile->data() + offset, size);
+        return size;
+    }
+    if (file == NULL || !fseek64(file, offset))
+        return 0;
+    return fread(buffer, 1, size, file);
+}
+
+//index stored at the end of a completed recording segment, avoids reading the whole file
+bool QuestVideoSourceFileImpl::loadSegmentIndex()
+{
+    SegmentIndexTrailer trailer;
+    if (fileSize < sizeof(FrameHeader) + sizeof(trailer)
+        || readAt(fileSize - sizeof(trailer), reinterpret_cast<unsigned char*>(&trailer), sizeof(trailer)) != sizeof(trailer)
+        || memcmp(trailer.magic, SegmentIndexMagic, sizeof(trailer.magic)) != 0 || trailer.version != SegmentIndexVersion
+        || trailer.indexOffset + sizeof(FrameHeader) + static_cast<uint64_t>(trailer.nbEntries) * sizeof(SegmentIndexEntry) + sizeof(trailer) != fileSize)
+        return false;
+    unsigned char header[sizeof(FrameHeader)];
+    if (readAt(trailer.indexOffset, header, sizeof(header)) != sizeof(header))
+        return false;
+    FrameHeader frameHeader = FrameCollection::readFrameHeader(header);
+    if (!FrameCollection::isValidFrameHeader(frameHeader) || frameHeader.PayloadType != static_cast<uint32_t>(Frame::PayloadType::SEGMENT_INDEX))
+        return false;
+
+    std::vector<SegmentIndexEntry> entries(trailer.nbEntries);
+    size_t size = entries.size() * sizeof(SegmentIndexEntry);
+    if (size > 0 && readAt(trailer.indexOffset + sizeof(FrameHeader), reinterpret_cast<unsigned char*>(&entries[0]), size) != size)
+        return false;
+    frameIndex.resize(entries.size());
+    for (size_t i = 0; i < entries.size(); i++)
+    {
+        QuestFrameIndexEntry& entry = frameIndex[i];
+        memset(&entry, 0, sizeof(entry));
+        entry.offset = entries[i].offset;
+        entry.payloadType = entries[i].payloadType;
+        entry.payloadLength = entries[i].payloadLength;
+        if (entry.payloadType == static_cast<uint32_t>(Frame::PayloadType::VIDEO_DATA)) {
+            entry.keyFrame = entries[i].param0 != 0;
+        } else if (entry.payloadType == static_cast<uint32_t>(Frame::PayloadType::VIDEO_DIMENSION)) {
+            entry.width = entries[i].param0;
+            entry.height = entries[i].param1;
+        } else if (entry.payloadType == static_cast<uint32_t>(Frame::PayloadType::AUDIO_SAMPLERATE)) {
+            entry.sampleRate = entries[i].param0;
+        }
+    }
+    OM_BLOG(LOG_INFO, "frame index : %d frames (segment index)", (int)frameIndex.size());
+    return true;
+}
+
+void QuestVideoSourceFileImpl::buildFrameIndex()
+{
+    frameIndexBuilt = true;
+    frameIndex.clear();
+    if (file == NULL && mappedFile == NULL)
+        return;
+    uint64_t currentPos = getReadPosition();
+    if (loadSegmentIndex())
+    {
+        if (file != NULL)
+            fseek64(file, currentPos);
+        return;
+    }
+    frameIndex.clear();
+
+    //only read the header and the start of the payload of each frame, enough to detect the keyframes
+    const size_t maxPayloadRead = 256;
+    unsigned char buffer[sizeof(FrameHeader) + maxPayloadRead];
+    uint64_t offset = 0;
+    while (true)
+    {
+        size_t sizeRead = readAt(offset, buffer, sizeof(buffer));
+        if (sizeRead < sizeof(FrameHeader))
+            break;
+        FrameHeader frameHeader = FrameCollection::readFrameHeader(buffer);
+        if (frameHeader.Magic != FrameMagic || frameHeader.PayloadLength != frameHeader.TotalDataLengthExcludingMagic + sizeof(uint32_t) - sizeof(FrameHeader)
+            || offset + sizeof(FrameHeader) + frameHeader.PayloadLength > fileSize
+            || frameHeader.PayloadType == static_cast<uint32_t>(Frame::PayloadType::SEGMENT_INDEX))
+            break;
+
+        const unsigned char *payload = buffer + sizeof(FrameHeader);
+        size_t payloadRead = std::min(sizeRead - sizeof(FrameHeader), static_cast<size_t>(frameHeader.PayloadLength));
+        QuestFrameIndexEntry entry;
+        memset(&entry, 0, sizeof(entry));
+        entry.offset = offset;
+        entry.payloadType = frameHeader.PayloadType;
+        entry.payloadLength = frameHeader.PayloadLength;
+        if (frameHeader.PayloadType == static_cast<uint32_t>(Frame::PayloadType::VIDEO_DATA)) {
+            entry.keyFrame = isH264KeyFrame(payload, payloadRead);
+        } else if (frameHeader.PayloadType == static_cast<uint32_t>(Frame::PayloadType::VIDEO_DIMENSION) && payloadRead >= 8) {
+            entry.width = convertBytesToInt32(payload, false);
+            entry.height = convertBytesToInt32(payload + 4, false);
+        } else if (frameHeader.PayloadType == static_cast<uint32_t>(Frame::PayloadType::AUDIO_SAMPLERATE) && payloadRead >= 4) {
+            memcpy(&entry.sampleRate, payload, 4);
+        }
+        frameIndex.push_back(entry);
+        offset += sizeof(FrameHeader) + frameHeader.PayloadLength;
+    }
+    OM_BLOG(LOG_INFO, "frame index : %d frames", (int)frameIndex.size());
+    if (file != NULL)
+        fseek64(file, currentPos);
+}
+
+const QuestFrameIndexEntry *QuestVideoSourceFileImpl::getFrameIndex(int *nbFrames)
+{
+    if (!frameIndexBuilt)
+        buildFrameIndex();
+    *nbFrames = static_cast<int>(frameIndex.size());
+    return frameIndex.empty() ? NULL : &frameIndex[0];
+}
+
+bool QuestVideoSourceFileImpl::seekToFrame(int frameId)
+{
+    int nbFrames;
+    const QuestFrameIndexEntry *index = getFrameIndex(&nbFrames);
+    if (index == NULL || frameId < 0 || frameId >= nbFrames)
+        return false;
+    if (mappedFile != NULL) {
+        mappedReadPos = index[frameId].offset;
+        return true;
+    }
+    return fseek64(file, index[frameId].offset);
 }
 
 int QuestVideoSourceFileImpl::recv(char *buf, size_t bufferSize, uint64_t *timestamp)
 {
+    if (mappedFile != NULL)
+    {
+        const char *data;
+        int size = recvSpan(&data, bufferSize, timestamp, NULL);
+        if (size > 0) {
+            memcpy(buf, data, size);
+            releaseRecvSpan(size);
+        }
+        return size;
+    }
     if(feof(file))
         return 0;
     int sizeRead = static_cast<int>(::fread(buf, 1, bufferSize, file));
@@ -681,8 +2513,51 @@ int QuestVideoSourceFileImpl::recv(char *buf, size_t bufferSize, uint64_t *times
     return sizeRead;
 }
 
+bool QuestVideoSourceFileImpl::hasRecvSpan()
+{
+    return mappedFile != NULL;
+}
+
+int QuestVideoSourceFileImpl::recvSpan(const char **data, size_t maxSize, uint64_t *timestamp, uint64_t *recvTimeUs)
+{
+    if (mappedFile == NULL || mappedReadPos >= fileSize)
+        return 0;
+    size_t size = static_cast<size_t>(std::min(static_cast<uint64_t>(maxSize), fileSize - mappedReadPos));
+    *data = reinterpret_cast<const char*>(mappedFile->data() + mappedReadPos);
+    //only meaningful without recorded timestamps (they replace it in the FrameCollection)
+    if (timestamp != NULL)
+        *timestamp = getTimestampMs();
+    if (recvTimeUs != NULL)
+        *recvTimeUs = getMonotonicTimeUs();
+    return static_cast<int>(size);
+}
+
+void QuestVideoSourceFileImpl::releaseRecvSpan(size_t size)
+{
+    mappedReadPos += size;
+}
+
+std::shared_ptr<const void> QuestVideoSourceFileImpl::getRecvSpanOwner()
+{
+    return mappedFile;
+}
+
+uint64_t QuestVideoSourceFileImpl::getReadPosition()
+{
+    if (mappedFile != NULL)
+        return mappedReadPos;
+    return file != NULL ? ftell64(file) : 0;
+}
+
+uint64_t QuestVideoSourceFileImpl::getFileSize()
+{
+    return fileSize;
+}
+
 bool QuestVideoSourceFileImpl::isValid()
 {
+    if (mappedFile != NULL)
+        return mappedReadPos < fileSize;
     return file != NULL && !feof(file);
 }
 
@@ -691,16 +2566,11 @@ void QuestVideoSourceFileImpl::close()
     if(file != NULL)
         fclose(file);
     file = NULL;
+    //the frames still referencing the mapping keep it alive
+    mappedFile = NULL;
+    fileSize = 0;
 }
 
-class BufferWithTimestamp
-{
-public:
-    int length;
-    char *buffer;
-    uint64_t timestamp;
-};
-
 class QuestVideoSourceBufferedSocketImpl : public QuestVideoSourceBufferedSocket
 {
 public:
@@ -708,6 +2578,10 @@ public:
 	virtual ~QuestVideoSourceBufferedSocketImpl();
 	virtual bool isValid();
 	virtual int recv(char *buf, size_t bufferSize, uint64_t *timestamp);
+    virtual bool hasRecvSpan();
+    virtual int recvSpan(const char **data, size_t maxSize, uint64_t *timestamp, uint64_t *recvTimeUs);
+    virtual void releaseRecvSpan(size_t size);
+    virtual bool waitForData(int timeoutMs);
     virtual void setUseThread(bool useThread, int maxBufferSize);
     virtual int getBufferedDataLength();
 
@@ -721,10 +2595,8 @@ private:
     std::shared_ptr<BufferedSocket> m_connectSocket;
     int threadMaxBufferSize;
     std::thread *threadPtr;
-    std::mutex mutex;
-    std::vector<BufferWithTimestamp> receivedData;
-    volatile int receivedDataSize;
-    volatile bool stopped;
+    RecvRingBuffer receivedData;
+    std::atomic<bool> stopped;
 };
 
 QuestVideoSourceBufferedSocket::~QuestVideoSourceBufferedSocket()
@@ -735,8 +2607,7 @@ QuestVideoSourceBufferedSocketImpl::QuestVideoSourceBufferedSocketImpl()
 {
 	m_connectSocket = createBufferedSocket();
     threadPtr = NULL;
-    threadMaxBufferSize = 500*1024*1024;
-    receivedDataSize = 0;
+    threadMaxBufferSize = 64*1024*1024;
     stopped = true;
 }
 
@@ -752,17 +2623,13 @@ void QuestVideoSourceBufferedSocketImpl::setUseThread(bool useThread, int maxBuf
 
 int QuestVideoSourceBufferedSocketImpl::getBufferedDataLength()
 {
-    return receivedDataSize;
+    return static_cast<int>(receivedData.size());
 }
 
 void QuestVideoSourceBufferedSocketImpl::clearBufferedData()
 {
-    mutex.lock();
-    receivedDataSize = 0;
-    for(size_t i = 0; i < receivedData.size(); i++)
-        delete [] receivedData[i].buffer;
-    receivedData.clear();
-    mutex.unlock();
+    //only called while the receiver thread is stopped
+    receivedData.allocate(std::max(threadMaxBufferSize, 0));
 }
 
 
@@ -781,64 +2648,57 @@ bool QuestVideoSourceBufferedSocketImpl::Connect(const char *ipaddr, uint32_t po
 
 void QuestVideoSourceBufferedSocketImpl::threadFunc()
 {
-    const int bufferSize = 50000;
-    char buffer[bufferSize];
+    //limit the size of each read so that the timestamps stay accurate
+    const size_t maxReadSize = 256*1024;
     while(!stopped)
     {
-        while(receivedDataSize >= threadMaxBufferSize) {
-            if(stopped) {
-                return ;
-            }
-            std::this_thread::sleep_for(std::chrono::milliseconds(1));
-        }
-        int sizeRead = m_connectSocket->readData(buffer, bufferSize);
-        if(sizeRead <= 0) {
-            stopped = true;
+        char *buffer = NULL;
+        size_t freeSize = receivedData.waitForWriteSpan(&buffer);
+        if(freeSize == 0)
             break;
-        }
-        BufferWithTimestamp data;
-        data.timestamp = getTimestampMs();
-        data.buffer = new char[sizeRead];
-        memcpy(data.buffer, buffer, sizeRead);
-        data.length = sizeRead;
-        mutex.lock();
-        receivedData.push_back(data);
-        receivedDataSize += sizeRead;
-        mutex.unlock();
+        int sizeRead = m_connectSocket->readData(buffer, static_cast<int>(std::min(freeSize, maxReadSize)));
+        if(sizeRead <= 0)
+            break;
+        receivedData.commitWrite(sizeRead, getTimestampMs(), getMonotonicTimeUs());
     }
+    stopped = true;
+    receivedData.close();
+}
+
+bool QuestVideoSourceBufferedSocketImpl::hasRecvSpan()
+{
+    return threadPtr != NULL || receivedData.size() > 0;
+}
+
+int QuestVideoSourceBufferedSocketImpl::recvSpan(const char **data, size_t maxSize, uint64_t *timestamp, uint64_t *recvTimeUs)
+{
+    size_t size = receivedData.waitForReadSpan(data, timestamp, -1, recvTimeUs);
+    return static_cast<int>(std::min(size, maxSize));
+}
+
+void QuestVideoSourceBufferedSocketImpl::releaseRecvSpan(size_t size)
+{
+    receivedData.consume(size);
+}
+
+bool QuestVideoSourceBufferedSocketImpl::waitForData(int timeoutMs)
+{
+    if(!hasRecvSpan())
+        return isValid();
+    const char *data;
+    return receivedData.waitForReadSpan(&data, NULL, timeoutMs) > 0;
 }
 
 int QuestVideoSourceBufferedSocketImpl::recv(char *buf, size_t bufferSize, uint64_t *timestamp)
 {
-    if(threadPtr != NULL || receivedDataSize > 0) {
-        while(receivedDataSize == 0) {
-            if(stopped) {
-                return 0;
-            }
-            std::this_thread::sleep_for(std::chrono::milliseconds(1));
-        }
-        mutex.lock();
-        BufferWithTimestamp data = receivedData[0];
-        if(timestamp != NULL)
-            *timestamp = data.timestamp;
-
-        int readSize = 0;
-        if(data.length <= bufferSize) {
-            receivedDataSize -= data.length;
-            receivedData.erase(receivedData.begin());
-            readSize = data.length;
-            memcpy(buf, data.buffer, data.length);
-            delete [] data.buffer;
-        } else {
-            receivedDataSize -= bufferSize;
-            readSize = bufferSize;
-            memcpy(buf, data.buffer, bufferSize);
-            for(size_t i = 0; i < data.length-bufferSize; i++)
-                data.buffer[i] = data.buffer[i+bufferSize];
-            data.length -= bufferSize;
+    if(hasRecvSpan()) {
+        const char *data;
+        int size = recvSpan(&data, bufferSize, timestamp, NULL);
+        if(size > 0) {
+            memcpy(buf, data, size);
+            releaseRecvSpan(size);
         }
-        mutex.unlock();
-        return readSize;
+        return size;
     } else {
         int sizeRead = m_connectSocket->readData(buf, (int)bufferSize);
         if(timestamp != NULL)
@@ -849,14 +2709,16 @@ int QuestVideoSourceBufferedSocketImpl::recv(char *buf, size_t bufferSize, uint6
 
 bool QuestVideoSourceBufferedSocketImpl::isValid()
 {
-    return receivedDataSize > 0 || (!stopped && m_connectSocket->isConnected());
+    return receivedData.size() > 0 || (!stopped && m_connectSocket->isConnected());
 }
 
 void QuestVideoSourceBufferedSocketImpl::Disconnect()
 {
     stopped = true;
+    receivedData.close();
     if(threadPtr != NULL) {
         threadPtr->join();
+        delete threadPtr;
         threadPtr = NULL;
     }
     m_connectSocket->disconnect();
@@ -869,7 +2731,6 @@ public:
 		:mngr(mngr)
 	{
 		finished = false;
-        mostRecentTimestamp = 0;
         mostRecentFrameId = -1;
 	}
 
@@ -881,6 +2742,7 @@ public:
     virtual void setFinishedVal(bool val)
     {
         finished = val;
+        newImgSignal.notify();
     }
 
     //Thread-safe function to know if the communication is finished
@@ -893,41 +2755,111 @@ public:
     virtual cv::Mat getMostRecentImg(uint64_t *timestamp, int *frameId = NULL)
     {
         cv::Mat img;
-		mutex.lock();
-		img = mostRecentImg;
+        std::shared_ptr<QuestYUVFrame> frame;
+        {
+            //converted here from the published frame, only for the frames that are asked for,
+            //the result is kept in the slot for the next calls
+            std::lock_guard<std::mutex> lock(readerMutex);
+            publishedFrames.update();
+            PublishedFrame& published = publishedFrames.front();
+            frame = published.frame;
+            if(frame != NULL && published.img.empty())
+                published.img = mngr->convertImg(*frame);
+            img = published.img;
+        }
         if(timestamp != NULL)
-            *timestamp = mostRecentTimestamp;
+            *timestamp = frame != NULL ? frame->getTimestamp() : 0;
         if(frameId != NULL)
-            *frameId = mostRecentFrameId;
-		mutex.unlock();
-		return img;
+            *frameId = frame != NULL ? frame->getFrameId() : -1;
+        if(frame != NULL)
+            mngr->notifyFrameConsumed(frame->getFrameId());
+        return img;
     }
     #endif
+
+    virtual std::shared_ptr<QuestYUVFrame> getMostRecentFrameYUV()
+    {
+        std::shared_ptr<QuestYUVFrame> frame;
+        {
+            //the readers only wait for each other, never for the decoding thread
+            std::lock_guard<std::mutex> lock(readerMutex);
+            publishedFrames.update();
+            frame = publishedFrames.front().frame;
+        }
+        if(frame != NULL)
+            mngr->notifyFrameConsumed(frame->getFrameId());
+        return frame;
+    }
+
+    virtual int subscribe(std::function<void(const QuestStreamEvent&)> callback)
+    {
+        return mngr->subscribe(callback);
+    }
+
+    virtual int subscribeQueue(int policy, int maxQueueSize = 64)
+    {
+        return mngr->subscribeQueue(policy, maxQueueSize);
+    }
+
+    virtual bool waitEvent(int subscriptionId, QuestStreamEvent *event, int timeoutMs = -1)
+    {
+        return mngr->waitEvent(subscriptionId, event, timeoutMs);
+    }
+
+    virtual void unsubscribe(int subscriptionId)
+    {
+        mngr->unsubscribe(subscriptionId);
+    }
+
+    virtual bool waitForNewImg(int timeoutMs, int lastFrameId = -1)
+    {
+        if(lastFrameId < 0)
+            lastFrameId = mostRecentFrameId;
+        newImgSignal.wait([&]() { return mostRecentFrameId != lastFrameId || finished; }, timeoutMs);
+        return mostRecentFrameId != lastFrameId;
+    }
     
     virtual void threadFunc()
     {
         while(!isFinished())
 		{
+            //block until there is something to decode, the timeouts only bound the reaction time to setFinishedVal()
+            if(!mngr->waitForData(100))
+            {
+                //returns at once without source : wait for the next one instead of spinning
+                mngr->waitForSource(100);
+                continue;
+            }
 			mngr->VideoTickImpl();
-            uint64_t timestamp;
-            int frameId;
-            cv::Mat img = mngr->getMostRecentImg(&timestamp, &frameId);
-            if(frameId != mostRecentFrameId) {
-                mutex.lock();
-                mostRecentImg = img.clone();
-                mostRecentTimestamp = timestamp;
-                mostRecentFrameId = frameId;
-                mutex.unlock();
+            //only a reference to the decoded picture, the BGR conversion is done by the readers of getMostRecentImg()
+            std::shared_ptr<QuestYUVFrame> frameYUV = mngr->getMostRecentFrameYUV();
+            if(frameYUV != NULL && frameYUV->getFrameId() != mostRecentFrameId) {
+                PublishedFrame& published = publishedFrames.back();
+                published.frame = frameYUV;
+                #ifdef LIBQUESTMR_USE_OPENCV
+                published.img.release();
+                #endif
+                publishedFrames.publish();
+                mostRecentFrameId = frameYUV->getFrameId();
+                newImgSignal.notify();
             }
 		}
     }
 private:
-    std::mutex mutex;
 	std::shared_ptr<QuestVideoMngr> mngr;
-	bool finished;
-    cv::Mat mostRecentImg;
-    uint64_t mostRecentTimestamp;
-    int mostRecentFrameId;
+	std::atomic<bool> finished;
+    struct PublishedFrame
+    {
+        std::shared_ptr<QuestYUVFrame> frame;
+        #ifdef LIBQUESTMR_USE_OPENCV
+        cv::Mat img;//BGR conversion of frame, done by the first reader asking for it
+        #endif
+    };
+    //frames published by threadFunc, the frame handles (timestamp, id, planes) stay valid while they are held
+    TripleBuffer<PublishedFrame> publishedFrames;
+    std::mutex readerMutex;
+    std::atomic<int> mostRecentFrameId;
+    RingSignal newImgSignal;//signaled when a frame is published or the thread is finished
 };
 
 QuestVideoMngrThreadData::~QuestVideoMngrThreadData()
@@ -977,52 +2909,6 @@ extern "C"
 		delete threadData;
 	}
 
-
-    bool loadQuestRecordedTimestamps(const char *filename, std::vector<uint64_t> *listTimestamp, std::vector<uint32_t> *listType, std::vector<uint32_t> *listSize, std::vector<std::vector<std::string> > *listExtraData)
-    {
-        if(listTimestamp != NULL)
-            listTimestamp->clear();
-        if(listType != NULL)
-            listType->clear();
-        if(listSize != NULL)
-            listSize->clear();
-        if(listExtraData != NULL)
-            listExtraData->clear();
-        
-        std::ifstream input(filename);
-        if(!input.good())
-            return false;
-        std::string line;
-        while(std::getline(input, line))
-        {
-            uint64_t timestamp;
-            uint32_t type;
-            uint32_t size;
-            std::string timestampStr, typeStr, sizeStr;
-            std::istringstream str(line);
-            if(!std::getline(str, timestampStr, ',') || !std::getline(str, typeStr, ',') || !std::getline(str, sizeStr, ','))
-                break;
-
-            std::istringstream(timestampStr) >> timestamp;
-            std::istringstream(typeStr) >> type;
-            std::istringstream(sizeStr) >> size;
-            
-            if(listTimestamp != NULL)
-                listTimestamp->push_back(timestamp);
-            if(listType != NULL)
-                listType->push_back(type);
-            if(listSize != NULL)
-                listSize->push_back(size);
-            if(listExtraData != NULL) {
-                std::vector<std::string> data;
-                std::string tmp;
-                while(std::getline(str, tmp, ','))
-                    data.push_back(tmp);
-                listExtraData->push_back(data);
-            }
-        }
-        return true;
-    }
 }
 
 #ifdef LIBQUESTMR_USE_OPENCV
@@ -1065,6 +2951,45 @@ extern "C"
         }
         return result;
     }
+
+    void composeMixedRealityImg(cv::Mat& background, const cv::Mat& foreground, const cv::Mat& foregroundAlpha, const cv::Mat& camImg, const cv::Mat& camAlpha)
+    {
+        int camAlphaChannelCount = camAlpha.channels();
+        for(int i = 0; i < background.rows; i++)
+        {
+            unsigned char *resultPtr = background.ptr<unsigned char>(i);
+            const unsigned char *fgPtr = foreground.ptr<unsigned char>(i);
+            const unsigned char *fgAlphaPtr = foregroundAlpha.ptr<unsigned char>(i);
+            const unsigned char *camImgPtr = camImg.ptr<unsigned char>(i);
+            const unsigned char *camAlphaPtr = camAlpha.ptr<unsigned char>(i);
+
+            int width = std::min(background.cols, camImg.cols);
+            if(i >= camImg.rows)
+                width = 0;
+            for(int j = width; j > 0; j--) {
+                int alpha = *camAlphaPtr;
+                int fgAlpha = *fgAlphaPtr;
+                for(int k = 3; k > 0; k--) {
+                    *resultPtr = ((255-alpha) * (*resultPtr) + alpha * (*camImgPtr))/255;
+                    *resultPtr = ((255-fgAlpha) * (*resultPtr) + fgAlpha * (*fgPtr))/255;
+                    resultPtr++;
+                    fgPtr++;
+                    camImgPtr++;
+                }
+                fgAlphaPtr++;
+                camAlphaPtr += camAlphaChannelCount;
+            }
+            for(int j = background.cols - width; j > 0; j--) {
+                int fgAlpha = *fgAlphaPtr;
+                for(int k = 3; k > 0; k--) {
+                    *resultPtr = ((255-fgAlpha) * (*resultPtr) + fgAlpha * (*fgPtr))/255;
+                    resultPtr++;
+                    fgPtr++;
+                }
+                fgAlphaPtr++;
+            }
+        }
+    }
 #endif
 
 }
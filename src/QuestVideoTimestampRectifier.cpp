@@ -3,6 +3,8 @@
 #include "frame.h"
 #include <fstream>
 #include <sstream>
+#include <stdlib.h>
+#include <string.h>
 
 namespace libQuestMR
 {
@@ -213,38 +215,63 @@ std::vector<uint64_t> rectifyAudioTimestamps(const std::vector<uint64_t>& listLo
 }
 
 std::vector<uint64_t> rectifyTimestamps(const std::vector<uint64_t>& listTimestamp, const std::vector<uint32_t>& listType, const std::vector<uint32_t>& listDataLength, const std::vector<std::vector<std::string> >& listExtraData)
+{
+	std::vector<QuestTimestampRecord> records(listTimestamp.size());
+	for(size_t i = 0; i < records.size(); i++) {
+		QuestTimestampRecord& record = records[i];
+		memset(&record, 0, sizeof(record));
+		record.timestamp = listTimestamp[i];
+		record.type = listType[i];
+		record.size = listDataLength[i];
+		if(i < listExtraData.size() && listExtraData[i].size() > 0) {
+			record.flags = QUEST_TIMESTAMP_RECORD_HAS_EXTRA_DATA;
+			if((Frame::PayloadType)listType[i] == Frame::PayloadType::AUDIO_DATA) {
+				record.audioTimestamp = strtoull(listExtraData[i][0].c_str(), NULL, 10);
+				record.param0 = listExtraData[i].size() > 1 ? atoi(listExtraData[i][1].c_str()) : 2;
+			} else {
+				record.param0 = atoi(listExtraData[i][0].c_str());
+			}
+		}
+	}
+	return rectifyTimestamps(records.empty() ? NULL : &records[0], records.size());
+}
+
+std::vector<uint64_t> rectifyTimestamps(const QuestTimestampRecord *records, size_t nbRecords)
 {
 	int audioHeaderSize = 16;
 	int nbChannels = 2;
 	int audioSamplingRate = 48000;
+	std::vector<uint64_t> listTimestamp(nbRecords);
+	std::vector<uint32_t> listType(nbRecords);
+	for(size_t i = 0; i < nbRecords; i++) {
+		listTimestamp[i] = records[i].timestamp;
+		listType[i] = records[i].type;
+	}
 	std::vector<uint64_t> listAudioDataTimestamp;
 	std::vector<double> listAudioDataQuestTimestamp;
 	std::vector<uint32_t> listAudioDataLength;
 	std::vector<double> listAudioRecordedLength;
 	std::vector<int> listAudioDataId;
 	listAudioRecordedLength.push_back(0);
-	for(size_t i = 0; i < listTimestamp.size(); i++) {
-		if((Frame::PayloadType)listType[i] == Frame::PayloadType::AUDIO_DATA) {
-			listAudioDataTimestamp.push_back(listTimestamp[i]);
-			listAudioDataLength.push_back(listDataLength[i]);
-			if(i < listExtraData.size() && listExtraData[i].size() > 0) {
-				uint64_t questTimestamp;
-				std::istringstream(listExtraData[i][0]) >> questTimestamp;
-				std::istringstream(listExtraData[i][1]) >> nbChannels;
-				listAudioDataQuestTimestamp.push_back(questTimestamp/1000.0);
-				//printf("questTimestamp: %s = %llu\n", listExtraData[i][0].c_str(), (unsigned long long)questTimestamp);
+	for(size_t i = 0; i < nbRecords; i++) {
+		const QuestTimestampRecord& record = records[i];
+		if((Frame::PayloadType)record.type == Frame::PayloadType::AUDIO_DATA) {
+			listAudioDataTimestamp.push_back(record.timestamp);
+			listAudioDataLength.push_back(record.size);
+			if((record.flags & QUEST_TIMESTAMP_RECORD_HAS_EXTRA_DATA) != 0) {
+				if(record.param0 > 0)
+					nbChannels = record.param0;
+				listAudioDataQuestTimestamp.push_back(record.audioTimestamp/1000.0);
 			} else {
 				return listTimestamp;
 			}
 			double recordedLength = listAudioRecordedLength[listAudioRecordedLength.size()-1];
-			double length = static_cast<double>(listDataLength[i] - audioHeaderSize) * (1000.0 / (nbChannels*4*audioSamplingRate)); //16 bits header, 1s = 1000 ms, 2 channels, 4 bytes, 48000 hz
+			double length = static_cast<double>(static_cast<int>(record.size) - audioHeaderSize) * (1000.0 / (nbChannels*4*audioSamplingRate)); //16 bits header, 1s = 1000 ms, 2 channels, 4 bytes, 48000 hz
 			listAudioRecordedLength.push_back(recordedLength+length);
 			listAudioDataId.push_back(i);
-		} else if((Frame::PayloadType)listType[i] == Frame::PayloadType::AUDIO_SAMPLERATE) {
-			if(i < listExtraData.size() && listExtraData[i].size() > 0) {
-				std::istringstream(listExtraData[i][0]) >> audioSamplingRate;
-				//printf("audio sample rate: %d\n", audioSamplingRate);
-			}
+		} else if((Frame::PayloadType)record.type == Frame::PayloadType::AUDIO_SAMPLERATE) {
+			if((record.flags & QUEST_TIMESTAMP_RECORD_HAS_EXTRA_DATA) != 0 && record.param0 > 0)
+				audioSamplingRate = record.param0;
 		}
 	}
 
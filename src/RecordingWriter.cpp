@@ -0,0 +1,467 @@
+#include "RecordingWriter.h"
+#include "log.h"
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+
+#ifdef _WIN32
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#include <windows.h>
+#include <io.h>
+#include <malloc.h>
+#include <sys/stat.h>
+#else
+#include <stdlib.h>
+#include <unistd.h>
+#endif
+
+namespace libQuestMR
+{
+
+//alignment of the buffers, the writes and the file offsets required by O_DIRECT
+static const size_t directIOAlignment = 4096;
+//a partially filled buffer is written after this delay, so a recording stopped abruptly loses little data
+static const int maxBufferDelayMs = 500;
+
+static uint8_t *allocateAlignedBuffer(size_t size)
+{
+#ifdef _WIN32
+	return static_cast<uint8_t*>(_aligned_malloc(size, directIOAlignment));
+#else
+	void *data = NULL;
+	if(posix_memalign(&data, directIOAlignment, size) != 0)
+		return NULL;
+	return static_cast<uint8_t*>(data);
+#endif
+}
+
+static void freeAlignedBuffer(uint8_t *data)
+{
+#ifdef _WIN32
+	_aligned_free(data);
+#else
+	free(data);
+#endif
+}
+
+RecordingWriter::RecordingWriter()
+	:m_bufferSize(0), m_currentBuffer(NULL), m_thread(NULL), m_isOpen(false), m_fd(-1), m_fileOffset(0), m_writeFailed(false),
+	 m_flushBuffer(NULL), m_directIO(false), m_totalBytes(0), m_queuedBytes(0), m_bytesWritten(0), m_writeTimeUs(0), m_nbStalls(0),
+	 m_nbFailedSwitches(0)
+{
+}
+
+RecordingWriter::~RecordingWriter()
+{
+	close();
+}
+
+int RecordingWriter::openFile(const char *filename, bool directIO)
+{
+#ifdef _WIN32
+	return _open(filename, _O_WRONLY | _O_CREAT | _O_TRUNC | _O_BINARY, _S_IREAD | _S_IWRITE);
+#else
+	int flags = O_WRONLY | O_CREAT | O_TRUNC;
+	#ifdef O_DIRECT
+	if(directIO)
+		flags |= O_DIRECT;
+	#endif
+	return ::open(filename, flags, 0644);
+#endif
+}
+
+void RecordingWriter::closeFile(int fd, uint64_t size)
+{
+	if(fd < 0)
+		return;
+#ifdef _WIN32
+	_close(fd);
+#else
+	if(m_directIO && ftruncate(fd, static_cast<off_t>(size)) != 0)
+		OM_BLOG(LOG_ERROR, "Unable to truncate the recording");
+	::close(fd);
+#endif
+}
+
+bool RecordingWriter::open(const char *filename, size_t bufferSize, int nbBuffers, bool directIO)
+{
+	close();
+	m_directIO = false;
+#if !defined(_WIN32) && defined(O_DIRECT)
+	if(directIO)
+	{
+		m_fd = openFile(filename, true);
+		m_directIO = m_fd >= 0;
+		if(!m_directIO)
+			OM_BLOG(LOG_INFO, "O_DIRECT not supported for %s, using buffered writes", filename);
+	}
+#endif
+	if(m_fd < 0)
+		m_fd = openFile(filename, false);
+	if(m_fd < 0)
+	{
+		OM_BLOG(LOG_ERROR, "Unable to open %s", filename);
+		return false;
+	}
+
+	nbBuffers = std::max(nbBuffers, 2);
+	m_bufferSize = std::max((bufferSize + directIOAlignment - 1) / directIOAlignment, static_cast<size_t>(1)) * directIOAlignment;
+	m_buffers.resize(nbBuffers);
+	bool allocated = true;
+	for(int i = 0; i < nbBuffers; i++)
+	{
+		m_buffers[i].data = allocateAlignedBuffer(m_bufferSize);
+		m_buffers[i].size = 0;
+		m_buffers[i].nextFilename.clear();
+		m_buffers[i].fileSize = 0;
+		m_buffers[i].sideFilename.clear();
+		allocated = allocated && m_buffers[i].data != NULL;
+	}
+	if(m_directIO)
+	{
+		m_flushBuffer = allocateAlignedBuffer(m_bufferSize);
+		allocated = allocated && m_flushBuffer != NULL;
+	}
+	if(!allocated)
+	{
+		OM_BLOG(LOG_ERROR, "Unable to allocate the buffers to write %s", filename);
+		freeBuffers();
+		closeFile(m_fd, 0);
+		m_fd = -1;
+		return false;
+	}
+	m_fullBuffers.allocate(nbBuffers);
+	m_freeBuffers.allocate(nbBuffers);
+	for(int i = 0; i < nbBuffers; i++)
+		m_freeBuffers.tryPush(&m_buffers[i]);
+	m_currentBuffer = NULL;
+	m_lastQueueTime = std::chrono::steady_clock::now();
+	m_fileOffset = 0;
+	m_writeFailed = false;
+	m_totalBytes = 0;
+	m_queuedBytes = 0;
+	m_bytesWritten = 0;
+	m_writeTimeUs = 0;
+	m_nbStalls = 0;
+	m_nbFailedSwitches = 0;
+	m_thread = new std::thread(&RecordingWriter::threadFunc, this);
+	m_isOpen = true;
+	return true;
+}
+
+void RecordingWriter::close()
+{
+	if(!m_isOpen.exchange(false))
+		return;
+	{
+		std::lock_guard<std::mutex> lock(m_currentBufferMutex);
+		if(m_currentBuffer != NULL && m_currentBuffer->size > 0)
+		{
+			padCurrentBuffer();
+			queueCurrentBuffer();
+		}
+	}
+	m_fullBuffers.close();
+	m_thread->join();
+	delete m_thread;
+	m_thread = NULL;
+
+	closeFile(m_fd, m_totalBytes);
+	m_fd = -1;
+	//after all the data, as the writer thread would do
+	if(!m_sideFilename.empty())
+	{
+		replaceFile(m_sideFilename.c_str(), m_sideContent);
+		m_sideFilename.clear();
+	}
+
+	Buffer *buffer;
+	while(m_freeBuffers.tryPop(&buffer))
+		;
+	freeBuffers();
+	m_currentBuffer = NULL;
+}
+
+void RecordingWriter::freeBuffers()
+{
+	for(size_t i = 0; i < m_buffers.size(); i++)
+		freeAlignedBuffer(m_buffers[i].data);
+	m_buffers.clear();
+	freeAlignedBuffer(m_flushBuffer);
+	m_flushBuffer = NULL;
+}
+
+//the lock is released while waiting, only the producer sets m_currentBuffer
+void RecordingWriter::acquireCurrentBuffer(std::unique_lock<std::mutex>& lock)
+{
+	Buffer *buffer = NULL;
+	if(!m_freeBuffers.tryPop(&buffer))
+	{
+		//the disk does not keep up, wait for a buffer to be written
+		m_nbStalls++;
+		lock.unlock();
+		m_freeBuffers.pop(&buffer);
+		lock.lock();
+	}
+	m_currentBuffer = buffer;
+}
+
+bool RecordingWriter::switchFile(const char *filename)
+{
+	if(!m_isOpen)
+		return false;
+	std::unique_lock<std::mutex> lock(m_currentBufferMutex);
+	//the last buffer of the file carries the switch, even if it is empty
+	if(m_currentBuffer == NULL)
+		acquireCurrentBuffer(lock);
+	padCurrentBuffer();
+	m_currentBuffer->nextFilename = filename;
+	m_currentBuffer->fileSize = m_totalBytes;
+	//swapped, the strings keep their capacity
+	m_currentBuffer->sideFilename.swap(m_sideFilename);
+	m_currentBuffer->sideContent.swap(m_sideContent);
+	m_sideFilename.clear();
+	queueCurrentBuffer();
+	m_totalBytes = 0;
+	return true;
+}
+
+void RecordingWriter::setSideFile(const char *filename, const std::string& content)
+{
+	m_sideFilename = filename;
+	m_sideContent = content;
+}
+
+#ifndef _WIN32
+//fsync of the directory of filename, so a rename in it is on disk
+static bool syncParentDirectory(const char *filename)
+{
+	const char *slash = strrchr(filename, '/');
+	std::string dirname = slash == NULL ? std::string(".") : slash == filename ? std::string("/") : std::string(filename, slash - filename);
+	int fd = ::open(dirname.c_str(), O_RDONLY);
+	if(fd < 0)
+		return false;
+	bool ok = fsync(fd) == 0;
+	::close(fd);
+	return ok;
+}
+#endif
+
+bool RecordingWriter::replaceFile(const char *filename, const std::string& content)
+{
+	std::string tmpFilename = std::string(filename) + ".tmp";
+	FILE *file = fopen(tmpFilename.c_str(), "wb");
+	if(file == NULL)
+	{
+		OM_BLOG(LOG_ERROR, "Unable to write %s", tmpFilename.c_str());
+		return false;
+	}
+	bool ok = fwrite(content.data(), 1, content.size(), file) == content.size();
+	//the content must be on disk before the rename, otherwise a power loss can leave an empty file under the final name
+	ok = ok && fflush(file) == 0;
+#ifdef _WIN32
+	ok = ok && _commit(_fileno(file)) == 0;
+#else
+	ok = ok && fsync(fileno(file)) == 0;
+#endif
+	ok = fclose(file) == 0 && ok;
+#ifdef _WIN32
+	//rename does not replace an existing file on Windows, MoveFileEx returns once the move is on disk
+	ok = ok && MoveFileExA(tmpFilename.c_str(), filename, MOVEFILE_REPLACE_EXISTING | MOVEFILE_WRITE_THROUGH) != 0;
+#else
+	ok = ok && rename(tmpFilename.c_str(), filename) == 0;
+#endif
+	if(!ok)
+	{
+		OM_BLOG(LOG_ERROR, "Unable to write %s", filename);
+		remove(tmpFilename.c_str());
+		return false;
+	}
+#ifndef _WIN32
+	//the file is replaced, but the rename can still be lost on a power loss until the directory is on disk
+	if(!syncParentDirectory(filename))
+		OM_BLOG(LOG_ERROR, "Unable to sync the directory of %s (errno %d)", filename, errno);
+#endif
+	return true;
+}
+
+void RecordingWriter::write(const void *data, size_t size)
+{
+	if(!m_isOpen)
+		return;
+	const uint8_t *src = static_cast<const uint8_t*>(data);
+	m_totalBytes += size;
+	m_queuedBytes += size;
+	std::unique_lock<std::mutex> lock(m_currentBufferMutex);
+	while(size > 0)
+	{
+		if(m_currentBuffer == NULL)
+			acquireCurrentBuffer(lock);
+		size_t n = std::min(size, m_bufferSize - m_currentBuffer->size);
+		memcpy(m_currentBuffer->data + m_currentBuffer->size, src, n);
+		m_currentBuffer->size += n;
+		src += n;
+		size -= n;
+		if(m_currentBuffer->size == m_bufferSize)
+			queueCurrentBuffer();
+	}
+}
+
+void RecordingWriter::flush()
+{
+	std::lock_guard<std::mutex> lock(m_currentBufferMutex);
+	if(!m_directIO && m_currentBuffer != NULL && m_currentBuffer->size > 0)
+		queueCurrentBuffer();
+}
+
+double RecordingWriter::getWriteThroughput() const
+{
+	uint64_t writeTimeUs = m_writeTimeUs.load();
+	return writeTimeUs > 0 ? static_cast<double>(m_bytesWritten.load()) / writeTimeUs : 0;
+}
+
+//direct writes are a multiple of the alignment, the file is truncated to its real size when it is closed
+void RecordingWriter::padCurrentBuffer()
+{
+	size_t padding = m_directIO ? (directIOAlignment - m_currentBuffer->size % directIOAlignment) % directIOAlignment : 0;
+	memset(m_currentBuffer->data + m_currentBuffer->size, 0, padding);
+	m_currentBuffer->size += padding;
+	m_queuedBytes += padding;
+}
+
+//called with m_currentBufferMutex locked
+void RecordingWriter::queueCurrentBuffer()
+{
+	//there is always room, the queue can hold all the buffers
+	m_fullBuffers.push(m_currentBuffer);
+	m_currentBuffer = NULL;
+	m_lastQueueTime = std::chrono::steady_clock::now();
+}
+
+void RecordingWriter::threadFunc()
+{
+	Buffer *buffer;
+	size_t flushedSize = 0;//part of the current buffer written by the last timed flush
+	while(true)
+	{
+		//the buffers queued before close() are all written
+		if(m_fullBuffers.pop(&buffer, maxBufferDelayMs) || (m_fullBuffers.isClosed() && m_fullBuffers.tryPop(&buffer)))
+		{
+			writeBuffer(buffer);
+			flushedSize = 0;
+		}
+		else if(m_fullBuffers.isClosed())
+			break;
+		else flushCurrentBuffer(&flushedSize);
+	}
+}
+
+void RecordingWriter::writeBuffer(Buffer *buffer)
+{
+	if(!m_writeFailed)
+	{
+		auto start = std::chrono::steady_clock::now();
+		m_writeFailed = !writeFile(buffer->data, buffer->size);
+		m_writeTimeUs += std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - start).count();
+		if(m_writeFailed)
+			OM_BLOG(LOG_ERROR, "Unable to write the recording (errno %d), the next data is dropped", errno);
+		else m_bytesWritten += buffer->size;
+	}
+	m_fileOffset += buffer->size;
+	m_queuedBytes -= buffer->size;
+	buffer->size = 0;
+	if(!buffer->nextFilename.empty())
+	{
+		closeFile(m_fd, buffer->fileSize);
+		m_fd = openFile(buffer->nextFilename.c_str(), m_directIO);
+		if(m_fd < 0)
+		{
+			OM_BLOG(LOG_ERROR, "Unable to open %s, the next data is dropped", buffer->nextFilename.c_str());
+			m_nbFailedSwitches++;
+		}
+		buffer->nextFilename.clear();
+		m_fileOffset = 0;
+		m_writeFailed = m_fd < 0;
+	}
+	if(!buffer->sideFilename.empty())
+	{
+		replaceFile(buffer->sideFilename.c_str(), buffer->sideContent);
+		buffer->sideFilename.clear();
+	}
+	m_freeBuffers.tryPush(buffer);
+}
+
+//no buffer was queued during maxBufferDelayMs : the writer thread writes the current buffer itself
+void RecordingWriter::flushCurrentBuffer(size_t *flushedSize)
+{
+	std::unique_lock<std::mutex> lock(m_currentBufferMutex);
+	//a buffer queued meanwhile is written first, the current buffer follows it in the file
+	if(m_currentBuffer == NULL || m_currentBuffer->size <= *flushedSize || m_fullBuffers.size() > 0
+		|| std::chrono::steady_clock::now() - m_lastQueueTime < std::chrono::milliseconds(maxBufferDelayMs))
+		return;
+	m_lastQueueTime = std::chrono::steady_clock::now();
+	if(!m_directIO)
+	{
+		Buffer *buffer = m_currentBuffer;
+		m_currentBuffer = NULL;
+		lock.unlock();
+		writeBuffer(buffer);
+		return;
+	}
+
+	//the producer keeps filling the buffer : a padded copy is written at its position in the file,
+	//overwritten when the buffer is queued
+	size_t size = m_currentBuffer->size;
+	memcpy(m_flushBuffer, m_currentBuffer->data, size);
+	lock.unlock();
+	size_t paddedSize = (size + directIOAlignment - 1) / directIOAlignment * directIOAlignment;
+	memset(m_flushBuffer + size, 0, paddedSize - size);
+	*flushedSize = size;
+	if(!m_writeFailed && !writeFileAt(m_flushBuffer, paddedSize, m_fileOffset))
+		OM_BLOG(LOG_ERROR, "Unable to write the current buffer of the recording (errno %d)", errno);
+}
+
+bool RecordingWriter::writeFile(const uint8_t *data, size_t size)
+{
+	while(size > 0)
+	{
+#ifdef _WIN32
+		int n = _write(m_fd, data, static_cast<unsigned int>(size));
+#else
+		ssize_t n = ::write(m_fd, data, size);
+		if(n < 0 && errno == EINTR)
+			continue;
+#endif
+		if(n <= 0)
+			return false;
+		data += n;
+		size -= static_cast<size_t>(n);
+	}
+	return true;
+}
+
+//only used with directIO, which is not available on Windows
+bool RecordingWriter::writeFileAt(const uint8_t *data, size_t size, uint64_t offset)
+{
+#ifdef _WIN32
+	return false;
+#else
+	while(size > 0)
+	{
+		ssize_t n = ::pwrite(m_fd, data, size, static_cast<off_t>(offset));
+		if(n < 0 && errno == EINTR)
+			continue;
+		if(n <= 0)
+			return false;
+		data += n;
+		size -= static_cast<size_t>(n);
+		offset += static_cast<uint64_t>(n);
+	}
+	return true;
+#endif
+}
+
+}
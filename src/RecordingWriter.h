@@ -0,0 +1,124 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include <atomic>
+#include <chrono>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include "RingBuffer.h"
+
+namespace libQuestMR
+{
+
+//Sequential file writer for the recordings : the data is copied into a pool of large buffers,
+//written by a dedicated thread, so a slow disk never blocks the producer while a buffer is free.
+//write() and flush() must be called by a single producer thread, the stats are thread-safe.
+//The writer thread also writes a buffer that is not filled within 500 ms, so a recording stopped abruptly loses little data.
+class RecordingWriter
+{
+public:
+	RecordingWriter();
+	~RecordingWriter();
+
+	//nbBuffers buffers of bufferSize bytes. With directIO, the file is written without the OS cache (O_DIRECT)
+	//from aligned buffers, if the platform supports it
+	bool open(const char *filename, size_t bufferSize = 1 << 20, int nbBuffers = 32, bool directIO = false);
+	//write the remaining data, wait for the writer thread and close the file
+	void close();
+
+	bool isOpen() const
+	{
+		return m_isOpen.load();
+	}
+
+	//copy the data, blocks only if all the buffers are waiting to be written (counted by getNbStalls())
+	void write(const void *data, size_t size);
+	//hand the current buffer to the writer thread even if it is not full (ignored with directIO)
+	void flush();
+	//continue in a new file : the writer thread completes the previous one, then opens the new one.
+	//If it can not be opened, the data is dropped until the next switch (counted by getNbFailedSwitches()).
+	//Returns false if the writer is not open
+	bool switchFile(const char *filename);
+	//small file (a manifest...) written by the writer thread with replaceFile(), once the data written so far is on disk :
+	//at the next switchFile() or close()
+	void setSideFile(const char *filename, const std::string& content);
+
+	//written to a temporary file, synced to disk then renamed, so a crash or a power loss never leaves a partial file
+	static bool replaceFile(const char *filename, const std::string& content);
+
+	size_t getQueuedBytes() const//received but not yet written
+	{
+		return static_cast<size_t>(m_queuedBytes.load());
+	}
+	uint64_t getBytesWritten() const
+	{
+		return m_bytesWritten.load();
+	}
+	double getWriteThroughput() const;//MB/s while writing to the file
+	uint64_t getNbStalls() const
+	{
+		return m_nbStalls.load();
+	}
+	uint64_t getNbFailedSwitches() const
+	{
+		return m_nbFailedSwitches.load();
+	}
+
+private:
+	RecordingWriter(const RecordingWriter&);
+	RecordingWriter& operator=(const RecordingWriter&);
+
+	struct Buffer
+	{
+		uint8_t *data;
+		size_t size;
+		std::string nextFilename;//if not empty, the writer thread continues in this file after the buffer
+		uint64_t fileSize;//size of the completed file if nextFilename is set
+		std::string sideFilename;//if not empty, sideContent is written to this file after the buffer
+		std::string sideContent;
+	};
+
+	int openFile(const char *filename, bool directIO);
+	void closeFile(int fd, uint64_t size);
+	void freeBuffers();
+	void acquireCurrentBuffer(std::unique_lock<std::mutex>& lock);
+	void padCurrentBuffer();
+	void queueCurrentBuffer();
+	void threadFunc();
+	void writeBuffer(Buffer *buffer);
+	void flushCurrentBuffer(size_t *flushedSize);
+	bool writeFile(const uint8_t *data, size_t size);
+	bool writeFileAt(const uint8_t *data, size_t size, uint64_t offset);
+
+	std::vector<Buffer> m_buffers;
+	size_t m_bufferSize;
+	SpscBlockingQueue<Buffer*> m_fullBuffers;//producer -> writer thread
+	SpscBlockingQueue<Buffer*> m_freeBuffers;//writer thread -> producer
+	//the producer fills m_currentBuffer, the writer thread takes it when it is not queued in time
+	std::mutex m_currentBufferMutex;
+	Buffer *m_currentBuffer;
+	std::chrono::steady_clock::time_point m_lastQueueTime;
+	std::string m_sideFilename;//set by setSideFile(), only used by the producer
+	std::string m_sideContent;
+	std::thread *m_thread;
+	std::atomic<bool> m_isOpen;
+
+	//used by the writer thread while it runs
+	int m_fd;
+	uint64_t m_fileOffset;//bytes of the full buffers written to the current file
+	bool m_writeFailed;
+	uint8_t *m_flushBuffer;//with directIO, aligned copy of the current buffer written by the timed flush
+	bool m_directIO;
+	uint64_t m_totalBytes;//received by write() for the current file, its size without the padding of the last direct write
+
+	std::atomic<uint64_t> m_queuedBytes;
+	std::atomic<uint64_t> m_bytesWritten;
+	std::atomic<uint64_t> m_writeTimeUs;
+	std::atomic<uint64_t> m_nbStalls;
+	std::atomic<uint64_t> m_nbFailedSwitches;
+};
+
+}
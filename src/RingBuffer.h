@@ -0,0 +1,640 @@
+#pragma once
+
+#include <stdint.h>
+#include <string.h>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+
+namespace libQuestMR
+{
+
+//Wakeup helper for the single-producer/single-consumer containers below.
+//The fast path (nobody waiting) is a single atomic load, the mutex is only taken to sleep or to wake a sleeper.
+class RingSignal
+{
+public:
+	RingSignal()
+		:m_nbWaiting(0)
+	{
+	}
+
+	void notify()
+	{
+		//order the data publication before reading the waiter count (pairs with the fence in wait())
+		std::atomic_thread_fence(std::memory_order_seq_cst);
+		if(m_nbWaiting.load() > 0)
+		{
+			std::lock_guard<std::mutex> lock(m_mutex);
+			m_cond.notify_all();
+		}
+	}
+
+	//wait until pred() is true, returns false on timeout (timeoutMs < 0 means no timeout)
+	template<typename Pred>
+	bool wait(Pred pred, int timeoutMs = -1)
+	{
+		if(pred())
+			return true;
+		std::unique_lock<std::mutex> lock(m_mutex);
+		m_nbWaiting++;
+		std::atomic_thread_fence(std::memory_order_seq_cst);
+		bool result;
+		if(timeoutMs < 0) {
+			m_cond.wait(lock, pred);
+			result = true;
+		} else {
+			result = m_cond.wait_for(lock, std::chrono::milliseconds(timeoutMs), pred);
+		}
+		m_nbWaiting--;
+		return result;
+	}
+
+private:
+	std::atomic<int> m_nbWaiting;
+	std::mutex m_mutex;
+	std::condition_variable m_cond;
+};
+
+//Preallocated lock-free ring of elements for one producer thread and one consumer thread.
+//Positions are absolute (never wrap), the storage index is position % capacity.
+template<typename T>
+class SpscRingBuffer
+{
+public:
+	SpscRingBuffer()
+		:m_capacity(0), m_writePos(0), m_readPos(0)
+	{
+	}
+
+	//not thread-safe, call it before starting the producer and consumer
+	void allocate(size_t capacity)
+	{
+		if(capacity != m_capacity)
+		{
+			m_buffer.reset(capacity > 0 ? new T[capacity] : NULL);
+			m_capacity = capacity;
+		}
+		reset();
+	}
+
+	//not thread-safe, call it when neither the producer nor the consumer is running
+	void reset()
+	{
+		m_writePos.store(0);
+		m_readPos.store(0);
+	}
+
+	size_t capacity() const
+	{
+		return m_capacity;
+	}
+
+	size_t size() const
+	{
+		return static_cast<size_t>(m_writePos.load(std::memory_order_acquire) - m_readPos.load(std::memory_order_acquire));
+	}
+
+	uint64_t getWritePos() const
+	{
+		return m_writePos.load(std::memory_order_acquire);
+	}
+
+	uint64_t getReadPos() const
+	{
+		return m_readPos.load(std::memory_order_acquire);
+	}
+
+	//producer side : contiguous free space starting at the write position
+	size_t getWriteSpan(T **data)
+	{
+		uint64_t writePos = m_writePos.load(std::memory_order_relaxed);
+		uint64_t readPos = m_readPos.load(std::memory_order_acquire);
+		size_t freeSize = m_capacity - static_cast<size_t>(writePos - readPos);
+		size_t offset = m_capacity > 0 ? static_cast<size_t>(writePos % m_capacity) : 0;
+		*data = m_buffer.get() + offset;
+		return std::min(freeSize, m_capacity - offset);
+	}
+
+	//producer side : publish the n elements written in the write span
+	void commitWrite(size_t n)
+	{
+		m_writePos.store(m_writePos.load(std::memory_order_relaxed) + n, std::memory_order_release);
+	}
+
+	//producer side : copy up to n elements, returns the number of elements copied
+	size_t write(const T *data, size_t n)
+	{
+		size_t total = 0;
+		while(total < n)
+		{
+			T *dst;
+			size_t spanSize = std::min(getWriteSpan(&dst), n - total);
+			if(spanSize == 0)
+				break;
+			std::copy(data + total, data + total + spanSize, dst);
+			commitWrite(spanSize);
+			total += spanSize;
+		}
+		return total;
+	}
+
+	//consumer side : contiguous readable data starting at the read position
+	size_t getReadSpan(const T **data) const
+	{
+		uint64_t readPos = m_readPos.load(std::memory_order_relaxed);
+		uint64_t writePos = m_writePos.load(std::memory_order_acquire);
+		size_t usedSize = static_cast<size_t>(writePos - readPos);
+		size_t offset = m_capacity > 0 ? static_cast<size_t>(readPos % m_capacity) : 0;
+		*data = m_buffer.get() + offset;
+		return std::min(usedSize, m_capacity - offset);
+	}
+
+	//consumer side : release the n first elements of the read span
+	void consume(size_t n)
+	{
+		m_readPos.store(m_readPos.load(std::memory_order_relaxed) + n, std::memory_order_release);
+	}
+
+	//consumer side : copy up to n elements, returns the number of elements copied
+	size_t read(T *data, size_t n)
+	{
+		size_t total = 0;
+		while(total < n)
+		{
+			const T *src;
+			size_t spanSize = std::min(getReadSpan(&src), n - total);
+			if(spanSize == 0)
+				break;
+			std::copy(src, src + spanSize, data + total);
+			consume(spanSize);
+			total += spanSize;
+		}
+		return total;
+	}
+
+private:
+	SpscRingBuffer(const SpscRingBuffer&);
+	SpscRingBuffer& operator=(const SpscRingBuffer&);
+
+	std::unique_ptr<T[]> m_buffer;
+	size_t m_capacity;
+	std::atomic<uint64_t> m_writePos;
+	std::atomic<uint64_t> m_readPos;
+};
+
+//Bounded lock-free queue for one producer thread and one consumer thread
+template<typename T>
+class SpscQueue
+{
+public:
+	SpscQueue()
+		:m_capacity(0), m_writePos(0), m_readPos(0)
+	{
+	}
+
+	//not thread-safe, call it before starting the producer and consumer
+	void allocate(size_t capacity)
+	{
+		if(capacity != m_capacity)
+		{
+			m_buffer.reset(capacity > 0 ? new T[capacity] : NULL);
+			m_capacity = capacity;
+		}
+		reset();
+	}
+
+	//not thread-safe, call it when neither the producer nor the consumer is running
+	void reset()
+	{
+		for(size_t i = 0; i < m_capacity; i++)
+			m_buffer[i] = T();
+		m_writePos.store(0);
+		m_readPos.store(0);
+	}
+
+	size_t capacity() const
+	{
+		return m_capacity;
+	}
+
+	size_t size() const
+	{
+		return static_cast<size_t>(m_writePos.load(std::memory_order_acquire) - m_readPos.load(std::memory_order_acquire));
+	}
+
+	bool empty() const
+	{
+		return size() == 0;
+	}
+
+	bool full() const
+	{
+		return size() >= m_capacity;
+	}
+
+	//producer side, returns false if the queue is full
+	bool push(const T& val)
+	{
+		uint64_t writePos = m_writePos.load(std::memory_order_relaxed);
+		if(writePos - m_readPos.load(std::memory_order_acquire) >= m_capacity)
+			return false;
+		m_buffer[writePos % m_capacity] = val;
+		m_writePos.store(writePos + 1, std::memory_order_release);
+		return true;
+	}
+
+	//consumer side, the element stays valid until pop() is called
+	T *front()
+	{
+		uint64_t readPos = m_readPos.load(std::memory_order_relaxed);
+		if(readPos == m_writePos.load(std::memory_order_acquire))
+			return NULL;
+		return &m_buffer[readPos % m_capacity];
+	}
+
+	//consumer side, returns false if the queue is empty
+	bool pop(T *val = NULL)
+	{
+		uint64_t readPos = m_readPos.load(std::memory_order_relaxed);
+		if(readPos == m_writePos.load(std::memory_order_acquire))
+			return false;
+		T& elem = m_buffer[readPos % m_capacity];
+		if(val != NULL)
+			*val = elem;
+		elem = T();//release the resources held by the element
+		m_readPos.store(readPos + 1, std::memory_order_release);
+		return true;
+	}
+
+private:
+	SpscQueue(const SpscQueue&);
+	SpscQueue& operator=(const SpscQueue&);
+
+	std::unique_ptr<T[]> m_buffer;
+	size_t m_capacity;
+	std::atomic<uint64_t> m_writePos;
+	std::atomic<uint64_t> m_readPos;
+};
+
+//SpscQueue with blocking push and pop, used between two threads of a pipeline.
+//Closing it wakes up both sides, the consumer can still pop the remaining elements.
+template<typename T>
+class SpscBlockingQueue
+{
+public:
+	SpscBlockingQueue()
+		:m_closed(false)
+	{
+	}
+
+	//not thread-safe, call it before starting the producer and consumer
+	void allocate(size_t capacity)
+	{
+		m_queue.allocate(capacity);
+		m_closed = false;
+	}
+
+	void close()
+	{
+		m_closed = true;
+		m_dataSignal.notify();
+		m_spaceSignal.notify();
+	}
+
+	bool isClosed() const
+	{
+		return m_closed;
+	}
+
+	size_t size() const
+	{
+		return m_queue.size();
+	}
+
+	bool full() const
+	{
+		return m_queue.full();
+	}
+
+	//producer side, returns false if the queue is full or closed
+	bool tryPush(const T& val)
+	{
+		if(m_closed || !m_queue.push(val))
+			return false;
+		m_dataSignal.notify();
+		return true;
+	}
+
+	//producer side, block until there is free space, returns false if closed
+	bool push(const T& val)
+	{
+		m_spaceSignal.wait([&]() {
+			return !m_queue.full() || m_closed;
+		});
+		return tryPush(val);
+	}
+
+	//consumer side, returns false if the queue is empty
+	bool tryPop(T *val)
+	{
+		if(!m_queue.pop(val))
+			return false;
+		m_spaceSignal.notify();
+		return true;
+	}
+
+	//consumer side, block until there is an element, returns false on timeout (timeoutMs < 0 : no timeout) or if closed and empty
+	bool pop(T *val, int timeoutMs = -1)
+	{
+		m_dataSignal.wait([&]() {
+			return !m_queue.empty() || m_closed;
+		}, timeoutMs);
+		return tryPop(val);
+	}
+
+private:
+	SpscQueue<T> m_queue;
+	RingSignal m_dataSignal;//signaled by the producer when an element is pushed
+	RingSignal m_spaceSignal;//signaled by the consumer when an element is popped
+	std::atomic<bool> m_closed;
+};
+
+//Latest-value handoff between one writer thread and one reader thread, without locks or copies.
+//The writer fills back() then publish(), the reader calls update() then reads front().
+//Each side owns one slot, the third one is exchanged atomically, so the writer never waits for the reader.
+template<typename T>
+class TripleBuffer
+{
+public:
+	TripleBuffer()
+		:m_back(0), m_middle(1), m_front(2)
+	{
+	}
+
+	//writer side
+	T& back()
+	{
+		return m_slots[m_back];
+	}
+
+	//writer side, make back() the most recent value
+	void publish()
+	{
+		m_back = m_middle.exchange(m_back | newValueFlag) & indexMask;
+	}
+
+	//reader side, returns true if a more recent value was published since the last call
+	bool update()
+	{
+		if((m_middle.load() & newValueFlag) == 0)
+			return false;
+		m_front = m_middle.exchange(m_front) & indexMask;
+		return true;
+	}
+
+	//reader side, the reader can also modify its slot (cache derived from the value)
+	T& front()
+	{
+		return m_slots[m_front];
+	}
+
+	const T& front() const
+	{
+		return m_slots[m_front];
+	}
+
+private:
+	static const int indexMask = 3;
+	static const int newValueFlag = 4;
+	T m_slots[3];
+	int m_back;//only used by the writer
+	std::atomic<int> m_middle;//slot index, with newValueFlag if not read yet
+	int m_front;//only used by the reader
+};
+
+//Byte ring filled by a receiver thread, with the reception timestamp of each write (one segment per socket read).
+//The consumer never gets data from two segments at once, so each span has an exact timestamp.
+class RecvRingBuffer
+{
+public:
+	RecvRingBuffer()
+		:m_closed(false)
+	{
+	}
+
+	//not thread-safe, call it before starting the producer and consumer
+	void allocate(size_t capacity)
+	{
+		m_data.allocate(capacity);
+		//reads are at least a few KB except at the end of a burst
+		m_segments.allocate(capacity > 0 ? std::max(capacity / 1024, static_cast<size_t>(1024)) : 0);
+		m_closed = false;
+	}
+
+	//wake up and stop both sides, the consumer can still read the remaining data
+	void close()
+	{
+		m_closed = true;
+		m_dataSignal.notify();
+		m_spaceSignal.notify();
+	}
+
+	bool isClosed() const
+	{
+		return m_closed;
+	}
+
+	size_t capacity() const
+	{
+		return m_data.capacity();
+	}
+
+	size_t size() const
+	{
+		return m_data.size();
+	}
+
+	//producer side : contiguous free space, 0 if full
+	size_t getWriteSpan(char **data)
+	{
+		if(m_segments.full())
+			return 0;
+		return m_data.getWriteSpan(data);
+	}
+
+	//producer side : block until there is free space, returns 0 if closed
+	size_t waitForWriteSpan(char **data)
+	{
+		size_t size = 0;
+		m_spaceSignal.wait([&]() {
+			size = getWriteSpan(data);
+			return size > 0 || m_closed;
+		});
+		return m_closed ? 0 : size;
+	}
+
+	//producer side : publish n bytes received at the given timestamp (and steady clock time in us, for latency tracing)
+	void commitWrite(size_t n, uint64_t timestamp, uint64_t recvTimeUs = 0)
+	{
+		Segment segment;
+		segment.endPos = m_data.getWritePos() + n;
+		segment.timestamp = timestamp;
+		segment.recvTimeUs = recvTimeUs;
+		m_data.commitWrite(n);
+		m_segments.push(segment);
+		m_dataSignal.notify();
+	}
+
+	//consumer side : contiguous data of the oldest segment, 0 if empty
+	size_t getReadSpan(const char **data, uint64_t *timestamp, uint64_t *recvTimeUs = NULL)
+	{
+		Segment *segment = m_segments.front();
+		if(segment == NULL)
+			return 0;
+		if(timestamp != NULL)
+			*timestamp = segment->timestamp;
+		if(recvTimeUs != NULL)
+			*recvTimeUs = segment->recvTimeUs;
+		size_t segmentSize = static_cast<size_t>(segment->endPos - m_data.getReadPos());
+		return std::min(m_data.getReadSpan(data), segmentSize);
+	}
+
+	//consumer side : block until there is data, returns 0 on timeout or if closed and empty
+	size_t waitForReadSpan(const char **data, uint64_t *timestamp, int timeoutMs = -1, uint64_t *recvTimeUs = NULL)
+	{
+		m_dataSignal.wait([&]() {
+			return m_segments.front() != NULL || m_closed;
+		}, timeoutMs);
+		return getReadSpan(data, timestamp, recvTimeUs);
+	}
+
+	//consumer side : release the n first bytes of the read span
+	void consume(size_t n)
+	{
+		m_data.consume(n);
+		Segment *segment = m_segments.front();
+		if(segment != NULL && m_data.getReadPos() >= segment->endPos)
+			m_segments.pop();
+		m_spaceSignal.notify();
+	}
+
+private:
+	struct Segment
+	{
+		uint64_t endPos;//ring position after the last byte of the segment
+		uint64_t timestamp;
+		uint64_t recvTimeUs;
+	};
+
+	SpscRingBuffer<char> m_data;
+	SpscQueue<Segment> m_segments;
+	RingSignal m_dataSignal;//signaled by the producer when data is pushed
+	RingSignal m_spaceSignal;//signaled by the consumer when data is released
+	std::atomic<bool> m_closed;
+};
+
+//Interleaved float PCM ring with the format and timestamps of each packet, for one producer thread and one consumer thread.
+//A read span never mixes two packets, so its format and timestamps are exact.
+class AudioRingBuffer
+{
+public:
+	struct Packet
+	{
+		uint64_t startPos;//ring position of the first sample (aligned on nbChannels)
+		uint64_t endPos;//ring position after the last sample
+		int nbChannels;
+		uint32_t sampleRate;
+		uint64_t deviceTimestamp;
+		uint64_t localTimestamp;
+	};
+
+	//not thread-safe, call it before starting the producer and consumer
+	void allocate(size_t nbSamples)
+	{
+		m_data.allocate(nbSamples);
+		//Quest packets are a few hundred frames
+		m_packets.allocate(nbSamples > 0 ? std::max(nbSamples / 64, static_cast<size_t>(64)) : 0);
+	}
+
+	size_t capacity() const
+	{
+		return m_data.capacity();
+	}
+
+	//producer side : copy a packet of nbFrames frames (data does not need to be aligned).
+	//Returns false if there is not enough space, the packet is then dropped
+	bool write(const void *data, size_t nbFrames, int nbChannels, uint32_t sampleRate, uint64_t deviceTimestamp, uint64_t localTimestamp)
+	{
+		size_t nbSamples = nbFrames * nbChannels;
+		uint64_t writePos = m_data.getWritePos();
+		//a frame is never split at the end of the ring : the packet starts on a multiple of nbChannels
+		//and the capacity must be a multiple of nbChannels
+		if(nbChannels <= 0 || m_data.capacity() == 0 || m_data.capacity() % nbChannels != 0)
+			return false;
+		size_t padding = static_cast<size_t>((nbChannels - writePos % nbChannels) % nbChannels);
+		if(nbSamples == 0 || m_packets.full() || m_data.capacity() - m_data.size() < nbSamples + padding)
+			return false;
+		m_data.commitWrite(padding);
+
+		Packet packet;
+		packet.startPos = writePos + padding;
+		packet.endPos = packet.startPos + nbSamples;
+		packet.nbChannels = nbChannels;
+		packet.sampleRate = sampleRate;
+		packet.deviceTimestamp = deviceTimestamp;
+		packet.localTimestamp = localTimestamp;
+		const char *src = static_cast<const char*>(data);
+		size_t written = 0;
+		while(written < nbSamples)
+		{
+			float *dst;
+			size_t n = std::min(m_data.getWriteSpan(&dst), nbSamples - written);
+			memcpy(dst, src + written * sizeof(float), n * sizeof(float));
+			m_data.commitWrite(n);
+			written += n;
+		}
+		m_packets.push(packet);
+		return true;
+	}
+
+	//consumer side : contiguous frames of the oldest packet, 0 if empty.
+	//frameOffset is the position of the first frame in the packet
+	size_t peek(const float **data, const Packet **packetInfo, size_t *frameOffset)
+	{
+		Packet *packet = m_packets.front();
+		if(packet == NULL)
+			return 0;
+		//skip the padding before the packet
+		uint64_t readPos = m_data.getReadPos();
+		if(readPos < packet->startPos)
+		{
+			m_data.consume(static_cast<size_t>(packet->startPos - readPos));
+			readPos = packet->startPos;
+		}
+		*packetInfo = packet;
+		*frameOffset = static_cast<size_t>(readPos - packet->startPos) / packet->nbChannels;
+		size_t nbSamples = std::min(m_data.getReadSpan(data), static_cast<size_t>(packet->endPos - readPos));
+		return nbSamples / packet->nbChannels;
+	}
+
+	//consumer side : release the n first frames returned by peek()
+	void consume(size_t nbFrames)
+	{
+		Packet *packet = m_packets.front();
+		if(packet == NULL)
+			return;
+		m_data.consume(nbFrames * packet->nbChannels);
+		if(m_data.getReadPos() >= packet->endPos)
+			m_packets.pop();
+	}
+
+private:
+	SpscRingBuffer<float> m_data;
+	SpscQueue<Packet> m_packets;
+};
+
+}
@@ -0,0 +1,298 @@
+#include "SocketUtil.h"
+#include <string.h>
+#include <stdio.h>
+#include <algorithm>
+
+#ifdef _WIN32
+#pragma comment(lib, "ws2_32.lib")
+#else
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <netdb.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#endif
+
+#ifdef __linux__
+#include <sys/epoll.h>
+#endif
+
+namespace libQuestMR
+{
+
+bool initSocketLib()
+{
+#ifdef _WIN32
+	static bool initialized = false;
+	static std::mutex initMutex;
+	std::lock_guard<std::mutex> lock(initMutex);
+	if(!initialized)
+	{
+		WSADATA wsaData;
+		if(WSAStartup(MAKEWORD(2, 2), &wsaData) != 0)
+			return false;
+		initialized = true;
+	}
+#endif
+	return true;
+}
+
+SocketHandle connectTcpSocket(const char *address, uint16_t port)
+{
+	if(!initSocketLib())
+		return INVALID_SOCKET_HANDLE;
+
+	char portStr[16];
+	snprintf(portStr, sizeof(portStr), "%u", static_cast<unsigned int>(port));
+
+	addrinfo hints;
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	hints.ai_protocol = IPPROTO_TCP;
+
+	addrinfo *result = NULL;
+	if(getaddrinfo(address, portStr, &hints, &result) != 0)
+		return INVALID_SOCKET_HANDLE;
+
+	SocketHandle sock = INVALID_SOCKET_HANDLE;
+	for(addrinfo *ptr = result; ptr != NULL; ptr = ptr->ai_next)
+	{
+		sock = socket(ptr->ai_family, ptr->ai_socktype, ptr->ai_protocol);
+		if(sock == INVALID_SOCKET_HANDLE)
+			continue;
+		if(connect(sock, ptr->ai_addr, (int)ptr->ai_addrlen) == 0)
+			break;
+		closeSocket(sock);
+		sock = INVALID_SOCKET_HANDLE;
+	}
+	freeaddrinfo(result);
+	return sock;
+}
+
+SocketHandle listenTcpSocket(uint16_t port, bool localhostOnly, int backlog)
+{
+	if(!initSocketLib())
+		return INVALID_SOCKET_HANDLE;
+
+	SocketHandle sock = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+	if(sock == INVALID_SOCKET_HANDLE)
+		return INVALID_SOCKET_HANDLE;
+
+	int reuse = 1;
+	setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, (const char*)&reuse, sizeof(reuse));
+
+	sockaddr_in addr;
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_port = htons(port);
+	addr.sin_addr.s_addr = htonl(localhostOnly ? INADDR_LOOPBACK : INADDR_ANY);
+	if(bind(sock, (sockaddr*)&addr, sizeof(addr)) != 0 || listen(sock, backlog) != 0)
+	{
+		closeSocket(sock);
+		return INVALID_SOCKET_HANDLE;
+	}
+	return sock;
+}
+
+SocketHandle acceptTcpSocket(SocketHandle listenSocket)
+{
+	SocketHandle sock = accept(listenSocket, NULL, NULL);
+	if(sock == INVALID_SOCKET_HANDLE)
+		return INVALID_SOCKET_HANDLE;
+	int noDelay = 1;
+	setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, (const char*)&noDelay, sizeof(noDelay));
+	return sock;
+}
+
+bool setSocketNonBlocking(SocketHandle sock, bool nonBlocking)
+{
+#ifdef _WIN32
+	u_long mode = nonBlocking ? 1 : 0;
+	return ioctlsocket(sock, FIONBIO, &mode) == 0;
+#else
+	int flags = fcntl(sock, F_GETFL, 0);
+	if(flags < 0)
+		return false;
+	flags = nonBlocking ? (flags | O_NONBLOCK) : (flags & ~O_NONBLOCK);
+	return fcntl(sock, F_SETFL, flags) == 0;
+#endif
+}
+
+int readSocket(SocketHandle sock, char *buf, size_t size)
+{
+#ifdef _WIN32
+	int ret = ::recv(sock, buf, (int)size, 0);
+	if(ret < 0)
+		return WSAGetLastError() == WSAEWOULDBLOCK ? SOCKET_WOULD_BLOCK : SOCKET_ERROR_CLOSED;
+#else
+	ssize_t ret;
+	do {
+		ret = ::recv(sock, buf, size, 0);
+	} while(ret < 0 && errno == EINTR);
+	if(ret < 0)
+		return (errno == EAGAIN || errno == EWOULDBLOCK) ? SOCKET_WOULD_BLOCK : SOCKET_ERROR_CLOSED;
+#endif
+	return static_cast<int>(ret);
+}
+
+bool sendSocketAll(SocketHandle sock, const char *buf, size_t size)
+{
+#if defined(MSG_NOSIGNAL)
+	const int flags = MSG_NOSIGNAL;//do not kill the process if the peer closed the connection
+#else
+	const int flags = 0;
+#endif
+	while(size > 0)
+	{
+		int chunkSize = static_cast<int>(std::min(size, static_cast<size_t>(1 << 20)));
+		int ret = static_cast<int>(::send(sock, buf, chunkSize, flags));
+		if(ret <= 0)
+		{
+#ifndef _WIN32
+			if(ret < 0 && errno == EINTR)
+				continue;
+#endif
+			return false;
+		}
+		buf += ret;
+		size -= ret;
+	}
+	return true;
+}
+
+void shutdownSocket(SocketHandle sock)
+{
+#ifdef _WIN32
+	shutdown(sock, SD_BOTH);
+#else
+	shutdown(sock, SHUT_RDWR);
+#endif
+}
+
+void closeSocket(SocketHandle sock)
+{
+#ifdef _WIN32
+	closesocket(sock);
+#else
+	close(sock);
+#endif
+}
+
+#ifdef __linux__
+
+SocketPoller::SocketPoller()
+{
+	m_epollFd = epoll_create1(0);
+}
+
+SocketPoller::~SocketPoller()
+{
+	if(m_epollFd >= 0)
+		close(m_epollFd);
+}
+
+bool SocketPoller::add(SocketHandle sock, uint64_t userData)
+{
+	epoll_event event;
+	memset(&event, 0, sizeof(event));
+	event.events = EPOLLIN | EPOLLRDHUP;
+	event.data.u64 = userData;
+	return epoll_ctl(m_epollFd, EPOLL_CTL_ADD, sock, &event) == 0;
+}
+
+void SocketPoller::remove(SocketHandle sock)
+{
+	epoll_event event;
+	memset(&event, 0, sizeof(event));
+	epoll_ctl(m_epollFd, EPOLL_CTL_DEL, sock, &event);
+}
+
+int SocketPoller::wait(uint64_t *userData, int maxEvents, int timeoutMs)
+{
+	const int maxEventsPerCall = 64;
+	epoll_event events[maxEventsPerCall];
+	int nbEvents = epoll_wait(m_epollFd, events, std::min(maxEvents, maxEventsPerCall), timeoutMs);
+	if(nbEvents < 0)
+		return errno == EINTR ? 0 : -1;
+	for(int i = 0; i < nbEvents; i++)
+		userData[i] = events[i].data.u64;
+	return nbEvents;
+}
+
+#else
+
+SocketPoller::SocketPoller()
+{
+}
+
+SocketPoller::~SocketPoller()
+{
+}
+
+bool SocketPoller::add(SocketHandle sock, uint64_t userData)
+{
+	std::lock_guard<std::mutex> lock(m_mutex);
+	m_sockets.push_back(sock);
+	m_userData.push_back(userData);
+	return true;
+}
+
+void SocketPoller::remove(SocketHandle sock)
+{
+	std::lock_guard<std::mutex> lock(m_mutex);
+	for(size_t i = 0; i < m_sockets.size(); i++)
+	{
+		if(m_sockets[i] == sock)
+		{
+			m_sockets.erase(m_sockets.begin() + i);
+			m_userData.erase(m_userData.begin() + i);
+			break;
+		}
+	}
+}
+
+int SocketPoller::wait(uint64_t *userData, int maxEvents, int timeoutMs)
+{
+	std::vector<uint64_t> pollUserData;
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		m_pollFds.resize(m_sockets.size());
+		for(size_t i = 0; i < m_sockets.size(); i++)
+		{
+			m_pollFds[i].fd = m_sockets[i];
+			m_pollFds[i].events = POLLIN;
+			m_pollFds[i].revents = 0;
+		}
+		pollUserData = m_userData;
+	}
+	//sockets added during the wait are only polled at the next call, so keep the timeout short
+	timeoutMs = (timeoutMs < 0 || timeoutMs > 50) ? 50 : timeoutMs;
+#ifdef _WIN32
+	if(m_pollFds.empty())
+	{
+		Sleep(timeoutMs);
+		return 0;
+	}
+	int ret = WSAPoll(m_pollFds.data(), (ULONG)m_pollFds.size(), timeoutMs);
+#else
+	int ret = poll(m_pollFds.data(), m_pollFds.size(), timeoutMs);
+#endif
+	if(ret <= 0)
+		return ret;
+	int nbEvents = 0;
+	for(size_t i = 0; i < m_pollFds.size() && nbEvents < maxEvents; i++)
+	{
+		if(m_pollFds[i].revents != 0)
+			userData[nbEvents++] = pollUserData[i];
+	}
+	return nbEvents;
+}
+
+#endif
+
+}
@@ -0,0 +1,87 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include <mutex>
+#include <vector>
+
+#ifdef _WIN32
+#include <winsock2.h>
+#include <ws2tcpip.h>
+#else
+#include <poll.h>
+#endif
+
+namespace libQuestMR
+{
+
+//Minimal portable TCP helpers for the places where BufferedSocket's blocking API is not enough
+//(non-blocking multiplexed reads, listening sockets)
+
+#ifdef _WIN32
+typedef SOCKET SocketHandle;
+#define INVALID_SOCKET_HANDLE INVALID_SOCKET
+#else
+typedef int SocketHandle;
+#define INVALID_SOCKET_HANDLE (-1)
+#endif
+
+//return values of readSocket() / sendSocket() when no byte was transferred
+#define SOCKET_WOULD_BLOCK (-1)
+#define SOCKET_ERROR_CLOSED (-2)
+
+//initialize the socket library (WSAStartup on Windows), can be called several times
+bool initSocketLib();
+
+//blocking connect, returns INVALID_SOCKET_HANDLE on failure
+SocketHandle connectTcpSocket(const char *address, uint16_t port);
+
+//listen on all interfaces (or localhost only), returns INVALID_SOCKET_HANDLE on failure
+SocketHandle listenTcpSocket(uint16_t port, bool localhostOnly = true, int backlog = 64);
+
+//blocking accept, returns INVALID_SOCKET_HANDLE on failure
+SocketHandle acceptTcpSocket(SocketHandle listenSocket);
+
+bool setSocketNonBlocking(SocketHandle sock, bool nonBlocking);
+
+//returns the number of bytes read, 0 if the connection is closed,
+//SOCKET_WOULD_BLOCK if a non-blocking socket has no data, SOCKET_ERROR_CLOSED on error
+int readSocket(SocketHandle sock, char *buf, size_t size);
+
+//send all the data (blocking socket), returns false on error
+bool sendSocketAll(SocketHandle sock, const char *buf, size_t size);
+
+//unblock the threads waiting in accept/read on this socket, without releasing it
+void shutdownSocket(SocketHandle sock);
+
+void closeSocket(SocketHandle sock);
+
+//Waits for readable sockets : epoll on Linux, poll (WSAPoll on Windows) elsewhere.
+//add/remove can be called from any thread, wait from a single thread.
+class SocketPoller
+{
+public:
+	SocketPoller();
+	~SocketPoller();
+
+	bool add(SocketHandle sock, uint64_t userData);
+	void remove(SocketHandle sock);
+
+	//fills userData of the readable (or closed) sockets, returns their count (0 on timeout, <0 on error)
+	int wait(uint64_t *userData, int maxEvents, int timeoutMs);
+
+private:
+	SocketPoller(const SocketPoller&);
+	SocketPoller& operator=(const SocketPoller&);
+
+#ifdef __linux__
+	int m_epollFd;
+#else
+	std::mutex m_mutex;
+	std::vector<SocketHandle> m_sockets;
+	std::vector<uint64_t> m_userData;
+	std::vector<pollfd> m_pollFds;
+#endif
+};
+
+}
@@ -16,21 +16,168 @@
 
 #include "log.h"
 #include "frame.h"
+#include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
+#include <algorithm>
+#include <fstream>
+#include <sstream>
+#include <atomic>
 #include <chrono>
 #include "libQuestMR/QuestVideoMngr.h"
 #include <BufferedSocket/DataPacket.h>
 
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define LQMR_USE_SSE2
+#endif
+
 namespace libQuestMR
 {
 
+uint8_t *FramePayload::allocate(size_t size)
+{
+	m_owner.reset();
+	m_viewTailSize = 0;
+	if(m_storage.size() < size + FramePayloadPadding)
+		m_storage.resize(size + FramePayloadPadding);
+	memset(m_storage.data() + size, 0, FramePayloadPadding);
+	m_data = m_storage.data();
+	m_size = size;
+	return m_storage.data();
+}
+
+void FramePayload::setView(const uint8_t *data, size_t size, const std::shared_ptr<const void>& owner, size_t tailSize)
+{
+	m_data = data;
+	m_size = size;
+	m_viewTailSize = tailSize;
+	m_owner = owner;
+}
+
+void FramePayload::clear()
+{
+	m_data = NULL;
+	m_size = 0;
+	m_viewTailSize = 0;
+	m_owner.reset();
+}
+
+bool isH264KeyFrame(const uint8_t *data, size_t size)
+{
+	//look at the NAL units until the first slice : SPS/PPS (and the IDR slice) come first in a keyframe
+	for(size_t i = 0; i + 3 < size; i++)
+	{
+		if(data[i] != 0 || data[i+1] != 0 || data[i+2] != 1)
+			continue;
+		uint8_t nalType = data[i+3] & 0x1F;
+		if(nalType == 5 || nalType == 7)//IDR slice, SPS
+			return true;
+		if(nalType == 1)//non-IDR slice
+			return false;
+		i += 3;
+	}
+	return false;
+}
+
+Frame::Frame()
+{
+#ifdef LIBQUESTMR_USE_FFMPEG
+	decoderBuf = NULL;
+#endif
+}
+
+Frame::~Frame()
+{
+#ifdef LIBQUESTMR_USE_FFMPEG
+	av_buffer_unref(&decoderBuf);
+#endif
+}
+
+FramePool::FramePool()
+	: m_nextId(0)
+{
+}
+
+std::shared_ptr<Frame> FramePool::acquire()
+{
+	for(size_t i = 0; i < m_frames.size(); i++)
+	{
+		std::shared_ptr<Frame>& frame = m_frames[m_nextId];
+		m_nextId = (m_nextId + 1) % m_frames.size();
+		if(frame.use_count() == 1)
+		{
+			//synchronize with the release of the last reference by the consumer thread
+			std::atomic_thread_fence(std::memory_order_acquire);
+			return frame;
+		}
+	}
+	std::shared_ptr<Frame> frame = std::make_shared<Frame>();
+	m_frames.push_back(frame);
+	return frame;
+}
+
+void FramePool::clear()
+{
+	m_frames.clear();
+	m_nextId = 0;
+}
+
+FrameQueue::FrameQueue()
+	: m_first(0), m_size(0)
+{
+	m_frames.resize(64);
+}
+
+void FrameQueue::push(const std::shared_ptr<Frame>& frame)
+{
+	if(m_size == m_frames.size())
+	{
+		//grow and unwrap the circular buffer
+		std::vector<std::shared_ptr<Frame> > frames(m_frames.size() * 2);
+		for(size_t i = 0; i < m_size; i++)
+			frames[i].swap(m_frames[(m_first + i) % m_frames.size()]);
+		m_frames.swap(frames);
+		m_first = 0;
+	}
+	m_frames[(m_first + m_size) % m_frames.size()] = frame;
+	m_size++;
+}
+
+std::shared_ptr<Frame> FrameQueue::pop()
+{
+	std::shared_ptr<Frame> result;
+	if(m_size > 0)
+	{
+		result.swap(m_frames[m_first]);
+		m_first = (m_first + 1) % m_frames.size();
+		m_size--;
+	}
+	return result;
+}
+
+void FrameQueue::clear()
+{
+	while(m_size > 0)
+		pop();
+	m_first = 0;
+}
+
 FrameCollection::FrameCollection()
-	: m_hasError(false)
+	: m_resyncing(false), m_resyncPending(false), m_resyncSkippedBytes(0), m_nbResyncs(0), m_nbResyncSkippedBytes(0)
 {
-	recordingFile = NULL;
-	timestampFile = NULL;
+	m_recordingNbBuffers = 32;
+	m_recordingBufferSize = 1 << 20;
+	m_recordingDirectIO = false;
+	m_maxSegmentSize = 0;
+	m_maxSegmentDurationMs = 0;
+	m_segmentedRecording = false;
+	m_segmentWaitingForKeyFrame = false;
 	recordedTimestampId = 0;
-	m_scratchPad.reserve(16 * 1024 * 1024);
+	m_nbParsedFrames = 0;
+	m_headerSize = 0;
+	m_payloadWritePtr = NULL;
+	m_payloadRemaining = 0;
 }
 
 FrameCollection::~FrameCollection()
@@ -38,7 +185,7 @@ FrameCollection::~FrameCollection()
 	Reset();
 }
 
-FrameHeader FrameCollection::readFrameHeader(unsigned char *data) const
+FrameHeader FrameCollection::readFrameHeader(const unsigned char *data)
 {
 	FrameHeader frameHeader;
 	frameHeader.Magic                         = convertBytesToUInt32(data, false);
@@ -48,29 +195,317 @@ FrameHeader FrameCollection::readFrameHeader(unsigned char *data) const
 	return frameHeader;
 }
 
+bool FrameCollection::isValidFrameHeader(const FrameHeader& frameHeader)
+{
+	return frameHeader.Magic == FrameMagic
+		&& ((frameHeader.PayloadType >= static_cast<uint32_t>(Frame::PayloadType::VIDEO_DIMENSION)
+			&& frameHeader.PayloadType <= static_cast<uint32_t>(Frame::PayloadType::AUDIO_DATA))
+			|| frameHeader.PayloadType == static_cast<uint32_t>(Frame::PayloadType::SEGMENT_INDEX))
+		&& frameHeader.PayloadLength <= MaxFramePayloadLength
+		&& frameHeader.PayloadLength == frameHeader.TotalDataLengthExcludingMagic + sizeof(uint32_t) - sizeof(FrameHeader);
+}
+
+//bytes of FrameMagic in stream order
+static const uint8_t frameMagicBytes[4] = {0x94, 0xAF, 0x77, 0x28};
+
+//true if the size (<= 4) first bytes of data match the start of the magic
+static bool matchesFrameMagic(const uint8_t *data, size_t size)
+{
+	return memcmp(data, frameMagicBytes, std::min(size, sizeof(frameMagicBytes))) == 0;
+}
+
+//position of the first magic in data, or of the start of a magic cut by the end of data. size if none
+static size_t findFrameMagic(const uint8_t *data, size_t size)
+{
+	size_t i = 0;
+#ifdef LQMR_USE_SSE2
+	//16 positions per iteration, candidates must match the first 2 bytes of the magic
+	const __m128i firstByte = _mm_set1_epi8(static_cast<char>(frameMagicBytes[0]));
+	const __m128i secondByte = _mm_set1_epi8(static_cast<char>(frameMagicBytes[1]));
+	for (; i + 17 <= size; i += 16)
+	{
+		__m128i block0 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(data + i));
+		__m128i block1 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(data + i + 1));
+		int mask = _mm_movemask_epi8(_mm_and_si128(_mm_cmpeq_epi8(block0, firstByte), _mm_cmpeq_epi8(block1, secondByte)));
+		for (size_t pos = i; mask != 0; pos++, mask >>= 1)
+		{
+			if ((mask & 1) != 0 && matchesFrameMagic(data + pos, size - pos))
+				return pos;
+		}
+	}
+#endif
+	//memchr is vectorized by the C library on the other architectures
+	while (i < size)
+	{
+		const uint8_t *candidate = static_cast<const uint8_t*>(memchr(data + i, frameMagicBytes[0], size - i));
+		if (candidate == NULL)
+			break;
+		size_t pos = candidate - data;
+		if (matchesFrameMagic(candidate, size - pos))
+			return pos;
+		i = pos + 1;
+	}
+	return size;
+}
+
 bool FrameCollection::isRecording() const
 {
-	return recordingFile != NULL;
+	return m_recordingWriter.isOpen();
 }
 
 void FrameCollection::setRecording(const char *folder, const char *filenameWithoutExt)
 {
+	std::lock_guard<std::mutex> lock(m_frameMutex);
+	closeRecording();
 	if(folder == NULL || filenameWithoutExt == NULL || strlen(filenameWithoutExt) == 0)
+		return;
+	m_recordingFolder = folder;
+	m_recordingName = filenameWithoutExt;
+	m_segmentedRecording = m_maxSegmentSize > 0 || m_maxSegmentDurationMs > 0;
+	if(m_segmentedRecording)
+	{
+		m_segments.clear();
+		m_segmentWaitingForKeyFrame = true;
+		startSegment();
+		return;
+	}
+	std::string baseFilename = m_recordingFolder + "/" + m_recordingName;
+	m_recordingWriter.open((baseFilename+".questMRVideo").c_str(), m_recordingBufferSize, m_recordingNbBuffers, m_recordingDirectIO);
+	//a few bytes per frame
+	m_timestampWriter.open((baseFilename+"_questTimestamp.txt").c_str(), 64 * 1024, 4);
+}
+
+void FrameCollection::setRecordingBuffers(int nbBuffers, size_t bufferSize, bool directIO)
+{
+	m_recordingNbBuffers = nbBuffers;
+	m_recordingBufferSize = bufferSize;
+	m_recordingDirectIO = directIO;
+}
+
+void FrameCollection::setRecordingSegments(uint64_t maxSegmentSize, int maxSegmentDurationMs)
+{
+	m_maxSegmentSize = maxSegmentSize;
+	m_maxSegmentDurationMs = maxSegmentDurationMs;
+}
+
+void FrameCollection::closeRecording()
+{
+	if(m_segmentedRecording && m_recordingWriter.isOpen())
 	{
-		if(recordingFile != NULL)
+		finishSegment();
+		queueManifest();
+	}
+	m_recordingWriter.close();
+	m_timestampWriter.close();
+}
+
+static void writeUInt32LE(uint8_t *data, uint32_t val)
+{
+	data[0] = static_cast<uint8_t>(val);
+	data[1] = static_cast<uint8_t>(val >> 8);
+	data[2] = static_cast<uint8_t>(val >> 16);
+	data[3] = static_cast<uint8_t>(val >> 24);
+}
+
+static void fillFrameHeader(uint8_t *data, Frame::PayloadType type, uint32_t payloadLength)
+{
+	writeUInt32LE(data, FrameMagic);
+	writeUInt32LE(data + 4, payloadLength + sizeof(FrameHeader) - sizeof(uint32_t));
+	writeUInt32LE(data + 8, static_cast<uint32_t>(type));
+	writeUInt32LE(data + 12, payloadLength);
+}
+
+//line of the _questTimestamp.txt file, with the parameters of the audio and dimension frames
+static int formatTimestampLine(char *line, size_t maxSize, uint64_t timestamp, Frame::PayloadType type, const uint8_t *payload, size_t size)
+{
+	int len = snprintf(line, maxSize, "%llu,%u,%u", static_cast<unsigned long long>(timestamp), static_cast<uint32_t>(type), static_cast<uint32_t>(size));
+	if(type == Frame::PayloadType::AUDIO_DATA) {
+		uint64_t audioTimestamp = convertBytesToUInt64(payload, false);
+		int32_t channels = convertBytesToInt32(payload + 8, false);
+		int32_t dataLength = convertBytesToInt32(payload + 12, false);
+		len += snprintf(line + len, maxSize - len, ",%llu,%d,%d", static_cast<unsigned long long>(audioTimestamp), channels, dataLength);
+	} else if(type == Frame::PayloadType::AUDIO_SAMPLERATE) {
+		uint32_t sampleRate = *(uint32_t*)(payload);
+		len += snprintf(line + len, maxSize - len, ",%u", sampleRate);
+	} else if(type == Frame::PayloadType::VIDEO_DIMENSION) {
+		int32_t w = convertBytesToInt32(payload, false);
+		int32_t h = convertBytesToInt32(payload + 4, false);
+		len += snprintf(line + len, maxSize - len, ",%d,%d", w, h);
+	}
+	line[len++] = '\n';
+	return len;
+}
+
+bool FrameCollection::startSegment()
+{
+	char suffix[16];
+	snprintf(suffix, sizeof(suffix), "_%04d", static_cast<int>(m_segments.size()));
+	std::string filename = m_recordingName + suffix;
+	std::string baseFilename = m_recordingFolder + "/" + filename;
+	bool switching = m_recordingWriter.isOpen();
+	if(!switching)
+	{
+		if(!m_recordingWriter.open((baseFilename+".questMRVideo").c_str(), m_recordingBufferSize, m_recordingNbBuffers, m_recordingDirectIO))
+			return false;
+		m_timestampWriter.open((baseFilename+"_questTimestamp.txt").c_str(), 64 * 1024, 4);
+	}
+	RecordingSegment segment;
+	segment.filename = filename;
+	segment.firstTimestamp = 0;
+	segment.lastTimestamp = 0;
+	segment.nbFrames = 0;
+	segment.size = 0;
+	segment.complete = false;
+	m_segments.push_back(segment);
+	m_segmentIndex.clear();
+	//listed before it has data, so an interrupted recording still references it
+	if(switching)
+	{
+		//the writer thread completes the previous segment, then opens the new one and writes the manifest
+		queueManifest();
+		m_recordingWriter.switchFile((baseFilename+".questMRVideo").c_str());
+		m_timestampWriter.switchFile((baseFilename+"_questTimestamp.txt").c_str());
+	}
+	else
+	{
+		formatManifest();
+		RecordingWriter::replaceFile(getManifestFilename().c_str(), m_manifest);
+	}
+	return true;
+}
+
+void FrameCollection::recordSegmentFrame(const Frame& frame)
+{
+	if(m_recordingWriter.getNbFailedSwitches() > 0)
+	{
+		OM_BLOG(LOG_ERROR, "Unable to open the recording segment %s, recording stopped", m_segments.back().filename.c_str());
+		m_recordingWriter.close();
+		m_timestampWriter.close();
+		return;
+	}
+	bool keyFrame = frame.m_type == Frame::PayloadType::VIDEO_DATA && isH264KeyFrame(frame.m_payload.data(), frame.m_payload.size());
+	const RecordingSegment *segment = &m_segments.back();
+	if(keyFrame && segment->nbFrames > 0
+		&& ((m_maxSegmentSize > 0 && segment->size >= m_maxSegmentSize)
+			|| (m_maxSegmentDurationMs > 0 && frame.localTimestamp >= segment->firstTimestamp + m_maxSegmentDurationMs)))
+	{
+		finishSegment();
+		if(!startSegment())
 		{
-			fclose(recordingFile);
-			fclose(timestampFile);
-			recordingFile = NULL;
-			timestampFile = NULL;
+			OM_BLOG(LOG_ERROR, "Unable to start the next recording segment, recording stopped");
+			queueManifest();
+			m_recordingWriter.close();
+			m_timestampWriter.close();
+			return;
 		}
+		segment = &m_segments.back();
+	}
+
+	//a segment can be decoded on its own : it starts with the current state and an IDR frame
+	if(m_segmentWaitingForKeyFrame && frame.m_type == Frame::PayloadType::VIDEO_DATA && !keyFrame)
 		return;
+	if(segment->nbFrames == 0)
+	{
+		if(!m_lastDimensionPayload.empty() && frame.m_type != Frame::PayloadType::VIDEO_DIMENSION)
+			writeSegmentFrame(frame.localTimestamp, Frame::PayloadType::VIDEO_DIMENSION, m_lastDimensionPayload.data(), m_lastDimensionPayload.size(), false);
+		if(!m_lastSampleRatePayload.empty() && frame.m_type != Frame::PayloadType::AUDIO_SAMPLERATE)
+			writeSegmentFrame(frame.localTimestamp, Frame::PayloadType::AUDIO_SAMPLERATE, m_lastSampleRatePayload.data(), m_lastSampleRatePayload.size(), false);
 	}
-	std::string baseFilename = folder;
-	baseFilename += "/";
-	baseFilename += filenameWithoutExt;
-	recordingFile = fopen((baseFilename+".questMRVideo").c_str(), "wb");
-	timestampFile = fopen((baseFilename+"_questTimestamp.txt").c_str(), "wb");
+	if(keyFrame)
+		m_segmentWaitingForKeyFrame = false;
+	writeSegmentFrame(frame.localTimestamp, frame.m_type, frame.m_payload.data(), frame.m_payload.size(), keyFrame);
+}
+
+void FrameCollection::writeSegmentFrame(uint64_t timestamp, Frame::PayloadType type, const uint8_t *payload, size_t size, bool keyFrame)
+{
+	RecordingSegment& segment = m_segments.back();
+	SegmentIndexEntry entry;
+	memset(&entry, 0, sizeof(entry));
+	entry.offset = segment.size;
+	entry.localTimestamp = timestamp;
+	entry.payloadType = static_cast<uint32_t>(type);
+	entry.payloadLength = static_cast<uint32_t>(size);
+	if(type == Frame::PayloadType::VIDEO_DATA) {
+		entry.param0 = keyFrame ? 1 : 0;
+	} else if(type == Frame::PayloadType::VIDEO_DIMENSION && size >= 8) {
+		entry.param0 = convertBytesToInt32(payload, false);
+		entry.param1 = convertBytesToInt32(payload + 4, false);
+	} else if(type == Frame::PayloadType::AUDIO_SAMPLERATE && size >= 4) {
+		memcpy(&entry.param0, payload, 4);
+	}
+	m_segmentIndex.push_back(entry);
+
+	uint8_t header[sizeof(FrameHeader)];
+	fillFrameHeader(header, type, static_cast<uint32_t>(size));
+	m_recordingWriter.write(header, sizeof(header));
+	m_recordingWriter.write(payload, size);
+	if(segment.nbFrames == 0)
+		segment.firstTimestamp = timestamp;
+	segment.lastTimestamp = timestamp;
+	segment.nbFrames++;
+	segment.size += sizeof(header) + size;
+
+	if(m_timestampWriter.isOpen()) {
+		char line[128];
+		int len = formatTimestampLine(line, sizeof(line), timestamp, type, payload, size);
+		m_timestampWriter.write(line, len);
+	}
+}
+
+//append the index of the segment, as a SEGMENT_INDEX frame ending with the trailer
+void FrameCollection::finishSegment()
+{
+	RecordingSegment& segment = m_segments.back();
+	segment.complete = true;
+	size_t payloadSize = m_segmentIndex.size() * sizeof(SegmentIndexEntry) + sizeof(SegmentIndexTrailer);
+	if(payloadSize > MaxFramePayloadLength)
+	{
+		OM_BLOG(LOG_ERROR, "Too many frames to index segment %s", segment.filename.c_str());
+		return;
+	}
+	SegmentIndexTrailer trailer;
+	memset(&trailer, 0, sizeof(trailer));
+	trailer.indexOffset = segment.size;
+	trailer.nbEntries = static_cast<uint32_t>(m_segmentIndex.size());
+	trailer.version = SegmentIndexVersion;
+	memcpy(trailer.magic, SegmentIndexMagic, sizeof(trailer.magic));
+
+	uint8_t header[sizeof(FrameHeader)];
+	fillFrameHeader(header, Frame::PayloadType::SEGMENT_INDEX, static_cast<uint32_t>(payloadSize));
+	m_recordingWriter.write(header, sizeof(header));
+	if(!m_segmentIndex.empty())
+		m_recordingWriter.write(&m_segmentIndex[0], m_segmentIndex.size() * sizeof(SegmentIndexEntry));
+	m_recordingWriter.write(&trailer, sizeof(trailer));
+	segment.size += sizeof(header) + payloadSize;
+	m_segmentIndex.clear();
+}
+
+std::string FrameCollection::getManifestFilename() const
+{
+	return m_recordingFolder + "/" + m_recordingName + ".questMRManifest";
+}
+
+void FrameCollection::formatManifest()
+{
+	char line[128];
+	snprintf(line, sizeof(line), "questMRManifest,%u\n", SegmentIndexVersion);
+	m_manifest = line;
+	for(size_t i = 0; i < m_segments.size(); i++)
+	{
+		const RecordingSegment& segment = m_segments[i];
+		m_manifest += segment.filename + ".questMRVideo," + segment.filename + "_questTimestamp.txt";
+		snprintf(line, sizeof(line), ",%llu,%llu,%d,%llu,%d\n",
+			static_cast<unsigned long long>(segment.firstTimestamp), static_cast<unsigned long long>(segment.lastTimestamp),
+			segment.nbFrames, static_cast<unsigned long long>(segment.size), segment.complete ? 1 : 0);
+		m_manifest += line;
+	}
+}
+
+//written by the writer thread after the data of the segments, at the next switchFile() or close()
+void FrameCollection::queueManifest()
+{
+	formatManifest();
+	m_recordingWriter.setSideFile(getManifestFilename().c_str(), m_manifest);
 }
 
 void FrameCollection::setRecordedTimestamp(const std::vector<uint64_t>& listTimestamp)
@@ -83,128 +518,265 @@ void FrameCollection::Reset()
 {
 	std::lock_guard<std::mutex> lock(m_frameMutex);
 
-	m_hasError = false;
-	m_scratchPad.clear();
+	m_resyncing = false;
+	m_resyncPending = false;
+	m_headerSize = 0;
+	m_currentFrame.reset();
+	m_payloadWritePtr = NULL;
+	m_payloadRemaining = 0;
 	m_frames.clear();
+	m_framePool.clear();//also releases the memory referenced by the payload views
 	m_firstFrameTimeSet = false;
 	recordedTimestampId = 0;
+	m_nbParsedFrames = 0;
+	m_lastDimensionPayload.clear();
+	m_lastSampleRatePayload.clear();
 
-	if(recordingFile != NULL)
-	{
-		fclose(recordingFile);
-		recordingFile = NULL;
-	}
-	if(timestampFile != NULL)
-	{
-		fclose(timestampFile);
-		timestampFile = NULL;
-	}
+	closeRecording();
 }
 
-void FrameCollection::AddData(const uint8_t* data, uint32_t len, uint64_t recv_timestamp)
+void FrameCollection::restartAt(int frameId)
 {
 	std::lock_guard<std::mutex> lock(m_frameMutex);
 
-	if (m_hasError)
-	{
-		return;
-	}
+	m_resyncing = false;
+	m_resyncPending = false;
+	m_headerSize = 0;
+	m_currentFrame.reset();
+	m_payloadWritePtr = NULL;
+	m_payloadRemaining = 0;
+	m_frames.clear();
+	recordedTimestampId = frameId;
+	m_nbParsedFrames = frameId;
+}
+
+void FrameCollection::AddData(const uint8_t* data, uint32_t len, uint64_t recv_timestamp, uint64_t recvTimeUs, const std::shared_ptr<const void>& dataOwner, size_t dataTailSize)
+{
+	std::lock_guard<std::mutex> lock(m_frameMutex);
 
 #if _DEBUG
 	OM_LOG(LOG_DEBUG, "FrameCollection::AddData, len = %u", len);
 #endif
-    if(recordingFile != NULL) {
-		//auto start = std::chrono::steady_clock::now();
-		fwrite(data, len, 1, recordingFile);
-		//auto end = std::chrono::steady_clock::now();
-		//printf("recording: %lf ms\n", std::chrono::duration_cast<std::chrono::microseconds>(end - start).count()/1000.0);
-	}
-
-	m_scratchPad.insert(m_scratchPad.end(), data, data + len);
+    if(m_recordingWriter.isOpen() && !m_segmentedRecording)
+		m_recordingWriter.write(data, len);
 
-	while (m_scratchPad.size() >= sizeof(FrameHeader))
+	while (len > 0)
 	{
-		FrameHeader frameHeader = readFrameHeader(m_scratchPad.data());
-		if (frameHeader.Magic != Magic)
+		if (m_resyncing)
 		{
-			OM_LOG(LOG_ERROR, "Frame magic mismatch: expected 0x%08x get 0x%08x", Magic, frameHeader->Magic);
-			m_hasError = true;
-			return;
+			size_t size = resync(data, len);
+			data += size;
+			len -= static_cast<uint32_t>(size);
 		}
-		uint32_t frameLengthExcludingMagic = frameHeader.TotalDataLengthExcludingMagic;
-		if (m_scratchPad.size() >= sizeof(uint32_t) + frameLengthExcludingMagic)
+		else if (m_currentFrame == nullptr)
 		{
-			if (frameHeader.PayloadLength != frameHeader.TotalDataLengthExcludingMagic + sizeof(uint32_t) - sizeof(FrameHeader))
+			//read the header in place when it is not split between two chunks
+			const uint8_t *headerData;
+			if (m_headerSize == 0 && len >= sizeof(FrameHeader))
 			{
-				OM_LOG(LOG_ERROR, "Frame length mismatch: length %u, payload length %u", frameHeader.TotalDataLengthExcludingMagic, frameHeader.PayloadLength);
-				m_hasError = true;
-				return;
+				headerData = data;
+				data += sizeof(FrameHeader);
+				len -= sizeof(FrameHeader);
+			}
+			else
+			{
+				uint32_t size = std::min(len, static_cast<uint32_t>(sizeof(FrameHeader) - m_headerSize));
+				memcpy(m_header + m_headerSize, data, size);
+				m_headerSize += size;
+				data += size;
+				len -= size;
+				if (m_headerSize < sizeof(FrameHeader))
+					break;
+				headerData = m_header;
+				m_headerSize = 0;
 			}
 
-			std::shared_ptr<Frame> frame = std::make_shared<Frame>();
-			frame->m_type = (Frame::PayloadType)frameHeader.PayloadType;
-			//frame->m_secondsSinceEpoch = frameHeader.SecondsSinceEpoch;
-			auto first = m_scratchPad.begin() + sizeof(FrameHeader);
-			auto last = first + frameHeader.PayloadLength;
-
-			if (m_scratchPad.size() >= sizeof(uint32_t) + frameHeader.TotalDataLengthExcludingMagic + sizeof(uint32_t))
+			FrameHeader frameHeader = readFrameHeader(headerData);
+			if (!isValidFrameHeader(frameHeader))
 			{
-				uint32_t* magic = (uint32_t*)&m_scratchPad.at(sizeof(uint32_t) + frameHeader.TotalDataLengthExcludingMagic);
-				if (*magic != Magic)
+				OM_LOG(LOG_ERROR, "Invalid frame header (magic 0x%08x, type %u, length %u, payload length %u), resynchronizing",
+					frameHeader.Magic, frameHeader.PayloadType, frameHeader.TotalDataLengthExcludingMagic, frameHeader.PayloadLength);
+				//the next header can start inside the invalid one, scan again from its second byte
+				if (headerData == m_header)
 				{
-					OM_LOG(LOG_ERROR, "Will have magic number error in next frame: current frame type %d, frame length %d, scratchPad size %d",
-						frame->m_type,
-						sizeof(uint32_t) + frameHeader.TotalDataLengthExcludingMagic,
-						m_scratchPad.size());
+					memmove(m_header, m_header + 1, sizeof(FrameHeader) - 1);
+					m_headerSize = sizeof(FrameHeader) - 1;
 				}
+				else
+				{
+					data -= sizeof(FrameHeader) - 1;
+					len += sizeof(FrameHeader) - 1;
+				}
+				startResync();
+				continue;
 			}
 
-			frame->m_payload.assign(first, last);
-			m_frames.push_back(frame);
-
-			if(recordedTimestamp.size() > 0) {
-                frame->localTimestamp = recordedTimestamp[std::min(recordedTimestampId, (int)recordedTimestamp.size()-1)];
-                recordedTimestampId++;
-            } else {
-            	frame->localTimestamp = recv_timestamp;
+			m_currentFrame = m_framePool.acquire();
+			m_currentFrame->m_type = (Frame::PayloadType)frameHeader.PayloadType;
+			//m_currentFrame->m_secondsSinceEpoch = frameHeader.SecondsSinceEpoch;
+			if (dataOwner != nullptr && len >= frameHeader.PayloadLength)
+			{
+				//the whole payload is in persistent memory : reference it in place
+				m_currentFrame->m_payload.setView(data, frameHeader.PayloadLength, dataOwner, len - frameHeader.PayloadLength + dataTailSize);
+				data += frameHeader.PayloadLength;
+				len -= frameHeader.PayloadLength;
+				m_payloadWritePtr = NULL;
+				m_payloadRemaining = 0;
 			}
-
-			if(timestampFile != NULL) {
-				fprintf(timestampFile, "%llu,%u,%u", static_cast<unsigned long long>(frame->localTimestamp), frameHeader.PayloadType,frameHeader.PayloadLength);
-				if(frameHeader.PayloadType == static_cast<uint32_t>(Frame::PayloadType::AUDIO_DATA)) {
-					uint64_t timestamp = convertBytesToUInt64(frame->m_payload.data(), false);
-					int32_t channels = convertBytesToInt32(frame->m_payload.data() + 8, false);
-					int32_t dataLength = convertBytesToInt32(frame->m_payload.data() + 12, false);
-					fprintf(timestampFile, ",%llu,%d,%d", static_cast<unsigned long long>(timestamp), channels, dataLength);
-				} else if(frameHeader.PayloadType == static_cast<uint32_t>(Frame::PayloadType::AUDIO_SAMPLERATE)) {
-					uint32_t sampleRate = *(uint32_t*)(frame->m_payload.data());
-					fprintf(timestampFile, ",%u", sampleRate);
-				} else if(frameHeader.PayloadType == static_cast<uint32_t>(Frame::PayloadType::VIDEO_DIMENSION)) {
-					int32_t w = convertBytesToInt32(frame->m_payload.data(), false);
-                	int32_t h = convertBytesToInt32(frame->m_payload.data() + 4, false);
-					fprintf(timestampFile, ",%d,%d", w, h);
-				}
-				fprintf(timestampFile, "\n");
+			else
+			{
+				m_payloadWritePtr = m_currentFrame->m_payload.allocate(frameHeader.PayloadLength);
+				m_payloadRemaining = frameHeader.PayloadLength;
 			}
+		}
+		else
+		{
+			uint32_t size = static_cast<uint32_t>(std::min(static_cast<size_t>(len), m_payloadRemaining));
+			memcpy(m_payloadWritePtr, data, size);
+			m_payloadWritePtr += size;
+			m_payloadRemaining -= size;
+			data += size;
+			len -= size;
+		}
 
-			if (!m_firstFrameTimeSet)
+		if (m_currentFrame != nullptr && m_payloadRemaining == 0)
+			completeFrame(recv_timestamp, recvTimeUs);
+	}
+}
+
+void FrameCollection::startResync()
+{
+	m_resyncing = true;
+	m_resyncSkippedBytes = 1;
+	m_nbResyncs++;
+	m_nbResyncSkippedBytes++;
+}
+
+//skip the data up to the next valid header, returns the number of bytes consumed.
+//When the header is found, m_resyncing is reset and the header is left to the normal parsing
+size_t FrameCollection::resync(const uint8_t *data, size_t len)
+{
+	size_t skipped = 0;
+	size_t consumed = len;
+	if (m_headerSize > 0)
+	{
+		//headers starting in the bytes kept from the previous chunk
+		uint8_t buffer[2*sizeof(FrameHeader)];
+		size_t bufferSize = m_headerSize + std::min(len, sizeof(FrameHeader));
+		size_t carrySize = m_headerSize;
+		memcpy(buffer, m_header, carrySize);
+		memcpy(buffer + carrySize, data, bufferSize - carrySize);
+		m_headerSize = 0;
+		size_t pos = 0;
+		for (; pos < carrySize; pos++)
+		{
+			size_t available = bufferSize - pos;
+			if (!matchesFrameMagic(buffer + pos, available))
+				continue;
+			if (available < sizeof(FrameHeader))
 			{
-				m_firstFrameTimeSet = true;
-				m_firstFrameTime = std::chrono::system_clock::now();
+				//not enough data to validate it, all the chunk is in buffer
+				memcpy(m_header, buffer + pos, available);
+				m_headerSize = available;
+				break;
+			}
+			if (isValidFrameHeader(readFrameHeader(buffer + pos)))
+			{
+				//keep the part of the header from the previous chunk, the rest is read from data
+				memcpy(m_header, buffer + pos, carrySize - pos);
+				m_headerSize = carrySize - pos;
+				m_resyncing = false;
+				consumed = 0;
+				break;
 			}
-#if _DEBUG
-			std::chrono::duration<double> timePassed = std::chrono::system_clock::now() - m_firstFrameTime;
-
-			static int frameIndex = 0;
-			OM_LOG(LOG_DEBUG, "[%f] new frame(%d) pushed, type %u, payload %u bytes", timePassed.count(), frameIndex++, frame->m_type, frame->m_payload.size());
-#endif
-			m_scratchPad.erase(m_scratchPad.begin(), last);
 		}
-		else
+		skipped = pos;
+	}
+	if (m_resyncing && m_headerSize == 0)
+	{
+		size_t pos = 0;
+		while (true)
 		{
-			break;
+			pos += findFrameMagic(data + pos, len - pos);
+			if (pos + sizeof(FrameHeader) > len)
+			{
+				//possible header cut by the end of the chunk
+				m_headerSize = len - pos;
+				memcpy(m_header, data + pos, m_headerSize);
+				skipped += pos;
+				break;
+			}
+			if (isValidFrameHeader(readFrameHeader(data + pos)))
+			{
+				m_resyncing = false;
+				skipped += pos;
+				consumed = pos;
+				break;
+			}
+			pos++;
 		}
 	}
+
+	m_resyncSkippedBytes += skipped;
+	m_nbResyncSkippedBytes += skipped;
+	if (!m_resyncing)
+	{
+		OM_LOG(LOG_INFO, "Resynchronized after skipping %llu bytes", static_cast<unsigned long long>(m_resyncSkippedBytes));
+		m_resyncPending = true;
+	}
+	return consumed;
+}
+
+void FrameCollection::completeFrame(uint64_t recv_timestamp, uint64_t recvTimeUs)
+{
+	std::shared_ptr<Frame> frame;
+	frame.swap(m_currentFrame);
+	m_payloadWritePtr = NULL;
+	//the index at the end of a recorded segment is not part of the stream
+	if(frame->m_type == Frame::PayloadType::SEGMENT_INDEX)
+		return;
+	frame->afterResync = m_resyncPending;
+	m_resyncPending = false;
+
+	//the frame is stamped with the reception of its last byte
+	frame->streamFrameId = m_nbParsedFrames++;
+	memset(frame->stageTimeUs, 0, sizeof(frame->stageTimeUs));
+	frame->stageTimeUs[QUEST_FRAME_STAGE_PARSED] = getMonotonicTimeUs();
+	frame->stageTimeUs[QUEST_FRAME_STAGE_RECV] = recvTimeUs != 0 ? recvTimeUs : frame->stageTimeUs[QUEST_FRAME_STAGE_PARSED];
+
+	if(recordedTimestamp.size() > 0) {
+		frame->localTimestamp = recordedTimestamp[std::min(recordedTimestampId, (int)recordedTimestamp.size()-1)];
+		recordedTimestampId++;
+	} else {
+		frame->localTimestamp = recv_timestamp;
+	}
+
+	//state repeated at the start of the next recording segments
+	if(frame->m_type == Frame::PayloadType::VIDEO_DIMENSION)
+		m_lastDimensionPayload.assign(frame->m_payload.data(), frame->m_payload.data() + frame->m_payload.size());
+	else if(frame->m_type == Frame::PayloadType::AUDIO_SAMPLERATE)
+		m_lastSampleRatePayload.assign(frame->m_payload.data(), frame->m_payload.data() + frame->m_payload.size());
+
+	if(m_segmentedRecording && m_recordingWriter.isOpen()) {
+		recordSegmentFrame(*frame);
+	} else if(m_timestampWriter.isOpen()) {
+		char line[128];
+		int len = formatTimestampLine(line, sizeof(line), frame->localTimestamp, frame->m_type, frame->m_payload.data(), frame->m_payload.size());
+		m_timestampWriter.write(line, len);
+	}
+
+	if (!m_firstFrameTimeSet)
+	{
+		m_firstFrameTimeSet = true;
+		m_firstFrameTime = std::chrono::system_clock::now();
+	}
+#if _DEBUG
+	std::chrono::duration<double> timePassed = std::chrono::system_clock::now() - m_firstFrameTime;
+
+	static int frameIndex = 0;
+	OM_LOG(LOG_DEBUG, "[%f] new frame(%d) pushed, type %u, payload %u bytes", timePassed.count(), frameIndex++, frame->m_type, frame->m_payload.size());
+#endif
+	m_frames.push(frame);
 }
 
 bool FrameCollection::HasCompletedFrame()
@@ -218,16 +790,7 @@ std::shared_ptr<Frame> FrameCollection::PopFrame()
 {
 	std::lock_guard<std::mutex> lock(m_frameMutex);
 
-	if (m_frames.size() > 0)
-	{
-		auto result = m_frames.front();
-		m_frames.pop_front();
-		return result;
-	}
-	else
-	{
-		return std::shared_ptr<Frame>(nullptr);
-	}
+	return m_frames.pop();
 }
 
 double FrameCollection::GetNbTickSinceFirstFrame() const
@@ -238,4 +801,61 @@ double FrameCollection::GetNbTickSinceFirstFrame() const
 	return timePassed.count();
 }
 
+extern "C"
+{
+	bool loadQuestRecordingManifest(const char *filename, std::vector<QuestRecordingSegment> *segments)
+	{
+		segments->clear();
+		std::ifstream input(filename);
+		std::string line;
+		if(!input.good() || !std::getline(input, line) || line.compare(0, 16, "questMRManifest,") != 0)
+			return false;
+		uint32_t version = static_cast<uint32_t>(strtoul(line.c_str() + 16, NULL, 10));
+		if(version != SegmentIndexVersion)
+		{
+			OM_BLOG(LOG_ERROR, "Unsupported manifest version %u in %s", version, filename);
+			return false;
+		}
+		//the segment filenames are relative to the manifest
+		std::string folder = filename;
+		size_t pos = folder.find_last_of("/\\");
+		folder = pos != std::string::npos ? folder.substr(0, pos + 1) : "";
+		static const std::string videoSuffix = ".questMRVideo,";
+		static const std::string timestampSuffix = "_questTimestamp.txt";
+		while(std::getline(input, line))
+		{
+			if(!line.empty() && line[line.size() - 1] == '\r')
+				line.resize(line.size() - 1);
+			//the 5 numeric fields are parsed from the end, the recording name can contain commas
+			size_t numbersPos = line.size();
+			for(int i = 0; i < 5 && numbersPos != std::string::npos; i++)
+				numbersPos = numbersPos > 0 ? line.rfind(',', numbersPos - 1) : std::string::npos;
+			if(numbersPos == std::string::npos)
+				break;
+			//name.questMRVideo,name_questTimestamp.txt : both filenames have the same name, so its length is known
+			std::string filenames = line.substr(0, numbersPos);
+			size_t fixedSize = videoSuffix.size() + timestampSuffix.size();
+			if(filenames.size() < fixedSize || (filenames.size() - fixedSize) % 2 != 0)
+				break;
+			size_t nameSize = (filenames.size() - fixedSize) / 2;
+			if(filenames.compare(nameSize, videoSuffix.size(), videoSuffix) != 0
+				|| filenames.compare(0, nameSize, filenames, nameSize + videoSuffix.size(), nameSize) != 0
+				|| filenames.compare(2 * nameSize + videoSuffix.size(), timestampSuffix.size(), timestampSuffix) != 0)
+				break;
+			const char *numbers = line.c_str() + numbersPos + 1;
+			char *next;
+			QuestRecordingSegment segment;
+			segment.videoFilename = folder + filenames.substr(0, nameSize + videoSuffix.size() - 1);
+			segment.timestampFilename = folder + filenames.substr(nameSize + videoSuffix.size());
+			segment.firstTimestamp = strtoull(numbers, &next, 10);
+			segment.lastTimestamp = strtoull(next + 1, &next, 10);
+			segment.nbFrames = static_cast<int>(strtol(next + 1, &next, 10));
+			segment.size = strtoull(next + 1, &next, 10);
+			segment.complete = strtol(next + 1, &next, 10) != 0;
+			segments->push_back(segment);
+		}
+		return true;
+	}
+}
+
 }
@@ -19,17 +19,32 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 #pragma once
 
 #include <libQuestMR/config.h>
+#include <libQuestMR/QuestVideoMngr.h>
 
 #include <stdint.h>
 #include <memory>
+#include <string>
 #include <vector>
-#include <list>
 #include <mutex>
+#include <atomic>
+#include <chrono>
 #include <cassert>
+#include "RecordingWriter.h"
 
 namespace libQuestMR
 {
 
+//steady clock time in microseconds, used for the latency tracing
+inline uint64_t getMonotonicTimeUs()
+{
+	return std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+//first 4 bytes of each frame of the MRC stream
+const uint32_t FrameMagic = 0x2877AF94;
+//larger payloads are considered as corrupted data
+const uint32_t MaxFramePayloadLength = 64*1024*1024;
+
 struct FrameHeader
 {
 	uint32_t Magic;
@@ -39,18 +54,158 @@ struct FrameHeader
 	uint32_t PayloadLength;
 };
 
+//zeroed bytes after the payloads stored in FramePayload, so that the decoder can use them in place
+//(at least AV_INPUT_BUFFER_PADDING_SIZE)
+const size_t FramePayloadPadding = 64;
+
+//Payload of a frame, the storage is kept between frames so that a recycled frame does not reallocate.
+//The payload can also be a view of memory owned by the source (memory-mapped file), kept alive by m_owner.
+class FramePayload
+{
+public:
+	FramePayload()
+		:m_data(NULL), m_size(0), m_viewTailSize(0)
+	{
+	}
+
+	const uint8_t *data() const
+	{
+		return m_data;
+	}
+
+	size_t size() const
+	{
+		return m_size;
+	}
+
+	//resize the storage (reusing its capacity) and return a pointer to write the payload
+	uint8_t *allocate(size_t size);
+
+	//reference the data without copy, owner keeps it valid and tailSize more bytes readable after it
+	void setView(const uint8_t *data, size_t size, const std::shared_ptr<const void>& owner, size_t tailSize = 0);
+
+	//true if FramePayloadPadding bytes can be read after the payload, so that the decoder can use it in place :
+	//zeroed bytes after the storage, the next bytes of the owner for views (except at the end of a memory-mapped file)
+	bool hasPadding() const
+	{
+		return m_data != NULL && (m_owner == nullptr || m_viewTailSize >= FramePayloadPadding);
+	}
+
+	//memory kept alive by a view, NULL for the storage
+	const std::shared_ptr<const void>& owner() const
+	{
+		return m_owner;
+	}
+
+	void clear();
+
+private:
+	FramePayload(const FramePayload&);
+	FramePayload& operator=(const FramePayload&);
+
+	std::vector<uint8_t> m_storage;
+	const uint8_t *m_data;
+	size_t m_size;
+	size_t m_viewTailSize;//readable bytes after a view
+	std::shared_ptr<const void> m_owner;
+};
+
 struct Frame
 {
+	Frame();
+	~Frame();
+
 	enum class PayloadType : uint32_t {
 		VIDEO_DIMENSION = 10,
 		VIDEO_DATA = 11,
 		AUDIO_SAMPLERATE = 12,
 		AUDIO_DATA = 13,
+		SEGMENT_INDEX = 100,//footer of a recording segment, not returned by the FrameCollection
 	};
 	PayloadType m_type;
 	//double m_secondsSinceEpoch;
     uint64_t localTimestamp;
-	std::vector<uint8_t> m_payload;
+	int streamFrameId;//position of the frame in the stream (first frame : 0)
+	bool afterResync;//first frame after corrupted data was skipped, the decoder must restart from a keyframe
+	uint64_t stageTimeUs[QUEST_FRAME_STAGE_COUNT];//steady clock time at each QuestFrameStage, 0 if not reached
+	FramePayload m_payload;
+#ifdef LIBQUESTMR_USE_FFMPEG
+	//reference to the storage of the payload given to the decoder, created once and pointed to the next payloads.
+	//The frame must not be recycled while the decoder holds other references to it
+	AVBufferRef *decoderBuf;
+#endif
+
+private:
+	Frame(const Frame&);
+	Frame& operator=(const Frame&);
+};
+
+//true if the H.264 access unit (Annex-B) starts an IDR picture, decoding can restart from it
+bool isH264KeyFrame(const uint8_t *data, size_t size);
+
+//Segmented recordings : each segment starts with the VIDEO_DIMENSION/AUDIO_SAMPLERATE frames and an IDR frame,
+//and ends with a SEGMENT_INDEX frame whose payload is the index of the segment followed by a SegmentIndexTrailer,
+//so the index is found from the end of the file. A segment without footer (crash) is still a valid recording.
+const uint32_t SegmentIndexVersion = 1;
+const char SegmentIndexMagic[8] = {'Q', 'M', 'R', 'S', 'E', 'G', 'I', 'X'};
+
+//one per frame of the segment, native byte order (little-endian on all the supported platforms)
+struct SegmentIndexEntry
+{
+	uint64_t offset;//position of the frame header in the segment
+	uint64_t localTimestamp;
+	uint32_t payloadType;
+	uint32_t payloadLength;
+	uint32_t param0;//VIDEO_DATA : 1 if keyframe, VIDEO_DIMENSION : width, AUDIO_SAMPLERATE : sample rate
+	uint32_t param1;//VIDEO_DIMENSION : height
+};
+
+//last bytes of a completed segment
+struct SegmentIndexTrailer
+{
+	uint64_t indexOffset;//position of the SEGMENT_INDEX frame header
+	uint32_t nbEntries;
+	uint32_t version;
+	char magic[8];
+};
+
+//Recycles the frames once the consumer has released them.
+//A frame is free when the pool holds the only reference to it.
+class FramePool
+{
+public:
+	FramePool();
+
+	std::shared_ptr<Frame> acquire();
+
+	void clear();
+
+private:
+	std::vector<std::shared_ptr<Frame> > m_frames;
+	size_t m_nextId;
+};
+
+//FIFO of frames stored in a circular vector, so that the steady state does not allocate
+class FrameQueue
+{
+public:
+	FrameQueue();
+
+	size_t size() const
+	{
+		return m_size;
+	}
+
+	void push(const std::shared_ptr<Frame>& frame);
+
+	std::shared_ptr<Frame> pop();
+
+	void clear();
+
+private:
+	std::vector<std::shared_ptr<Frame> > m_frames;
+	size_t m_first;
+	size_t m_size;
 };
 
 //typedef std::vector<uint8_t> Frame;
@@ -65,50 +220,148 @@ public:
 	FrameCollection(FrameCollection const&) = delete;
     FrameCollection& operator=(FrameCollection const&) = delete;
     
-    FrameHeader readFrameHeader(unsigned char *data) const;
+    static FrameHeader readFrameHeader(const unsigned char *data);
+	//magic, payload type and length fields are consistent
+	static bool isValidFrameHeader(const FrameHeader& frameHeader);
 
 	void Reset();
 
+	//drop the buffered data and continue with frame frameId of the stream (after seeking the source to it),
+	//the recording and the recorded timestamps are kept
+	void restartAt(int frameId);
+
 	bool isRecording() const;
 
 	void setRecording(const char *folder, const char *filenameWithoutExt);
+	//buffers of the recording writer thread, for the next setRecording()
+	void setRecordingBuffers(int nbBuffers, size_t bufferSize, bool directIO);
+	//for the next setRecording() : start a new segment at the first keyframe after maxSegmentSize bytes
+	//or maxSegmentDurationMs. 0 for both : a single file with the data as received
+	void setRecordingSegments(uint64_t maxSegmentSize, int maxSegmentDurationMs);
+	//thread-safe
+	const RecordingWriter& getRecordingWriter() const
+	{
+		return m_recordingWriter;
+	}
 
 	void setRecordedTimestamp(const std::vector<uint64_t>& listTimestamp);
 
-	void AddData(const uint8_t* data, uint32_t len, uint64_t recv_timestamp);
+	//true if the frame timestamps come from setRecordedTimestamp() instead of the reception time
+	bool useRecordedTimestamp() const
+	{
+		return !recordedTimestamp.empty();
+	}
+
+	const std::vector<uint64_t>& getRecordedTimestamp() const
+	{
+		return recordedTimestamp;
+	}
+
+	//if dataOwner is not NULL, the data stays valid while dataOwner is alive,
+	//and the payloads fully contained in data are referenced instead of copied.
+	//dataTailSize : number of bytes of dataOwner still readable after data + len
+	void AddData(const uint8_t* data, uint32_t len, uint64_t recv_timestamp, uint64_t recvTimeUs = 0, const std::shared_ptr<const void>& dataOwner = std::shared_ptr<const void>(), size_t dataTailSize = 0);
 
 	bool HasCompletedFrame();
 
 	std::shared_ptr<Frame> PopFrame();
 
-	bool HasError() const
+	//true while skipping corrupted data, until the next valid frame header
+	bool IsResyncing() const
 	{
-		return m_hasError;
+		return m_resyncing;
 	}
 
 	bool HasFirstFrame() const
 	{
-		return m_firstFrameTimeSet && !m_hasError;
+		return m_firstFrameTimeSet && !m_resyncing;
+	}
+
+	//thread-safe
+	uint64_t GetNbResyncs() const
+	{
+		return m_nbResyncs;
+	}
+
+	//thread-safe
+	uint64_t GetNbResyncSkippedBytes() const
+	{
+		return m_nbResyncSkippedBytes;
 	}
 
 	double GetNbTickSinceFirstFrame() const;
 
 private:
-	uint32_t Magic = 0x2877AF94;
+	void closeRecording();
+	void recordSegmentFrame(const Frame& frame);
+	void writeSegmentFrame(uint64_t timestamp, Frame::PayloadType type, const uint8_t *payload, size_t size, bool keyFrame);
+	void finishSegment();
+	bool startSegment();
+	void formatManifest();
+	void queueManifest();
+	std::string getManifestFilename() const;
+	void completeFrame(uint64_t recv_timestamp, uint64_t recvTimeUs);
+	void startResync();
+	size_t resync(const uint8_t *data, size_t len);
+
+	uint32_t Magic = FrameMagic;
 
 	bool m_firstFrameTimeSet = false;
 
-	bool m_hasError;
+	//after a corrupted header, the data is skipped up to the next valid header.
+	//During the resync, m_header holds the end of the previous chunk, where a header may start
+	bool m_resyncing;
+	bool m_resyncPending;//the next completed frame is the first one after a resync
+	uint64_t m_resyncSkippedBytes;//bytes skipped by the current resync
+	std::atomic<uint64_t> m_nbResyncs;
+	std::atomic<uint64_t> m_nbResyncSkippedBytes;
 
-	FILE *recordingFile;
-	FILE *timestampFile;
+	//the recording and the timestamp file are written by their own threads, AddData() only copies the data
+	RecordingWriter m_recordingWriter;
+	RecordingWriter m_timestampWriter;
+	int m_recordingNbBuffers;
+	size_t m_recordingBufferSize;
+	bool m_recordingDirectIO;
+
+	//segmented recording, the frames are written one by one instead of the received data
+	struct RecordingSegment
+	{
+		std::string filename;//without folder
+		uint64_t firstTimestamp;
+		uint64_t lastTimestamp;
+		int nbFrames;
+		uint64_t size;
+		bool complete;
+	};
+	uint64_t m_maxSegmentSize;
+	int m_maxSegmentDurationMs;
+	bool m_segmentedRecording;
+	bool m_segmentWaitingForKeyFrame;//the first segment starts at the first keyframe
+	std::string m_recordingFolder;
+	std::string m_recordingName;
+	std::vector<RecordingSegment> m_segments;
+	std::vector<SegmentIndexEntry> m_segmentIndex;
+	std::string m_manifest;//formatted by the receive thread, written by the writer thread
+	//payloads of the last VIDEO_DIMENSION and AUDIO_SAMPLERATE frames, repeated at the start of each segment
+	std::vector<uint8_t> m_lastDimensionPayload;
+	std::vector<uint8_t> m_lastSampleRatePayload;
 
 	std::vector<uint64_t> recordedTimestamp;
     int recordedTimestampId;
+	int m_nbParsedFrames;
 
 	std::chrono::time_point<std::chrono::system_clock> m_firstFrameTime;
-	std::vector<uint8_t> m_scratchPad;
-	std::list<std::shared_ptr<Frame>> m_frames;
+
+	//parser state : the header is accumulated in m_header only when it is split between two chunks,
+	//the payload is written directly in the frame obtained from the pool
+	uint8_t m_header[sizeof(FrameHeader)];
+	size_t m_headerSize;
+	std::shared_ptr<Frame> m_currentFrame;
+	uint8_t *m_payloadWritePtr;
+	size_t m_payloadRemaining;
+
+	FramePool m_framePool;
+	FrameQueue m_frames;
 	std::mutex m_frameMutex;
 };
 